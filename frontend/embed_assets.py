@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""Gzip the frontend and write it out as a C table for main/frontend_assets.h
+
+Usage: embed_assets.py OUTPUT.c INDEX [ASSET...]
+
+INDEX is served at /, every other asset at /<file name>. The gzip header
+carries no timestamp or name, so the output and its ETags only change when
+an asset's content does.
+"""
+
+import gzip
+import hashlib
+import os
+import sys
+
+CONTENT_TYPES = {
+    ".html": "text/html; charset=utf-8",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".svg": "image/svg+xml",
+    ".png": "image/png",
+    ".ico": "image/x-icon",
+}
+
+
+def c_bytes(data):
+    lines = []
+    for start in range(0, len(data), 12):
+        chunk = data[start : start + 12]
+        lines.append("    " + ", ".join("0x%02x" % b for b in chunk) + ",")
+    return "\n".join(lines)
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit(__doc__)
+    output, paths = sys.argv[1], sys.argv[2:]
+
+    arrays = []
+    entries = []
+    for index, path in enumerate(paths):
+        name = os.path.basename(path)
+        extension = os.path.splitext(name)[1]
+        if extension not in CONTENT_TYPES:
+            sys.exit("%s: unknown content type for %s" % (sys.argv[0], path))
+
+        with open(path, "rb") as f:
+            data = gzip.compress(f.read(), compresslevel=9, mtime=0)
+        etag = '\\"%s\\"' % hashlib.sha256(data).hexdigest()[:16]
+        uri = "/" if index == 0 else "/" + name
+
+        arrays.append(
+            "// %s\nstatic const uint8_t asset_%d[] = {\n%s\n};\n"
+            % (name, index, c_bytes(data))
+        )
+        entries.append(
+            '    {"%s", "%s", "%s", asset_%d, sizeof(asset_%d)},'
+            % (uri, CONTENT_TYPES[extension], etag, index, index)
+        )
+
+    source = "// Generated by frontend/embed_assets.py, do not edit\n\n"
+    source += '#include "frontend_assets.h"\n\n'
+    source += "\n".join(arrays)
+    source += "\nconst frontend_asset frontend_assets[] = {\n"
+    source += "\n".join(entries)
+    source += "\n};\n\n"
+    source += "const size_t frontend_asset_count = %d;\n" % len(paths)
+
+    with open(output, "w") as f:
+        f.write(source)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,418 @@
+let socket;
+const logEl = document.getElementById("log");
+const statusEl = document.getElementById("status");
+
+const offButton = document.getElementById("off");
+const autonomousButton = document.getElementById("autonomous");
+const manualButton = document.getElementById("manual");
+const buttons = [offButton, autonomousButton, manualButton];
+
+const roleEl = document.getElementById("role");
+const controlButton = document.getElementById("control");
+// Only one client drives at a time, the firmware tells us when that's us
+let role = "spectator";
+
+// Binary protocol, see main/protocol.h
+const PROTOCOL_VERSION = 1;
+const MSG_HEARTBEAT = 0x00;
+const MSG_POSITION = 0x01;
+const MSG_MODE = 0x02;
+const MSG_CONTROL = 0x03;
+const MSG_TELEMETRY = 0x80;
+const MSG_SESSION = 0x81;
+const MODES = ["off", "autonomous", "manual"];
+const ROLES = ["spectator", "operator"];
+
+function encode_message(payload) {
+  if (payload.position) {
+    const view = new DataView(new ArrayBuffer(6));
+    view.setUint8(0, PROTOCOL_VERSION);
+    view.setUint8(1, MSG_POSITION);
+    view.setInt16(2, Math.round(payload.position.x * 100), true);
+    view.setInt16(4, Math.round(payload.position.y * 100), true);
+    return view.buffer;
+  } else if (payload.mode) {
+    const view = new DataView(new ArrayBuffer(3));
+    view.setUint8(0, PROTOCOL_VERSION);
+    view.setUint8(1, MSG_MODE);
+    view.setUint8(2, MODES.indexOf(payload.mode));
+    return view.buffer;
+  } else if (payload.control !== undefined) {
+    const view = new DataView(new ArrayBuffer(3));
+    view.setUint8(0, PROTOCOL_VERSION);
+    view.setUint8(1, MSG_CONTROL);
+    view.setUint8(2, payload.control ? 1 : 0);
+    return view.buffer;
+  } else {
+    const view = new DataView(new ArrayBuffer(4));
+    view.setUint8(0, PROTOCOL_VERSION);
+    view.setUint8(1, MSG_HEARTBEAT);
+    view.setUint16(2, payload.sequence, true);
+    return view.buffer;
+  }
+}
+
+function decode_message(buffer) {
+  const view = new DataView(buffer);
+  if (
+    view.byteLength >= 3 &&
+    view.getUint8(0) == PROTOCOL_VERSION &&
+    view.getUint8(1) == MSG_SESSION
+  ) {
+    return { role: ROLES[view.getUint8(2)] };
+  }
+  if (
+    view.byteLength < 9 ||
+    view.getUint8(0) != PROTOCOL_VERSION ||
+    view.getUint8(1) != MSG_TELEMETRY
+  ) {
+    return null;
+  }
+
+  const message = {
+    left: view.getInt16(2, true) / 100,
+    right: view.getInt16(4, true) / 100,
+    front_distance: view.getUint16(6, true) / 10,
+    mode: MODES[view.getUint8(8)],
+  };
+  // Remaining sensors follow the mode, when the firmware has them
+  const sensors = ["front_left", "front_right", "rear"];
+  sensors.forEach((sensor, i) => {
+    if (view.byteLength >= 11 + i * 2) {
+      message[`${sensor}_distance`] = view.getUint16(9 + i * 2, true) / 10;
+    }
+  });
+  // Then what the speed loop is aiming for, measured speeds are above
+  if (view.byteLength >= 19) {
+    message.left_target = view.getInt16(15, true) / 100;
+    message.right_target = view.getInt16(17, true) / 100;
+  }
+  // And how the firmware sees the driving client's link
+  if (view.byteLength >= 24 && view.getUint16(19, true) != 0xffff) {
+    message.link = {
+      age: view.getUint16(19, true),
+      jitter: view.getUint16(21, true),
+      loss: view.getUint8(23),
+    };
+  }
+  // Then where odometry thinks the robot is, in cm and radians
+  if (view.byteLength >= 30) {
+    message.x = view.getInt16(24, true) / 10;
+    message.y = view.getInt16(26, true) / 10;
+    message.theta = view.getInt16(28, true) / 1000;
+  }
+  return message;
+}
+
+function connect() {
+  socket = new WebSocket(`ws://${location.hostname}/websocket`);
+  socket.binaryType = "arraybuffer";
+
+  socket.addEventListener("open", (event) => {
+    logEl.innerText = "Connected!";
+    // A new socket is a new session, control has to be taken again
+    set_role("spectator");
+    // Registers us for pushed telemetry
+    send_heartbeat();
+  });
+
+  socket.addEventListener("error", (event) => {
+    console.log(event);
+    logEl.innerText = "Connection failed :(";
+    connect();
+  });
+
+  socket.onmessage = (event) => {
+    const data =
+      typeof event.data === "string"
+        ? JSON.parse(event.data)
+        : decode_message(event.data);
+    if (data === null) {
+      return;
+    }
+    if (data.role !== undefined) {
+      set_role(data.role);
+      return;
+    }
+
+    statusEl.innerText = `Left ${data.left.toFixed(
+      0
+    )}, Right: ${data.right.toFixed(
+      0
+    )}, Front: ${data.front_distance.toFixed(0)}`;
+    if (data.rear_distance !== undefined) {
+      statusEl.innerText += `, Front left: ${data.front_left_distance.toFixed(
+        0
+      )}, Front right: ${data.front_right_distance.toFixed(
+        0
+      )}, Rear: ${data.rear_distance.toFixed(0)}`;
+    }
+    if (data.left_target !== undefined) {
+      statusEl.innerText += `, Target: ${data.left_target.toFixed(
+        0
+      )}/${data.right_target.toFixed(0)}`;
+    }
+    if (data.link !== undefined) {
+      statusEl.innerText += `, Link: ${data.link.age}ms old, ${data.link.jitter}ms jitter, ${data.link.loss}% lost`;
+    }
+
+    if (data.x !== undefined) {
+      statusEl.innerText += `, Pose: ${data.x.toFixed(
+        0
+      )}, ${data.y.toFixed(0)} cm, ${(
+        (data.theta * 180) /
+        Math.PI
+      ).toFixed(0)}°`;
+      add_path_point(data);
+    }
+
+    for (const button of buttons) {
+      if (button.id == data.mode) {
+        button.classList.add("selected");
+      } else {
+        button.classList.remove("selected");
+      }
+    }
+  };
+}
+
+// Recent poses, oldest first
+const MAX_PATH_POINTS = 2000;
+const pathEl = document.getElementById("path");
+let path = [];
+
+function add_path_point(pose) {
+  const last = path[path.length - 1];
+  // Telemetry repeats while the robot stands still
+  if (last && last.x == pose.x && last.y == pose.y) {
+    last.theta = pose.theta;
+  } else {
+    path.push({ x: pose.x, y: pose.y, theta: pose.theta });
+    if (path.length > MAX_PATH_POINTS) {
+      path.shift();
+    }
+  }
+  draw_path();
+}
+
+function draw_path() {
+  const ctx = pathEl.getContext("2d");
+  const size = pathEl.width;
+  ctx.clearRect(0, 0, size, size);
+
+  // Fit everything visited so far, keeping at least a 2 m square
+  let extent = 100;
+  for (const point of path) {
+    extent = Math.max(extent, Math.abs(point.x), Math.abs(point.y));
+  }
+  const scale = (size / 2 - 10) / extent;
+  // Flip y so counter-clockwise turns look counter-clockwise
+  const toCanvas = (point) => [
+    size / 2 + point.x * scale,
+    size / 2 - point.y * scale,
+  ];
+
+  ctx.strokeStyle = "purple";
+  ctx.beginPath();
+  path.forEach((point, i) => {
+    const [x, y] = toCanvas(point);
+    if (i == 0) {
+      ctx.moveTo(x, y);
+    } else {
+      ctx.lineTo(x, y);
+    }
+  });
+  ctx.stroke();
+
+  const robot = path[path.length - 1];
+  if (robot) {
+    const [x, y] = toCanvas(robot);
+    ctx.fillStyle = "black";
+    ctx.beginPath();
+    ctx.arc(x, y, 4, 0, 2 * Math.PI);
+    ctx.fill();
+    ctx.beginPath();
+    ctx.moveTo(x, y);
+    ctx.lineTo(x + 12 * Math.cos(robot.theta), y - 12 * Math.sin(robot.theta));
+    ctx.stroke();
+  }
+}
+
+function set_role(newRole) {
+  role = newRole;
+  const driving = role == "operator";
+  roleEl.innerText = driving ? "Driving" : "Watching";
+  controlButton.innerText = driving ? "Release control" : "Take control";
+}
+
+function bind_events() {
+  const remote = document.getElementById("remote");
+  let dragStart = null;
+
+  const start = (event) => {
+    event.preventDefault();
+
+    console.log("start");
+
+    if (event.changedTouches) {
+      dragStart = {
+        x: event.changedTouches[0].clientX,
+        y: event.changedTouches[0].clientY,
+      };
+    } else {
+      dragStart = {
+        x: event.clientX,
+        y: event.clientY,
+      };
+    }
+  };
+
+  // Convert raw pixel diff to percentage
+  const normalizePosition = (rawPosition) => {
+    // Assuming box is square for simplicity
+    const boxSize = remote.clientWidth;
+    // Make range slightly smaller than box so starting exactly in center is unnecessary
+    const range = boxSize / 2.5;
+
+    const percentage = (rawPosition / range) * 100;
+
+    if (percentage < 0) {
+      return Math.max(percentage, -100);
+    } else {
+      return Math.min(percentage, 100);
+    }
+  };
+
+  const move = (event) => {
+    if (dragStart === null) {
+      return;
+    }
+
+    const { clientX, clientY } =
+      (event.changedTouches && event.changedTouches[0]) || event;
+
+    const xPos = clientX - dragStart.x;
+    // Flipping sign on Y because screen coordinates start at top
+    const yPos = -(clientY - dragStart.y);
+
+    const x = normalizePosition(xPos);
+    const y = normalizePosition(yPos);
+
+    console.log("Moved to", [x, y]);
+    socket_send({ position: { x: x, y: y } });
+  };
+
+  const end = (event) => {
+    console.log("end");
+
+    dragStart = null;
+    socket_send({ position: { x: 0, y: 0 } });
+  };
+
+  const changeMode = (event) => {
+    const el = event.currentTarget;
+    socket_send({ mode: el.id });
+  };
+
+  const throttledMove = throttle(move, 20);
+  remote.addEventListener("touchstart", start);
+  remote.addEventListener("mousedown", start);
+  document.addEventListener("mousemove", throttledMove);
+  document.addEventListener("touchmove", throttledMove);
+  document.addEventListener("mouseup", end);
+  document.addEventListener("touchend", end);
+
+  for (const button of buttons) {
+    button.addEventListener("click", changeMode);
+  }
+
+  controlButton.addEventListener("click", () => {
+    socket_send({ control: role != "operator" });
+  });
+}
+
+// Tunable parameters, see main/params.h. Changes apply on the robot as soon
+// as they are sent and survive a reboot. Clearing a field restores the
+// default.
+const paramsEl = document.getElementById("params");
+
+function render_params(params) {
+  paramsEl.innerHTML = "";
+  for (const param of params) {
+    const row = paramsEl.insertRow();
+    row.insertCell().innerText = param.name;
+
+    const input = document.createElement("input");
+    input.type = "number";
+    input.min = param.min;
+    input.max = param.max;
+    input.step = param.type == "int" ? 1 : "any";
+    input.value = param.value;
+    input.placeholder = param.default;
+    input.title = `${param.min} to ${param.max}, default ${param.default}`;
+    input.addEventListener("change", () => {
+      const value = input.value === "" ? null : Number(input.value);
+      update_params({ [param.name]: value }, input);
+    });
+    row.insertCell().appendChild(input);
+  }
+}
+
+function update_params(changes, input) {
+  fetch("params", { method: "POST", body: JSON.stringify(changes) })
+    .then((response) => {
+      input.classList.toggle("invalid", !response.ok);
+      return response.ok ? response.json() : null;
+    })
+    .then((params) => params && render_params(params))
+    .catch((error) => console.log("Updating parameters failed", error));
+}
+
+function load_params() {
+  fetch("params")
+    .then((response) => response.json())
+    .then(render_params)
+    .catch((error) => console.log("Loading parameters failed", error));
+}
+
+function socket_send(payload) {
+  if (socket.readyState == WebSocket.OPEN) {
+    socket.send(encode_message(payload));
+  }
+}
+
+// The firmware stops the robot if the driver goes quiet, see
+// CONFIG_ROBOT_LINK_TIMEOUT_MS
+const HEARTBEAT_PERIOD_MS = 100;
+let heartbeatSequence = 0;
+
+function send_heartbeat() {
+  socket_send({ sequence: heartbeatSequence });
+  heartbeatSequence = (heartbeatSequence + 1) & 0xffff;
+}
+
+function throttle(func, limit) {
+  let lastFunc;
+  let lastRan;
+  return function () {
+    const context = this;
+    const args = arguments;
+    if (!lastRan) {
+      func.apply(context, args);
+      lastRan = Date.now();
+    } else {
+      clearTimeout(lastFunc);
+      lastFunc = setTimeout(function () {
+        if (Date.now() - lastRan >= limit) {
+          func.apply(context, args);
+          lastRan = Date.now();
+        }
+      }, limit - (Date.now() - lastRan));
+    }
+  };
+}
+
+connect();
+bind_events();
+load_params();
+setInterval(send_heartbeat, HEARTBEAT_PERIOD_MS);
@@ -0,0 +1,552 @@
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "controller.h"
+#include "distance_filter.h"
+#include "episode.h"
+#if BENCH_JSON_PROTOCOL
+#include "json_protocol.h"
+#endif
+#include "params.h"
+#include "protocol.h"
+#include "ultrasonic.h"
+#include "world.h"
+
+// Benchmarks of the controller's hot paths and of autonomous driving,
+// reported as one JSON document for release gating
+//
+// Micro benchmarks time each path on this machine in batches and report the
+// median and fastest batch, which shrug off the odd preemption. Scenario
+// results come from the simulator's virtual clock, so they only change when
+// the firmware's behavior does.
+//
+// Given a baseline written by an earlier run, every result is compared
+// against it and the exit status is 3 if any got worse by more than the
+// tolerance, or has no baseline to compare with. Gating needs the JSON
+// protocol benchmarks, so a build without cJSON refuses a baseline.
+
+#define BENCH_BATCHES 11
+#define BENCH_ITERATIONS 200000
+// Distinct inputs each micro benchmark cycles through, a power of two
+#define BENCH_INPUTS 256
+
+typedef struct {
+  const char *name;
+  // What on the robot this stands in for
+  const char *covers;
+  // Run iterations times, returning something derived from every result so
+  // none of the work can be optimized out
+  uint32_t (*run)(uint32_t iterations);
+} micro_benchmark;
+
+typedef struct {
+  double median_ns;
+  double min_ns;
+} micro_result;
+
+static uint8_t position_frames[BENCH_INPUTS][POSITION_MSG_LEN];
+static telemetry telemetry_states[BENCH_INPUTS];
+static float positions[BENCH_INPUTS][2];
+static sensor_state sensor_views[BENCH_INPUTS];
+static float samples[BENCH_INPUTS];
+#if BENCH_JSON_PROTOCOL
+// Room for a position object as the frontend sends it
+#define JSON_FRAME_LEN 64
+static char json_frames[BENCH_INPUTS][JSON_FRAME_LEN];
+static controller_snapshot snapshots[BENCH_INPUTS];
+#endif
+
+static float uniform(float low, float high) {
+  return low + (high - low) * rand() / (float)RAND_MAX;
+}
+
+static void prepare_inputs() {
+  srand(1);
+  for (int i = 0; i < BENCH_INPUTS; i++) {
+    int16_t x = (int16_t)uniform(-10000, 10000);
+    int16_t y = (int16_t)uniform(-10000, 10000);
+    uint8_t *frame = position_frames[i];
+    frame[0] = PROTOCOL_VERSION;
+    frame[1] = msg_position;
+    frame[2] = x & 0xff;
+    frame[3] = (uint16_t)x >> 8;
+    frame[4] = y & 0xff;
+    frame[5] = (uint16_t)y >> 8;
+
+    telemetry *state = &telemetry_states[i];
+    state->left_speed = uniform(-100, 100);
+    state->right_speed = uniform(-100, 100);
+    state->left_target = uniform(-100, 100);
+    state->right_target = uniform(-100, 100);
+    for (int sensor = 0; sensor < SENSOR_COUNT; sensor++) {
+      state->distances[sensor] = uniform(2, ULTRASONIC_MAX_RANGE_CM);
+    }
+    state->mode = mode_manual;
+    state->link_age_ms = uniform(0, 500);
+    state->link_jitter_ms = uniform(0, 50);
+    state->link_loss_percent = uniform(0, 10);
+    state->odometry = (pose){uniform(-1000, 1000), uniform(-1000, 1000),
+                             uniform(-3.14f, 3.14f)};
+
+    positions[i][X_IDX] = uniform(-100, 100);
+    positions[i][Y_IDX] = uniform(-100, 100);
+    for (int sensor = 0; sensor < SENSOR_COUNT; sensor++) {
+      sensor_views[i].distances[sensor] = uniform(2, ULTRASONIC_MAX_RANGE_CM);
+      sensor_views[i].distance_rates[sensor] = uniform(-200, 200);
+    }
+
+#if BENCH_JSON_PROTOCOL
+    snprintf(json_frames[i], JSON_FRAME_LEN,
+             "{\"position\":{\"x\":%.6g,\"y\":%.6g}}", x / 100.0,
+             y / 100.0);
+    snapshots[i] = (controller_snapshot){
+        .left_speed = state->left_speed,
+        .right_speed = state->right_speed,
+        .odometry = state->odometry,
+        .remote = {.mode = mode_manual}};
+    snapshots[i].sensors.distances[sensor_front] =
+        state->distances[sensor_front];
+#endif
+
+    // A wall 1 m away with sensor noise and the odd stray echo
+    samples[i] = i % 17 == 0 ? uniform(2, ULTRASONIC_MAX_RANGE_CM)
+                             : 100 + uniform(-3, 3);
+  }
+}
+
+// Inbound position frame, the bulk of WebSocket traffic
+static uint32_t bench_decode(uint32_t iterations) {
+  uint32_t sum = 0;
+  remote_event event;
+  for (uint32_t i = 0; i < iterations; i++) {
+    if (protocol_decode(position_frames[i % BENCH_INPUTS], POSITION_MSG_LEN,
+                        &event) == ESP_OK) {
+      sum += (uint32_t)event.new_position[X_IDX];
+    }
+  }
+  return sum;
+}
+
+static uint32_t bench_encode_telemetry(uint32_t iterations) {
+  uint32_t sum = 0;
+  uint8_t buf[TELEMETRY_MSG_LEN];
+  for (uint32_t i = 0; i < iterations; i++) {
+    sum += protocol_encode_telemetry(&telemetry_states[i % BENCH_INPUTS], buf,
+                                     sizeof(buf));
+    sum += buf[i % TELEMETRY_MSG_LEN];
+  }
+  return sum;
+}
+
+#if BENCH_JSON_PROTOCOL
+static uint32_t bench_json_decode(uint32_t iterations) {
+  uint32_t sum = 0;
+  remote_event events[JSON_MAX_EVENTS];
+  for (uint32_t i = 0; i < iterations; i++) {
+    if (json_decode(json_frames[i % BENCH_INPUTS], events) > 0) {
+      sum += (uint32_t)events[0].new_position[X_IDX];
+    }
+  }
+  return sum;
+}
+
+static uint32_t bench_json_encode(uint32_t iterations) {
+  uint32_t sum = 0;
+  for (uint32_t i = 0; i < iterations; i++) {
+    char *report = json_encode_state(&snapshots[i % BENCH_INPUTS]);
+    sum += strlen(report);
+    free(report);
+  }
+  return sum;
+}
+#endif
+
+static uint32_t bench_mix(uint32_t iterations) {
+  float sum = 0;
+  for (uint32_t i = 0; i < iterations; i++) {
+    float left, right;
+    sum += control_mix(positions[i % BENCH_INPUTS],
+                       &sensor_views[i % BENCH_INPUTS], &left, &right);
+    sum += left - right;
+  }
+  return (uint32_t)sum;
+}
+
+static uint32_t run_filter(const filter_config *config, uint32_t iterations) {
+  distance_filter filter;
+  distance_filter_init(&filter, config);
+  float sum = 0;
+  for (uint32_t i = 0; i < iterations; i++) {
+    // One reading per 60 ms polling cycle
+    if (distance_filter_push(&filter, samples[i % BENCH_INPUTS],
+                             (int64_t)i * 60000)) {
+      sum += filter.distance;
+    }
+  }
+  return (uint32_t)sum;
+}
+
+static uint32_t bench_front_filter(uint32_t iterations) {
+  return run_filter(ultrasonic_mounts[sensor_front].filter, iterations);
+}
+
+static const filter_stage widest_median_stages[] = {
+    {.type = filter_median, .median = {.taps = FILTER_MAX_MEDIAN_TAPS}},
+};
+
+static uint32_t bench_median(uint32_t iterations) {
+  static const filter_config config = {widest_median_stages, 1};
+  return run_filter(&config, iterations);
+}
+
+static const micro_benchmark micro_benchmarks[] = {
+    {"protocol_decode", "position frame parse in the WebSocket handler",
+     bench_decode},
+    {"protocol_encode_telemetry",
+     "telemetry serialization, once per broadcast", bench_encode_telemetry},
+#if BENCH_JSON_PROTOCOL
+    {"json_decode", "text frame parse in handle_message()", bench_json_decode},
+    {"json_encode_state", "state report sent back for each text frame",
+     bench_json_encode},
+#endif
+    {"control_mix", "wheel speed mixing in control_sync()", bench_mix},
+    {"front_filter", "front sensor pipeline, per reading",
+     bench_front_filter},
+    {"median_filter", "widest median stage alone, per reading",
+     bench_median},
+};
+
+#define MICRO_BENCHMARK_COUNT                                                  \
+  (sizeof(micro_benchmarks) / sizeof(micro_benchmarks[0]))
+
+static double now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Checksums of every run end up here so the compiler must compute them
+static volatile uint32_t sink;
+
+static micro_result run_micro(const micro_benchmark *bench) {
+  double per_op[BENCH_BATCHES];
+
+  // Warm the caches and branch predictors first
+  sink += bench->run(BENCH_ITERATIONS);
+  for (int batch = 0; batch < BENCH_BATCHES; batch++) {
+    double started = now_ns();
+    sink += bench->run(BENCH_ITERATIONS);
+    per_op[batch] = (now_ns() - started) / BENCH_ITERATIONS;
+  }
+
+  qsort(per_op, BENCH_BATCHES, sizeof(per_op[0]), compare_doubles);
+  return (micro_result){.median_ns = per_op[BENCH_BATCHES / 2],
+                        .min_ns = per_op[0]};
+}
+
+typedef struct {
+  int episodes;
+  uint32_t seed;
+  double duration_s;
+  double collisions_per_min;
+  double distance_cm_per_min;
+  double coverage_percent;
+} scenario_result;
+
+// Allowed regression when no --tolerance is given, in percent
+#define DEFAULT_TOLERANCE 25
+// Timing noise allowed on top of the tolerance, which matters for paths that
+// only take a few nanoseconds. Separate runs of the same binary settle about
+// 2 ns apart on such paths, depending on where their code ends up.
+#define MICRO_SLACK_NS 3.0
+// Reruns of a micro benchmark that looks slower than its baseline before it
+// counts as a regression, since one busy stretch on the machine can slow a
+// whole run down
+#define MICRO_RETRIES 3
+// Collisions a baseline without any may grow to before that is a regression
+#define COLLISION_SLACK_PER_MIN 0.05
+
+static char *read_file(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long len = ftell(file);
+  rewind(file);
+  char *text = malloc(len + 1);
+  if (text != NULL) {
+    text[fread(text, 1, len, file)] = '\0';
+  }
+  fclose(file);
+  return text;
+}
+
+// Look up a number in a document this program wrote: the first "field" after
+// the key "object", or anywhere when object is NULL
+static bool baseline_number(const char *text, const char *object,
+                            const char *field, double *value) {
+  char key[64];
+  if (object != NULL) {
+    snprintf(key, sizeof(key), "\"%s\":", object);
+    if ((text = strstr(text, key)) == NULL) {
+      return false;
+    }
+  }
+  snprintf(key, sizeof(key), "\"%s\":", field);
+  if ((text = strstr(text, key)) == NULL) {
+    return false;
+  }
+  return sscanf(text + strlen(key), "%lf", value) == 1;
+}
+
+// Report a result that moved the wrong way by more than the tolerance.
+// higher_is_worse picks the direction.
+static bool regressed(const char *name, double value, double base,
+                      double allowed, bool higher_is_worse) {
+  bool worse =
+      higher_is_worse ? value > base + allowed : value < base - allowed;
+  if (worse) {
+    fprintf(stderr, "regression: %s is %.3f, baseline %.3f\n", name, value,
+            base);
+  }
+  return worse;
+}
+
+// Compare results against a baseline, returning how many regressed or were
+// missing from it. Micro results are replaced by the best of any reruns.
+static int compare_baseline(const char *text, double tolerance,
+                            micro_result *micro,
+                            const scenario_result *scenario) {
+  int regressions = 0;
+  double base;
+  char name[64];
+
+  for (size_t i = 0; i < MICRO_BENCHMARK_COUNT; i++) {
+    const char *bench = micro_benchmarks[i].name;
+    // The fastest batch is what preemption and frequency scaling disturb
+    // least
+    if (!baseline_number(text, bench, "min_ns", &base)) {
+      fprintf(stderr, "baseline has no %s, regenerate it with --output\n",
+              bench);
+      regressions++;
+      continue;
+    }
+    double allowed = base * tolerance + MICRO_SLACK_NS;
+    for (int retry = 0;
+         retry < MICRO_RETRIES && micro[i].min_ns > base + allowed; retry++) {
+      micro_result again = run_micro(&micro_benchmarks[i]);
+      if (again.min_ns < micro[i].min_ns) {
+        micro[i] = again;
+      }
+    }
+    snprintf(name, sizeof(name), "%s min_ns", bench);
+    regressions += regressed(name, micro[i].min_ns, base, allowed, true);
+  }
+
+  // Scenario results are only comparable between runs of the same episodes
+  double episodes, seed, duration_s;
+  if (!baseline_number(text, "scenario", "episodes", &episodes) ||
+      !baseline_number(text, "scenario", "seed", &seed) ||
+      !baseline_number(text, "scenario", "duration_s", &duration_s) ||
+      episodes != scenario->episodes || seed != scenario->seed ||
+      fabs(duration_s - scenario->duration_s) > 0.05) {
+    fprintf(stderr, "baseline ran other episodes, scenario not compared\n");
+    return regressions;
+  }
+  if (baseline_number(text, "scenario", "collisions_per_min", &base)) {
+    regressions +=
+        regressed("collisions_per_min", scenario->collisions_per_min, base,
+                  base * tolerance + COLLISION_SLACK_PER_MIN, true);
+  }
+  if (baseline_number(text, "scenario", "distance_cm_per_min", &base)) {
+    regressions +=
+        regressed("distance_cm_per_min", scenario->distance_cm_per_min, base,
+                  base * tolerance, false);
+  }
+  if (baseline_number(text, "scenario", "coverage_percent", &base)) {
+    regressions +=
+        regressed("coverage_percent", scenario->coverage_percent, base,
+                  base * tolerance, false);
+  }
+  return regressions;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--episodes N] [--duration SECONDS] [--seed N] "
+          "[--world FILE] [--output FILE]\n"
+          "       [--baseline FILE] [--tolerance PERCENT]\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  int episodes = 20;
+  double duration_s = 120;
+  uint32_t seed = 1;
+  const char *world_path = NULL;
+  const char *output_path = NULL;
+  const char *baseline_path = NULL;
+  double tolerance = DEFAULT_TOLERANCE;
+
+  static const struct option options[] = {
+      {"episodes", required_argument, NULL, 'n'},
+      {"duration", required_argument, NULL, 'd'},
+      {"seed", required_argument, NULL, 's'},
+      {"world", required_argument, NULL, 'w'},
+      {"output", required_argument, NULL, 'o'},
+      {"baseline", required_argument, NULL, 'b'},
+      {"tolerance", required_argument, NULL, 't'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:d:s:w:o:b:t:", options, NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      episodes = atoi(optarg);
+      break;
+    case 'd':
+      duration_s = atof(optarg);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 0);
+      break;
+    case 'w':
+      world_path = optarg;
+      break;
+    case 'o':
+      output_path = optarg;
+      break;
+    case 'b':
+      baseline_path = optarg;
+      break;
+    case 't':
+      tolerance = atof(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (episodes < 1 || duration_s <= 0 || tolerance < 0) {
+    usage(argv[0]);
+    return 2;
+  }
+#if !BENCH_JSON_PROTOCOL
+  if (baseline_path != NULL) {
+    fprintf(stderr, "built without cJSON, so the JSON protocol can't be "
+                    "gated. Set IDF_PATH or install cJSON and rebuild.\n");
+    return 2;
+  }
+#endif
+
+  // Read up front so a typo fails before minutes of benchmarking
+  char *baseline = NULL;
+  if (baseline_path != NULL && (baseline = read_file(baseline_path)) == NULL) {
+    perror(baseline_path);
+    return 1;
+  }
+
+  world w;
+  if (world_path == NULL) {
+    world_load_default(&w);
+  } else if (!world_load(&w, world_path)) {
+    fprintf(stderr, "could not load world map %s\n", world_path);
+    return 1;
+  }
+
+  params_init();
+  prepare_inputs();
+  micro_result micro[MICRO_BENCHMARK_COUNT];
+  for (size_t i = 0; i < MICRO_BENCHMARK_COUNT; i++) {
+    micro[i] = run_micro(&micro_benchmarks[i]);
+  }
+
+  int collisions = 0;
+  double distance_cm = 0;
+  double coverage = 0;
+  for (int i = 0; i < episodes; i++) {
+    episode_result result;
+    if (fork_episode(&w, seed + i, duration_s, NULL, &result) != 0) {
+      fprintf(stderr, "episode with seed %u failed\n", seed + i);
+      return 1;
+    }
+
+    collisions += result.stats.collisions;
+    distance_cm += result.stats.distance_cm;
+    coverage += 100.0 * result.stats.cells_visited / result.stats.free_cells;
+  }
+
+  double minutes = episodes * duration_s / 60;
+  scenario_result scenario = {
+      .episodes = episodes,
+      .seed = seed,
+      .duration_s = duration_s,
+      .collisions_per_min = collisions / minutes,
+      .distance_cm_per_min = distance_cm / minutes,
+      .coverage_percent = coverage / episodes,
+  };
+
+  int regressions = 0;
+  if (baseline != NULL) {
+    regressions = compare_baseline(baseline, tolerance / 100, micro, &scenario);
+    free(baseline);
+  }
+
+  FILE *out = stdout;
+  if (output_path != NULL && (out = fopen(output_path, "w")) == NULL) {
+    perror(output_path);
+    return 1;
+  }
+
+  fprintf(out, "{\n  \"micro\": {\n");
+  for (size_t i = 0; i < MICRO_BENCHMARK_COUNT; i++) {
+    fprintf(out,
+            "    \"%s\": {\"median_ns\": %.2f, \"min_ns\": %.2f, "
+            "\"covers\": \"%s\"}%s\n",
+            micro_benchmarks[i].name, micro[i].median_ns, micro[i].min_ns,
+            micro_benchmarks[i].covers,
+            i + 1 < MICRO_BENCHMARK_COUNT ? "," : "");
+  }
+  fprintf(out, "  },\n");
+
+  fprintf(out,
+          "  \"scenario\": {\n"
+          "    \"episodes\": %d,\n"
+          "    \"seed\": %u,\n"
+          "    \"duration_s\": %.1f,\n"
+          "    \"collisions_per_min\": %.3f,\n"
+          "    \"distance_cm_per_min\": %.1f,\n"
+          "    \"coverage_percent\": %.2f,\n"
+          "    \"coverage_percent_per_min\": %.3f\n"
+          "  }\n"
+          "}\n",
+          scenario.episodes, scenario.seed, scenario.duration_s,
+          scenario.collisions_per_min, scenario.distance_cm_per_min,
+          scenario.coverage_percent,
+          scenario.coverage_percent / (duration_s / 60));
+
+  if (out != stdout) {
+    fclose(out);
+  }
+
+  if (regressions > 0) {
+    fprintf(stderr,
+            "%d results regressed by more than %g%% from %s, or are missing "
+            "from it\n",
+            regressions, tolerance, baseline_path);
+    return 3;
+  }
+  return 0;
+}
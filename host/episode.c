@@ -0,0 +1,116 @@
+#include <math.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include "controller.h"
+#include "deferred_log.h"
+#include "episode.h"
+#include "hal_sim.h"
+#include "motor.h"
+#include "params.h"
+#include "recorder.h"
+#include "sim.h"
+#include "tasks.h"
+#include "ultrasonic.h"
+#include "wiring.h"
+
+#define START_CLEARANCE_CM 20.0f
+
+static sim_pose random_start_pose(const world *w, uint32_t seed) {
+  srand(seed);
+  float width = w->width * WORLD_CELL_CM;
+  float height = w->height * WORLD_CELL_CM;
+
+  sim_pose pose;
+  do {
+    pose.x = width * rand() / (float)RAND_MAX;
+    pose.y = height * rand() / (float)RAND_MAX;
+  } while (world_collides(w, pose.x, pose.y, START_CLEARANCE_CM));
+  pose.theta = 2 * (float)M_PI * rand() / (float)RAND_MAX;
+
+  return pose;
+}
+
+void episode_boot(const world *w, sim_pose start, uint32_t seed,
+                  const char *record_path) {
+  sim_init();
+  hal_sim_seed(seed);
+  deferred_log_init();
+  if (record_path != NULL) {
+    hal_sim_record_to(record_path);
+    recorder_start();
+  }
+  params_init();
+
+  global_controller.left_motor =
+      initialize_motor(BIN1_GPIO, BIN2_GPIO, STDBY_GPIO, PWMB_GPIO,
+                       MCPWM_UNIT_0, MCPWM_TIMER_0, MCPWM_OPR_A);
+  global_controller.right_motor =
+      initialize_motor(AIN1_GPIO, AIN2_GPIO, STDBY_GPIO, PWMA_GPIO,
+                       MCPWM_UNIT_1, MCPWM_TIMER_1, MCPWM_OPR_B);
+#if CONFIG_ROBOT_WHEEL_ENCODERS
+  attach_encoder(&global_controller.left_motor, LEFT_ENCODER_PCNT,
+                 LEFT_ENCODER_A_GPIO, LEFT_ENCODER_B_GPIO);
+  attach_encoder(&global_controller.right_motor, RIGHT_ENCODER_PCNT,
+                 RIGHT_ENCODER_A_GPIO, RIGHT_ENCODER_B_GPIO);
+#endif
+  plant_init(w, start, &global_controller.left_motor,
+             &global_controller.right_motor, seed);
+  start_motor_control(&global_controller.left_motor,
+                      &global_controller.right_motor);
+
+  task_start(task_poll_distance, poll_distance, NULL);
+  control_init();
+
+  remote_event event = {.type = mode, .new_mode = mode_autonomous};
+  control_submit(&event);
+}
+
+// Boot the firmware tasks in autonomous mode and let them drive until the
+// episode ends, recording their inputs to record_path unless it is NULL.
+// Runs in a forked child so every episode starts from a clean process.
+static episode_result run_episode(const world *w, uint32_t seed,
+                                  double duration_s, const char *record_path) {
+  episode_boot(w, random_start_pose(w, seed), seed, record_path);
+  sim_run_until((int64_t)(duration_s * 1e6));
+  recorder_flush();
+
+  episode_result result = {.seed = seed, .stats = plant_get_stats()};
+  for (int point = 0; point < TRACE_POINT_COUNT; point++) {
+    trace_get_stats(point, &result.trace[point]);
+  }
+  return result;
+}
+
+int fork_episode(const world *w, uint32_t seed, double duration_s,
+                        const char *record_path, episode_result *result) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    episode_result child_result =
+        run_episode(w, seed, duration_s, record_path);
+    ssize_t written = write(fds[1], &child_result, sizeof(child_result));
+    _exit(written == sizeof(child_result) ? 0 : 1);
+  }
+
+  close(fds[1]);
+  ssize_t got = read(fds[0], result, sizeof(*result));
+  close(fds[0]);
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return (got == sizeof(*result) && WIFEXITED(status) &&
+          WEXITSTATUS(status) == 0)
+             ? 0
+             : -1;
+}
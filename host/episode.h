@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "plant.h"
+#include "trace.h"
+#include "world.h"
+
+// One autonomous driving episode of the firmware against the simulated
+// robot, shared by robot_sim and robot_bench
+
+typedef struct {
+  uint32_t seed;
+  plant_stats stats;
+  trace_stats trace[TRACE_POINT_COUNT];
+} episode_result;
+
+// Boot the firmware tasks against the simulated robot at start and switch
+// them to autonomous mode, without running the clock. Tests use it to script
+// their own episodes with sim_run_until().
+void episode_boot(const world *w, sim_pose start, uint32_t seed,
+                  const char *record_path);
+
+// Run an episode from a random start pose picked by seed, recording the
+// controller's inputs to record_path unless it is NULL. Returns 0 on
+// success.
+int fork_episode(const world *w, uint32_t seed, double duration_s,
+                 const char *record_path, episode_result *result);
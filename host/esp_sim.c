@@ -0,0 +1,58 @@
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "sim.h"
+
+static esp_log_level_t log_level = ESP_LOG_WARN;
+
+const char *esp_err_to_name(esp_err_t code) {
+  switch (code) {
+  case ESP_OK:
+    return "ESP_OK";
+  case ESP_FAIL:
+    return "ESP_FAIL";
+  case ESP_ERR_NO_MEM:
+    return "ESP_ERR_NO_MEM";
+  case ESP_ERR_INVALID_ARG:
+    return "ESP_ERR_INVALID_ARG";
+  case ESP_ERR_INVALID_STATE:
+    return "ESP_ERR_INVALID_STATE";
+  case ESP_ERR_INVALID_SIZE:
+    return "ESP_ERR_INVALID_SIZE";
+  case ESP_ERR_NOT_FOUND:
+    return "ESP_ERR_NOT_FOUND";
+  case ESP_ERR_NOT_SUPPORTED:
+    return "ESP_ERR_NOT_SUPPORTED";
+  case ESP_ERR_TIMEOUT:
+    return "ESP_ERR_TIMEOUT";
+  case ESP_ERR_INVALID_VERSION:
+    return "ESP_ERR_INVALID_VERSION";
+  default:
+    return "UNKNOWN ERROR";
+  }
+}
+
+// Only a global level is supported, tag is ignored
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+  log_level = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format,
+                   ...) {
+  if (level > log_level) {
+    return;
+  }
+
+  static const char letters[] = "NEWIDV";
+  fprintf(stderr, "%c (%lld) %s: ", letters[level],
+          (long long)(sim_now_us() / 1000), tag);
+
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+}
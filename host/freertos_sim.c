@@ -0,0 +1,447 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "sim.h"
+
+#define MAX_TASKS 16
+#define MAX_EVENTS 64
+#define TICK_US (portTICK_PERIOD_MS * 1000)
+#define NEVER INT64_MAX
+#define TASK_STACK_SIZE (256 * 1024)
+
+struct sim_task {
+  pthread_t thread;
+  pthread_cond_t wake;
+  TaskFunction_t function;
+  void *parameters;
+  const char *name;
+  UBaseType_t priority;
+  bool ready;
+  uint64_t ready_seq;
+  // Object the task is blocked on and when it gives up waiting
+  const void *blocked_on;
+  int64_t wake_at;
+  bool timed_out;
+  uint32_t notify_value;
+  bool notify_pending;
+};
+
+struct sim_queue {
+  uint8_t *items;
+  UBaseType_t length;
+  UBaseType_t item_size;
+  UBaseType_t head;
+  UBaseType_t count;
+};
+
+typedef struct {
+  int64_t at;
+  uint64_t seq;
+  sim_event_fn fn;
+  void *arg;
+} sim_event;
+
+// Every task runs with the kernel lock held, so only one runs at a time
+static pthread_mutex_t kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scheduler_wake = PTHREAD_COND_INITIALIZER;
+
+static struct sim_task tasks[MAX_TASKS];
+static int task_count = 0;
+// NULL while the scheduler or an event (interrupt) is running
+static struct sim_task *running = NULL;
+static uint64_t next_seq = 0;
+
+static sim_event events[MAX_EVENTS];
+static int event_count = 0;
+
+static int64_t now_us = 0;
+
+// Wait object for plain delays, never signalled
+static const char delay_object = 0;
+
+void sim_init() { pthread_mutex_lock(&kernel_lock); }
+
+int64_t sim_now_us() { return now_us; }
+
+void sim_schedule(int64_t at_us, sim_event_fn fn, void *arg) {
+  assert(event_count < MAX_EVENTS);
+  events[event_count++] = (sim_event){
+      .at = at_us < now_us ? now_us : at_us,
+      .seq = next_seq++,
+      .fn = fn,
+      .arg = arg,
+  };
+}
+
+static int earliest_event() {
+  int earliest = -1;
+  for (int i = 0; i < event_count; i++) {
+    if (earliest < 0 || events[i].at < events[earliest].at ||
+        (events[i].at == events[earliest].at &&
+         events[i].seq < events[earliest].seq)) {
+      earliest = i;
+    }
+  }
+  return earliest;
+}
+
+static void run_due_events() {
+  int i;
+  while ((i = earliest_event()) >= 0 && events[i].at <= now_us) {
+    sim_event event = events[i];
+    events[i] = events[--event_count];
+    event.fn(event.arg);
+  }
+}
+
+static void make_ready(struct sim_task *task) {
+  task->ready = true;
+  task->ready_seq = next_seq++;
+  task->blocked_on = NULL;
+  task->wake_at = NEVER;
+}
+
+// Highest priority ready task, oldest first among equals
+static struct sim_task *highest_ready() {
+  struct sim_task *best = NULL;
+  for (int i = 0; i < task_count; i++) {
+    struct sim_task *task = &tasks[i];
+    if (task->ready &&
+        (best == NULL || task->priority > best->priority ||
+         (task->priority == best->priority &&
+          task->ready_seq < best->ready_seq))) {
+      best = task;
+    }
+  }
+  return best;
+}
+
+// Hand control back to the scheduler until this task is picked again
+static void switch_out() {
+  struct sim_task *self = running;
+  running = NULL;
+  pthread_cond_signal(&scheduler_wake);
+  while (running != self) {
+    pthread_cond_wait(&self->wake, &kernel_lock);
+  }
+}
+
+// Give way to a higher priority task that was just made ready, the way
+// FreeRTOS preempts on wake-up
+static void preempt() {
+  if (running == NULL) {
+    return;
+  }
+
+  struct sim_task *next = highest_ready();
+  if (next != NULL && next->priority > running->priority) {
+    make_ready(running);
+    switch_out();
+  }
+}
+
+// Block the running task until object is signalled or the deadline passes
+//
+// Returns false on timeout
+static bool block_on(const void *object, int64_t deadline) {
+  struct sim_task *self = running;
+  assert(self != NULL && "blocking call made outside of a task");
+
+  self->ready = false;
+  self->blocked_on = object;
+  self->wake_at = deadline;
+  self->timed_out = false;
+  switch_out();
+
+  return !self->timed_out;
+}
+
+static void signal_waiters(const void *object) {
+  for (int i = 0; i < task_count; i++) {
+    if (!tasks[i].ready && tasks[i].blocked_on == object) {
+      make_ready(&tasks[i]);
+    }
+  }
+}
+
+static int64_t deadline_after(TickType_t ticks) {
+  if (ticks == portMAX_DELAY) {
+    return NEVER;
+  }
+  return (now_us / TICK_US + ticks) * TICK_US;
+}
+
+void sim_run_until(int64_t end_us) {
+  while (true) {
+    run_due_events();
+
+    struct sim_task *next = highest_ready();
+    if (next != NULL) {
+      next->ready = false;
+      running = next;
+      pthread_cond_signal(&next->wake);
+      while (running != NULL) {
+        pthread_cond_wait(&scheduler_wake, &kernel_lock);
+      }
+      continue;
+    }
+
+    // Everything is blocked, jump ahead to whatever happens next
+    int64_t next_time = NEVER;
+    int event = earliest_event();
+    if (event >= 0) {
+      next_time = events[event].at;
+    }
+    for (int i = 0; i < task_count; i++) {
+      if (!tasks[i].ready && tasks[i].wake_at < next_time) {
+        next_time = tasks[i].wake_at;
+      }
+    }
+
+    if (next_time > end_us) {
+      now_us = end_us;
+      return;
+    }
+
+    now_us = next_time;
+    for (int i = 0; i < task_count; i++) {
+      if (!tasks[i].ready && tasks[i].wake_at <= now_us) {
+        make_ready(&tasks[i]);
+        tasks[i].timed_out = true;
+      }
+    }
+  }
+}
+
+static void *task_entry(void *arg) {
+  struct sim_task *self = (struct sim_task *)arg;
+
+  pthread_mutex_lock(&kernel_lock);
+  while (running != self) {
+    pthread_cond_wait(&self->wake, &kernel_lock);
+  }
+
+  self->function(self->parameters);
+
+  // FreeRTOS tasks must not return, park it forever
+  self->ready = false;
+  self->blocked_on = self;
+  self->wake_at = NEVER;
+  running = NULL;
+  pthread_cond_signal(&scheduler_wake);
+  pthread_mutex_unlock(&kernel_lock);
+
+  return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name,
+                       uint32_t stack_depth, void *parameters,
+                       UBaseType_t priority, TaskHandle_t *created_task) {
+  if (task_count >= MAX_TASKS) {
+    return pdFAIL;
+  }
+
+  struct sim_task *task = &tasks[task_count++];
+  task->function = function;
+  task->parameters = parameters;
+  task->name = name;
+  task->priority = priority;
+  pthread_cond_init(&task->wake, NULL);
+  make_ready(task);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, TASK_STACK_SIZE);
+  int ret = pthread_create(&task->thread, &attr, task_entry, task);
+  pthread_attr_destroy(&attr);
+  if (ret != 0) {
+    task_count--;
+    return pdFAIL;
+  }
+
+  if (created_task != NULL) {
+    *created_task = task;
+  }
+
+  preempt();
+  return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name,
+                                   uint32_t stack_depth, void *parameters,
+                                   UBaseType_t priority,
+                                   TaskHandle_t *created_task,
+                                   BaseType_t core_id) {
+  return xTaskCreate(function, name, stack_depth, parameters, priority,
+                     created_task);
+}
+
+void vTaskDelay(TickType_t ticks) {
+  if (ticks == 0) {
+    make_ready(running);
+    switch_out();
+  } else {
+    block_on(&delay_object, deadline_after(ticks));
+  }
+}
+
+TickType_t xTaskGetTickCount() { return now_us / TICK_US; }
+
+TaskHandle_t xTaskGetCurrentTaskHandle() { return running; }
+
+static bool notify(TaskHandle_t task, uint32_t value, eNotifyAction action) {
+  switch (action) {
+  case eNoAction:
+    break;
+  case eSetBits:
+    task->notify_value |= value;
+    break;
+  case eIncrement:
+    task->notify_value++;
+    break;
+  case eSetValueWithOverwrite:
+    task->notify_value = value;
+    break;
+  case eSetValueWithoutOverwrite:
+    if (task->notify_pending) {
+      return false;
+    }
+    task->notify_value = value;
+    break;
+  }
+
+  task->notify_pending = true;
+  signal_waiters(&task->notify_value);
+  return true;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value,
+                       eNotifyAction action) {
+  bool notified = notify(task, value, action);
+  preempt();
+  return notified ? pdPASS : pdFAIL;
+}
+
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value,
+                              eNotifyAction action,
+                              BaseType_t *higher_priority_task_woken) {
+  bool notified = notify(task, value, action);
+  if (higher_priority_task_woken != NULL && notified) {
+    *higher_priority_task_woken = pdTRUE;
+  }
+  return notified ? pdPASS : pdFAIL;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t bits_to_clear_on_entry,
+                           uint32_t bits_to_clear_on_exit,
+                           uint32_t *notification_value,
+                           TickType_t ticks_to_wait) {
+  struct sim_task *self = running;
+  assert(self != NULL);
+
+  if (!self->notify_pending) {
+    self->notify_value &= ~bits_to_clear_on_entry;
+    if (ticks_to_wait != 0) {
+      block_on(&self->notify_value, deadline_after(ticks_to_wait));
+    }
+  }
+
+  if (notification_value != NULL) {
+    *notification_value = self->notify_value;
+  }
+  if (!self->notify_pending) {
+    return pdFALSE;
+  }
+
+  self->notify_value &= ~bits_to_clear_on_exit;
+  self->notify_pending = false;
+  return pdTRUE;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+  struct sim_queue *queue = calloc(1, sizeof(struct sim_queue));
+  queue->items = calloc(length, item_size);
+  queue->length = length;
+  queue->item_size = item_size;
+  return queue;
+}
+
+static bool queue_push(QueueHandle_t queue, const void *item) {
+  if (queue->count == queue->length) {
+    return false;
+  }
+
+  UBaseType_t tail = (queue->head + queue->count) % queue->length;
+  memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+  queue->count++;
+  signal_waiters(queue);
+  return true;
+}
+
+static bool queue_pop(QueueHandle_t queue, void *buffer) {
+  if (queue->count == 0) {
+    return false;
+  }
+
+  memcpy(buffer, queue->items + queue->head * queue->item_size,
+         queue->item_size);
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+  signal_waiters(queue);
+  return true;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item,
+                      TickType_t ticks_to_wait) {
+  int64_t deadline = deadline_after(ticks_to_wait);
+
+  while (!queue_push(queue, item)) {
+    if (running == NULL || ticks_to_wait == 0 || !block_on(queue, deadline)) {
+      return pdFALSE;
+    }
+  }
+
+  preempt();
+  return pdTRUE;
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item) {
+  assert(queue->length == 1);
+  queue->count = 0;
+  queue_push(queue, item);
+  preempt();
+  return pdPASS;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item,
+                             BaseType_t *higher_priority_task_woken) {
+  bool sent = queue_push(queue, item);
+  if (higher_priority_task_woken != NULL && sent) {
+    *higher_priority_task_woken = pdTRUE;
+  }
+  return sent ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer,
+                         TickType_t ticks_to_wait) {
+  int64_t deadline = deadline_after(ticks_to_wait);
+
+  while (!queue_pop(queue, buffer)) {
+    if (running == NULL || ticks_to_wait == 0 || !block_on(queue, deadline)) {
+      return pdFALSE;
+    }
+  }
+
+  preempt();
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  return queue->count;
+}
@@ -0,0 +1,222 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal_sim.h"
+#include "plant.h"
+#include "sim.h"
+
+static int levels[GPIO_NUM_MAX];
+static hal_isr_t isr_handlers[GPIO_NUM_MAX];
+static void *isr_args[GPIO_NUM_MAX];
+static uint32_t random_state = 1;
+
+#define CAPTURE_CHANNELS 6
+
+static hal_pulse_handler_t capture_handlers[GPIO_NUM_MAX];
+static void *capture_args[GPIO_NUM_MAX];
+static int64_t capture_rise[GPIO_NUM_MAX];
+static int capture_channel_count = 0;
+
+void hal_sim_seed(uint32_t seed) { random_state = seed ? seed : 1; }
+
+// Plenty for any episode
+#define RECORD_STORAGE_SIZE (64 * 1024 * 1024)
+
+static FILE *record_file = NULL;
+static bool erase_stalls = false;
+
+void hal_sim_record_to(const char *path) {
+  record_file = fopen(path, "w+b");
+  if (record_file == NULL) {
+    perror(path);
+    exit(1);
+  }
+}
+
+int hal_sim_output_level(gpio_num_t pin) { return levels[pin]; }
+
+void hal_sim_drive_input(gpio_num_t pin, int level) {
+  assert(pin >= 0 && pin < GPIO_NUM_MAX);
+  if (levels[pin] == level) {
+    return;
+  }
+
+  levels[pin] = level;
+  if (isr_handlers[pin] != NULL) {
+    isr_handlers[pin](isr_args[pin]);
+  }
+
+  if (capture_handlers[pin] != NULL) {
+    if (level == 1) {
+      capture_rise[pin] = sim_now_us();
+    } else {
+      capture_handlers[pin](capture_args[pin],
+                            (sim_now_us() - capture_rise[pin]) * 1000,
+                            sim_now_us());
+    }
+  }
+}
+
+void hal_gpio_output(gpio_num_t pin) { assert(pin >= 0 && pin < GPIO_NUM_MAX); }
+
+void hal_gpio_input(gpio_num_t pin) { assert(pin >= 0 && pin < GPIO_NUM_MAX); }
+
+esp_err_t hal_gpio_set_level(gpio_num_t pin, int level) {
+  if (pin < 0 || pin >= GPIO_NUM_MAX) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  levels[pin] = level;
+  plant_on_gpio(pin, level);
+  return ESP_OK;
+}
+
+int hal_gpio_get_level(gpio_num_t pin) { return levels[pin]; }
+
+void hal_gpio_isr_add(gpio_num_t pin, hal_isr_t handler, void *arg) {
+  isr_handlers[pin] = handler;
+  isr_args[pin] = arg;
+}
+
+esp_err_t hal_pulse_capture_add(gpio_num_t pin, hal_pulse_handler_t handler,
+                                void *arg) {
+  // Same limit as the hardware, three channels on each MCPWM unit
+  if (capture_channel_count >= CAPTURE_CHANNELS) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  capture_channel_count++;
+  capture_handlers[pin] = handler;
+  capture_args[pin] = arg;
+  return ESP_OK;
+}
+
+esp_err_t hal_encoder_init(int unit, gpio_num_t a, gpio_num_t b) {
+  return ESP_OK;
+}
+
+int32_t hal_encoder_count(int unit) { return plant_encoder_count(unit); }
+
+struct hal_timer {
+  uint32_t period_us;
+  hal_isr_t callback;
+  void *arg;
+  bool paused;
+  // Whether a firing is on the simulator's schedule
+  bool scheduled;
+};
+
+static void periodic_timer_fire(void *arg) {
+  hal_timer_t timer = (hal_timer_t)arg;
+  if (timer->paused) {
+    timer->scheduled = false;
+    return;
+  }
+  timer->callback(timer->arg);
+  sim_schedule(sim_now_us() + timer->period_us, periodic_timer_fire, timer);
+}
+
+esp_err_t hal_timer_start_periodic(uint32_t period_us, hal_isr_t callback,
+                                   void *arg, hal_timer_t *out) {
+  hal_timer_t timer = malloc(sizeof(struct hal_timer));
+  *timer = (struct hal_timer){.period_us = period_us,
+                              .callback = callback,
+                              .arg = arg,
+                              .scheduled = true};
+  sim_schedule(sim_now_us() + period_us, periodic_timer_fire, timer);
+  if (out != NULL) {
+    *out = timer;
+  }
+  return ESP_OK;
+}
+
+esp_err_t hal_timer_pause(hal_timer_t timer) {
+  timer->paused = true;
+  return ESP_OK;
+}
+
+// Resuming before the next firing came round keeps that firing, so unlike on
+// the robot the first period can run short
+esp_err_t hal_timer_resume(hal_timer_t timer) {
+  timer->paused = false;
+  if (!timer->scheduled) {
+    timer->scheduled = true;
+    sim_schedule(sim_now_us() + timer->period_us, periodic_timer_fire, timer);
+  }
+  return ESP_OK;
+}
+
+void hal_pwm_init(gpio_num_t pin, mcpwm_unit_t unit, mcpwm_timer_t timer,
+                  int frequency) {}
+
+void hal_pwm_set_duty(mcpwm_unit_t unit, mcpwm_timer_t timer,
+                      mcpwm_operator_t op, float duty) {
+  plant_on_pwm(unit, timer, op, duty);
+}
+
+int64_t hal_time_us() { return sim_now_us(); }
+
+// The simulator runs one task at a time, like a single core
+int hal_core_id() { return 0; }
+
+// xorshift32, seeded per episode so runs are reproducible
+uint32_t hal_random() {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+size_t hal_record_storage_size() {
+  return record_file != NULL ? RECORD_STORAGE_SIZE : 0;
+}
+
+// The file grows as it is written, so there is nothing to erase
+esp_err_t hal_record_storage_erase(size_t offset, size_t len) {
+  return record_file != NULL ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t hal_record_storage_write(size_t offset, const void *data,
+                                   size_t len) {
+  if (record_file == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (fseek(record_file, offset, SEEK_SET) != 0 ||
+      fwrite(data, 1, len, record_file) != len || fflush(record_file) != 0) {
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+esp_err_t hal_record_storage_read(size_t offset, void *data, size_t len) {
+  if (record_file == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  memset(data, 0xff, len);
+  if (fseek(record_file, offset, SEEK_SET) != 0) {
+    return ESP_FAIL;
+  }
+  fread(data, 1, len, record_file);
+  return ESP_OK;
+}
+
+// Just a file, so the recorder may erase whenever it needs to unless a test
+// says otherwise
+bool hal_record_storage_erase_stalls() { return erase_stalls; }
+
+void hal_sim_record_erase_stalls(bool stalls) { erase_stalls = stalls; }
+
+// Every episode starts from the defaults, so nothing is ever stored
+esp_err_t hal_settings_get(const char *key, uint32_t *value) {
+  return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t hal_settings_set(const char *key, uint32_t value) { return ESP_OK; }
+
+esp_err_t hal_settings_erase(const char *key) { return ESP_OK; }
+
+esp_err_t hal_power_init() { return ESP_OK; }
+
+esp_err_t hal_power_save(bool enable) { return ESP_OK; }
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hal.h"
+
+// Simulator side of the HAL, see hal_sim.c
+
+void hal_sim_seed(uint32_t seed);
+
+// Back the record storage with a file, see recorder.h. Without one there is
+// no record storage.
+void hal_sim_record_to(const char *path);
+
+// Have the recorder treat erasing as stalling the robot, as it does on the
+// ESP32, so it only erases while stopped and drops records it has no room
+// for in the meantime
+void hal_sim_record_erase_stalls(bool stalls);
+
+// Level the firmware last wrote to an output pin
+int hal_sim_output_level(gpio_num_t pin);
+
+// Change the level seen on an input pin, firing its ISR on an edge
+void hal_sim_drive_input(gpio_num_t pin, int level);
@@ -0,0 +1,9 @@
+#pragma once
+
+// Host stand-in for the GPIO driver types, see host/hal_sim.c
+
+#include "esp_attr.h"
+
+#define GPIO_NUM_MAX 40
+
+typedef int gpio_num_t;
@@ -0,0 +1,14 @@
+#pragma once
+
+// Host stand-in for the MCPWM driver types, see host/hal_sim.c
+
+typedef enum { MCPWM_UNIT_0, MCPWM_UNIT_1, MCPWM_UNIT_MAX } mcpwm_unit_t;
+
+typedef enum {
+  MCPWM_TIMER_0,
+  MCPWM_TIMER_1,
+  MCPWM_TIMER_2,
+  MCPWM_TIMER_MAX
+} mcpwm_timer_t;
+
+typedef enum { MCPWM_OPR_A, MCPWM_OPR_B, MCPWM_OPR_MAX } mcpwm_operator_t;
@@ -0,0 +1,5 @@
+#pragma once
+
+// Host stand-in for esp_attr.h, placement attributes mean nothing here
+
+#define IRAM_ATTR
@@ -0,0 +1,31 @@
+#pragma once
+
+// Host stand-in for esp_log.h, timestamps come from the simulated clock
+
+typedef enum {
+  ESP_LOG_NONE,
+  ESP_LOG_ERROR,
+  ESP_LOG_WARN,
+  ESP_LOG_INFO,
+  ESP_LOG_DEBUG,
+  ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format,
+                   ...) __attribute__((format(printf, 3, 4)));
+
+// Everything is compiled in, filtering happens at runtime
+#define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
+
+#define ESP_LOG_LEVEL(level, tag, format, ...)                                 \
+  esp_log_write(level, tag, format, ##__VA_ARGS__)
+
+#define ESP_LOGE(tag, format, ...)                                             \
+  esp_log_write(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)                                             \
+  esp_log_write(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)                                             \
+  esp_log_write(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)                                             \
+  esp_log_write(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
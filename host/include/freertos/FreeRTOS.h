@@ -0,0 +1,24 @@
+#pragma once
+
+// Host stand-in for FreeRTOS, backed by the simulated scheduler in
+// host/freertos_sim.c. Ticks match CONFIG_FREERTOS_HZ in sdkconfig.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define configTICK_RATE_HZ 100
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((TickType_t)(ms)*configTICK_RATE_HZ) / 1000))
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define portYIELD_FROM_ISR()
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_queue *QueueHandle_t;
+typedef QueueHandle_t xQueueHandle;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item,
+                      TickType_t ticks_to_wait);
+// Only valid for queues of length 1
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item);
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item,
+                             BaseType_t *higher_priority_task_woken);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer,
+                         TickType_t ticks_to_wait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct sim_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+typedef enum {
+  eNoAction,
+  eSetBits,
+  eIncrement,
+  eSetValueWithOverwrite,
+  eSetValueWithoutOverwrite
+} eNotifyAction;
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name,
+                       uint32_t stack_depth, void *parameters,
+                       UBaseType_t priority, TaskHandle_t *created_task);
+// The host has no cores to pin to, so core_id is ignored
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name,
+                                   uint32_t stack_depth, void *parameters,
+                                   UBaseType_t priority,
+                                   TaskHandle_t *created_task,
+                                   BaseType_t core_id);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount();
+TaskHandle_t xTaskGetCurrentTaskHandle();
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action);
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value,
+                              eNotifyAction action,
+                              BaseType_t *higher_priority_task_woken);
+BaseType_t xTaskNotifyWait(uint32_t bits_to_clear_on_entry,
+                           uint32_t bits_to_clear_on_exit,
+                           uint32_t *notification_value,
+                           TickType_t ticks_to_wait);
@@ -0,0 +1,41 @@
+#pragma once
+
+// Host stand-in for the generated sdkconfig.h, mirroring the defaults in
+// sdkconfig. Any option can be overridden with -D on the command line.
+
+#ifndef CONFIG_FREERTOS_HZ
+#define CONFIG_FREERTOS_HZ 100
+#endif
+
+#ifndef CONFIG_ROBOT_TELEMETRY_PERIOD_MS
+#define CONFIG_ROBOT_TELEMETRY_PERIOD_MS 20
+#endif
+
+#ifndef CONFIG_ROBOT_LINK_TIMEOUT_MS
+#define CONFIG_ROBOT_LINK_TIMEOUT_MS 500
+#endif
+
+#ifndef CONFIG_ROBOT_MAX_CLIENTS
+#define CONFIG_ROBOT_MAX_CLIENTS 7
+#endif
+
+#ifndef CONFIG_ROBOT_WHEEL_ENCODERS
+#define CONFIG_ROBOT_WHEEL_ENCODERS 1
+#endif
+
+#ifndef CONFIG_ROBOT_MOTOR_MAX_ACCEL
+#define CONFIG_ROBOT_MOTOR_MAX_ACCEL 400
+#endif
+
+#ifndef CONFIG_ROBOT_MOTOR_MAX_JERK
+#define CONFIG_ROBOT_MOTOR_MAX_JERK 4000
+#endif
+
+#ifndef CONFIG_ROBOT_IDLE_TIMEOUT_S
+#define CONFIG_ROBOT_IDLE_TIMEOUT_S 30
+#endif
+
+#if !defined(CONFIG_ROBOT_ULTRASONIC_GPIO_ISR) &&                              \
+    !defined(CONFIG_ROBOT_ULTRASONIC_MCPWM_CAPTURE)
+#define CONFIG_ROBOT_ULTRASONIC_GPIO_ISR 1
+#endif
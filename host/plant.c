@@ -0,0 +1,228 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hal_sim.h"
+#include "plant.h"
+#include "sim.h"
+#include "ultrasonic.h"
+
+#define PHYSICS_TICK_US 5000
+#define ROBOT_RADIUS_CM 8.0f
+#define TRACK_WIDTH_CM 12.0f
+#define MAX_WHEEL_SPEED_CM_S 60.0f
+// Duty below which the gearbox friction keeps the wheel from turning
+#define STALL_DUTY 5.0f
+#define DRIVE_TAU_S 0.08f
+#define BRAKE_TAU_S 0.03f
+#define COAST_TAU_S 0.2f
+
+#define SENSOR_MAX_RANGE_CM 400.0f
+#define SENSOR_HALF_CONE_RAD 0.2f
+#define ECHO_DELAY_US 460
+#define ECHO_NO_TARGET_US 38000
+#define SENSOR_MIN_RANGE_CM 2.0f
+#define CM_ROUNDTRIP_US 58.0f
+
+// No two motors are quite the same, each wheel's top speed is off by up to
+// this fraction
+#define MOTOR_MISMATCH 0.1f
+// Rolling distance per wheel revolution that matches MOTOR_FULL_SPEED_RPS
+#define WHEEL_CIRCUMFERENCE_CM (MAX_WHEEL_SPEED_CM_S / MOTOR_FULL_SPEED_RPS)
+
+typedef struct {
+  const motor *config;
+  float duty;
+  float velocity;
+  float gain;
+  // Encoder position, fractional counts carried between ticks
+  double counts;
+} wheel;
+
+static const world *plant_world = NULL;
+static sim_pose truth;
+static wheel left_wheel;
+static wheel right_wheel;
+static plant_stats stats;
+static uint8_t *visited = NULL;
+static bool in_contact = false;
+static int trig_levels[SENSOR_COUNT];
+static bool silenced[SENSOR_COUNT];
+static uint32_t noise_state = 1;
+
+static float noise() {
+  noise_state ^= noise_state << 13;
+  noise_state ^= noise_state >> 17;
+  noise_state ^= noise_state << 5;
+  return (noise_state % 1000) / 1000.0f - 0.5f;
+}
+
+// Direction from the TB6612 input pins: +1/-1 when driving, 0 when stopped
+static int wheel_direction(const wheel *w) {
+  int in1 = hal_sim_output_level(w->config->in1);
+  int in2 = hal_sim_output_level(w->config->in2);
+  return in2 - in1;
+}
+
+static bool wheel_braking(const wheel *w) {
+  return hal_sim_output_level(w->config->in1) == 1 &&
+         hal_sim_output_level(w->config->in2) == 1;
+}
+
+static void update_wheel(wheel *w, float dt) {
+  float effective = fmaxf(0, (w->duty - STALL_DUTY) / (100 - STALL_DUTY));
+  float target =
+      wheel_direction(w) * effective * w->gain * MAX_WHEEL_SPEED_CM_S;
+
+  float tau = DRIVE_TAU_S;
+  if (wheel_direction(w) == 0) {
+    tau = wheel_braking(w) ? BRAKE_TAU_S : COAST_TAU_S;
+  }
+
+  w->velocity += (target - w->velocity) * fminf(1, dt / tau);
+  w->counts += w->velocity * dt / WHEEL_CIRCUMFERENCE_CM * ENCODER_COUNTS_PER_REV;
+}
+
+static void mark_visited() {
+  int col = (int)(truth.x / WORLD_CELL_CM);
+  int row = (int)(truth.y / WORLD_CELL_CM);
+  if (col < 0 || row < 0 || col >= plant_world->width ||
+      row >= plant_world->height) {
+    return;
+  }
+
+  int cell = row * plant_world->width + col;
+  if (!visited[cell]) {
+    visited[cell] = 1;
+    stats.cells_visited++;
+  }
+}
+
+static void physics_tick(void *arg) {
+  const float dt = PHYSICS_TICK_US / 1e6f;
+
+  update_wheel(&left_wheel, dt);
+  update_wheel(&right_wheel, dt);
+
+  float v = (left_wheel.velocity + right_wheel.velocity) / 2;
+  float w = (right_wheel.velocity - left_wheel.velocity) / TRACK_WIDTH_CM;
+
+  float heading = truth.theta + w * dt / 2;
+  float x = truth.x + v * cosf(heading) * dt;
+  float y = truth.y + v * sinf(heading) * dt;
+  truth.theta = remainderf(truth.theta + w * dt, 2 * (float)M_PI);
+
+  if (world_collides(plant_world, x, y, ROBOT_RADIUS_CM)) {
+    // Wheels keep spinning against the wall without moving the body
+    if (!in_contact) {
+      stats.collisions++;
+      in_contact = true;
+    }
+  } else {
+    in_contact = false;
+    stats.distance_cm += fabsf(v * dt);
+    truth.x = x;
+    truth.y = y;
+  }
+
+  mark_visited();
+  sim_schedule(sim_now_us() + PHYSICS_TICK_US, physics_tick, NULL);
+}
+
+static void echo_rise(void *arg) {
+  const ultrasonic_mount *mount = (const ultrasonic_mount *)arg;
+  hal_sim_drive_input(mount->echo, 1);
+}
+
+static void echo_fall(void *arg) {
+  const ultrasonic_mount *mount = (const ultrasonic_mount *)arg;
+  hal_sim_drive_input(mount->echo, 0);
+}
+
+// Range to the nearest wall within the sensor's beam. Sensors sit on the edge
+// of the body, facing outwards.
+static float measure_range(const ultrasonic_mount *mount) {
+  float direction = truth.theta + mount->angle;
+  float x = truth.x + ROBOT_RADIUS_CM * cosf(direction);
+  float y = truth.y + ROBOT_RADIUS_CM * sinf(direction);
+
+  float range = SENSOR_MAX_RANGE_CM;
+  for (int i = -1; i <= 1; i++) {
+    float ray = world_raycast(plant_world, x, y,
+                              direction + i * SENSOR_HALF_CONE_RAD,
+                              SENSOR_MAX_RANGE_CM);
+    range = fminf(range, ray);
+  }
+  return range;
+}
+
+// A falling edge on the trigger pin starts a measurement cycle
+static void ping(const ultrasonic_mount *mount) {
+  float range = measure_range(mount);
+  int64_t pulse_us = ECHO_NO_TARGET_US;
+  if (range < SENSOR_MAX_RANGE_CM) {
+    pulse_us = fmaxf(SENSOR_MIN_RANGE_CM, range + noise()) * CM_ROUNDTRIP_US;
+  }
+
+  int64_t rise_at = sim_now_us() + ECHO_DELAY_US;
+  sim_schedule(rise_at, echo_rise, (void *)mount);
+  sim_schedule(rise_at + pulse_us, echo_fall, (void *)mount);
+}
+
+void plant_init(const world *w, sim_pose start, const motor *left,
+                const motor *right, uint32_t seed) {
+  plant_world = w;
+  truth = start;
+  stats = (plant_stats){.free_cells = world_free_cells(w)};
+  visited = calloc(w->width * w->height, 1);
+  in_contact = false;
+  noise_state = seed | 1;
+  left_wheel = (wheel){.config = left, .gain = 1 + 2 * MOTOR_MISMATCH * noise()};
+  right_wheel =
+      (wheel){.config = right, .gain = 1 + 2 * MOTOR_MISMATCH * noise()};
+
+  mark_visited();
+  sim_schedule(sim_now_us() + PHYSICS_TICK_US, physics_tick, NULL);
+}
+
+void plant_on_gpio(gpio_num_t pin, int level) {
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    if (pin == ultrasonic_mounts[i].trig) {
+      if (trig_levels[i] == 1 && level == 0 && plant_world != NULL &&
+          !silenced[i]) {
+        ping(&ultrasonic_mounts[i]);
+      }
+      trig_levels[i] = level;
+    }
+  }
+}
+
+void plant_on_pwm(mcpwm_unit_t unit, mcpwm_timer_t timer, mcpwm_operator_t op,
+                  float duty) {
+  wheel *wheels[] = {&left_wheel, &right_wheel};
+  for (int i = 0; i < 2; i++) {
+    const motor *config = wheels[i]->config;
+    if (config != NULL && config->pwm_unit == unit &&
+        config->pwm_timer == timer && config->pwm_op == op) {
+      wheels[i]->duty = duty;
+    }
+  }
+}
+
+void plant_silence_sensor(enum sensor_position position) {
+  silenced[position] = true;
+}
+
+int32_t plant_encoder_count(int unit) {
+  wheel *wheels[] = {&left_wheel, &right_wheel};
+  for (int i = 0; i < 2; i++) {
+    if (wheels[i]->config != NULL && wheels[i]->config->encoder_unit == unit) {
+      return (int32_t)floor(wheels[i]->counts);
+    }
+  }
+  return 0;
+}
+
+sim_pose plant_pose() { return truth; }
+
+plant_stats plant_get_stats() { return stats; }
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "driver/gpio.h"
+#include "driver/mcpwm.h"
+
+#include "controller.h"
+#include "motor.h"
+#include "world.h"
+
+// Simulated robot body: a differential drive with first-order motor lag,
+// and ultrasonic sensors that echo off the walls of a world map
+
+typedef struct {
+  float x;
+  float y;
+  float theta;
+} sim_pose;
+
+typedef struct {
+  int collisions;
+  float distance_cm;
+  int cells_visited;
+  int free_cells;
+} plant_stats;
+
+// Call after the motors are initialized, starts the physics tick
+void plant_init(const world *w, sim_pose start, const motor *left,
+                const motor *right, uint32_t seed);
+
+// Hooks called by hal_sim.c when the firmware drives an output
+void plant_on_gpio(gpio_num_t pin, int level);
+void plant_on_pwm(mcpwm_unit_t unit, mcpwm_timer_t timer, mcpwm_operator_t op,
+                  float duty);
+
+// Stop a sensor from answering its trigger, as if it were unplugged
+void plant_silence_sensor(enum sensor_position position);
+
+// Encoder counts of the wheel whose motor uses pulse counter unit
+int32_t plant_encoder_count(int unit);
+
+sim_pose plant_pose();
+plant_stats plant_get_stats();
@@ -0,0 +1,300 @@
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "controller.h"
+#include "deferred_log.h"
+#include "link.h"
+#include "motor.h"
+#include "odometry.h"
+#include "params.h"
+#include "recorder.h"
+#include "sim.h"
+#include "tasks.h"
+#include "wiring.h"
+
+// How long to keep running after the last record, so commands due at that
+// same instant still get issued
+#define TAIL_US 1000000
+
+typedef struct {
+  record *records;
+  size_t count;
+  // Time of the last record, where the recording stopped
+  int64_t end_us;
+  // Next record to look at for each stream
+  size_t next_input;
+  size_t next_random;
+  size_t next_command;
+
+  size_t inputs_fed;
+  size_t commands_matched;
+  size_t gaps;
+  bool diverged;
+  TaskHandle_t feeder;
+} replay;
+
+static replay run;
+
+static bool is_input(enum record_type type) {
+  return type != record_type_random && type != record_type_command;
+}
+
+// Find the next record of type from *cursor onwards, or NULL
+static const record *next_of(enum record_type type, size_t *cursor) {
+  while (*cursor < run.count && run.records[*cursor].type != type) {
+    (*cursor)++;
+  }
+  return *cursor < run.count ? &run.records[(*cursor)++] : NULL;
+}
+
+static const char *command_name(enum motor_command command) {
+  switch (command) {
+  case motor_coast:
+    return "coast";
+  case motor_brake:
+    return "brake";
+  case motor_drive:
+    return "drive";
+  }
+  return "?";
+}
+
+static void print_command(const char *label, const record *rec) {
+  printf("  %s t=%.6fs motor=%u %s %.2f\n", label, rec->time_us / 1e6,
+         rec->command.motor, command_name(rec->command.command),
+         rec->command.speed);
+}
+
+static void diverge(const record *expected, const record *issued) {
+  if (run.diverged) {
+    return;
+  }
+  run.diverged = true;
+  printf("diverged after %zu matching motor commands\n", run.commands_matched);
+  if (expected != NULL) {
+    print_command("recorded", expected);
+  } else {
+    printf("  recorded nothing more\n");
+  }
+  if (issued != NULL) {
+    print_command("replayed", issued);
+  } else {
+    printf("  replayed nothing more\n");
+  }
+}
+
+static uint32_t replay_random(void *arg) {
+  const record *rec = next_of(record_type_random, &run.next_random);
+  if (rec == NULL) {
+    if (sim_now_us() <= run.end_us) {
+      printf("controller drew more random numbers than were recorded\n");
+      run.diverged = true;
+    }
+    return 0;
+  }
+  return rec->random;
+}
+
+static void replay_command(const record *issued, void *arg) {
+  if (issued->time_us > run.end_us) {
+    // Nothing to compare against once past the end of the log
+    return;
+  }
+  const record *expected = next_of(record_type_command, &run.next_command);
+  if (expected == NULL || expected->time_us != issued->time_us ||
+      expected->command.motor != issued->command.motor ||
+      expected->command.command != issued->command.command ||
+      expected->command.speed != issued->command.speed) {
+    diverge(expected, issued);
+  } else if (!run.diverged) {
+    run.commands_matched++;
+  }
+}
+
+static void feed(const record *rec) {
+  switch (rec->type) {
+  case record_type_distance:
+    controller_publish_distance(rec->distance.sensor, rec->distance.distance,
+                                rec->distance.rate, rec->distance.echo_us);
+    break;
+  case record_type_remote: {
+    remote_event event = {.type = rec->remote.type,
+                          .received_at = rec->time_us};
+    if (event.type == position) {
+      event.new_position[X_IDX] = rec->remote.position[X_IDX];
+      event.new_position[Y_IDX] = rec->remote.position[Y_IDX];
+    } else {
+      event.new_mode = rec->remote.mode;
+    }
+    control_submit(&event);
+    break;
+  }
+  case record_type_link:
+    switch (rec->link.kind) {
+    case record_link_frame:
+      link_frame_received(rec->link.client, rec->time_us);
+      break;
+    case record_link_heartbeat:
+      link_heartbeat_received(rec->link.client, rec->link.sequence);
+      break;
+    case record_link_driver:
+      link_set_driver(rec->link.client);
+      break;
+    case record_link_closed:
+      link_client_closed(rec->link.client);
+      break;
+    }
+    break;
+  case record_type_odometry:
+    odometry_update(rec->odometry.left_cm, rec->odometry.right_cm);
+    break;
+  case record_type_param:
+    if (rec->param.id < PARAM_COUNT) {
+      param_set(rec->param.id, rec->param.value);
+    }
+    break;
+  case record_type_gap:
+    printf("log lost %u records at t=%.6fs, replay may diverge\n",
+           rec->dropped, rec->time_us / 1e6);
+    run.gaps++;
+    break;
+  default:
+    break;
+  }
+  run.inputs_fed++;
+}
+
+static void wake_feeder(void *arg) {
+  xTaskNotifyFromISR(run.feeder, 0, eNoAction, NULL);
+}
+
+// Stands in for every input source. It runs above all of them so that
+// inputs recorded at the same time all arrive before anything reacts.
+static void feed_inputs(void *arg) {
+  for (; run.next_input < run.count; run.next_input++) {
+    const record *rec = &run.records[run.next_input];
+    if (!is_input(rec->type)) {
+      continue;
+    }
+
+    if (rec->time_us > sim_now_us()) {
+      sim_schedule(rec->time_us, wake_feeder, NULL);
+      xTaskNotifyWait(0, UINT32_MAX, NULL, portMAX_DELAY);
+    }
+    feed(rec);
+  }
+
+  while (true) {
+    vTaskDelay(portMAX_DELAY);
+  }
+}
+
+static bool load(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+  fseek(file, 0, SEEK_END);
+  long len = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t *buf = malloc(len > 0 ? len : 1);
+  bool read_all = fread(buf, 1, len, file) == (size_t)len;
+  fclose(file);
+
+  int64_t time_us;
+  if (!read_all || !recorder_decode_header(buf, len, &time_us)) {
+    fprintf(stderr, "%s is not a recording\n", path);
+    free(buf);
+    return false;
+  }
+
+  // Every record takes at least two bytes
+  run.records = malloc((len / 2 + 1) * sizeof(record));
+  size_t offset = RECORD_HEADER_LEN;
+  size_t used;
+  while ((used = recorder_decode(&buf[offset], len - offset, time_us,
+                                 &run.records[run.count])) > 0) {
+    time_us = run.records[run.count].time_us;
+    run.count++;
+    offset += used;
+  }
+  run.end_us = time_us;
+
+  free(buf);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  static const struct option options[] = {
+      {"verbose", no_argument, NULL, 'v'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "v", options, NULL)) != -1) {
+    switch (opt) {
+    case 'v':
+      esp_log_level_set("*", ESP_LOG_INFO);
+      break;
+    default:
+      optind = argc;
+      break;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [--verbose] LOG\n", argv[0]);
+    return 2;
+  }
+  if (!load(argv[optind])) {
+    return 1;
+  }
+
+  // Same boot sequence as the recording, with the replay standing in for
+  // the motor task, the sensors and the network
+  sim_init();
+  deferred_log_init();
+  // The log starts with every parameter's value at boot
+  params_init();
+  recorder_replay(&(recorder_replay_hooks){
+      .random = replay_random, .command = replay_command, .arg = NULL});
+  global_controller.left_motor =
+      initialize_motor(BIN1_GPIO, BIN2_GPIO, STDBY_GPIO, PWMB_GPIO,
+                       MCPWM_UNIT_0, MCPWM_TIMER_0, MCPWM_OPR_A);
+  global_controller.right_motor =
+      initialize_motor(AIN1_GPIO, AIN2_GPIO, STDBY_GPIO, PWMA_GPIO,
+                       MCPWM_UNIT_1, MCPWM_TIMER_1, MCPWM_OPR_B);
+  control_init();
+
+  const task_config *highest = task_get_config(task_motor_control);
+  xTaskCreatePinnedToCore(feed_inputs, "replay", 4096, NULL,
+                          highest->priority + 1, &run.feeder, highest->core);
+
+  struct timespec started, finished;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  sim_run_until(run.end_us + TAIL_US);
+  clock_gettime(CLOCK_MONOTONIC, &finished);
+
+  // Anything recorded but never issued
+  const record *missing = next_of(record_type_command, &run.next_command);
+  if (missing != NULL) {
+    diverge(missing, NULL);
+  }
+
+  double wall_s = (finished.tv_sec - started.tv_sec) +
+                  (finished.tv_nsec - started.tv_nsec) / 1e9;
+  printf("records=%zu inputs=%zu commands_matched=%zu gaps=%zu "
+         "simulated=%.1fs speedup=%.0fx %s\n",
+         run.count, run.inputs_fed, run.commands_matched, run.gaps,
+         run.end_us / 1e6, run.end_us / 1e6 / (wall_s > 0 ? wall_s : 1e-9),
+         run.diverged ? "DIVERGED" : "identical");
+
+  return run.diverged ? 1 : 0;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+// Virtual-time scheduler behind the host FreeRTOS stand-in
+//
+// Each FreeRTOS task is backed by a pthread, but only one of them runs at a
+// time and the clock only moves forward when every task is blocked. That
+// makes a run deterministic for a given seed and lets it go as fast as the
+// host can execute the firmware code.
+
+typedef void (*sim_event_fn)(void *arg);
+
+// Must be called once, from the thread that will later call sim_run_until()
+void sim_init();
+
+int64_t sim_now_us();
+
+// Run fn at the given virtual time from interrupt context, i.e. outside of
+// any task. Events at the same time run in the order they were scheduled.
+void sim_schedule(int64_t at_us, sim_event_fn fn, void *arg);
+
+// Run tasks and events until the clock reaches end_us or nothing is left to
+// do
+void sim_run_until(int64_t end_us);
@@ -0,0 +1,121 @@
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_log.h"
+
+#include "episode.h"
+#include "trace.h"
+#include "world.h"
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--episodes N] [--duration SECONDS] [--seed N] "
+          "[--world FILE] [--record FILE] [--trace] [--verbose]\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  int episodes = 1;
+  double duration_s = 60;
+  uint32_t seed = 1;
+  const char *world_path = NULL;
+  const char *record_path = NULL;
+  bool print_trace = false;
+
+  static const struct option options[] = {
+      {"episodes", required_argument, NULL, 'n'},
+      {"duration", required_argument, NULL, 'd'},
+      {"seed", required_argument, NULL, 's'},
+      {"world", required_argument, NULL, 'w'},
+      {"record", required_argument, NULL, 'r'},
+      {"trace", no_argument, NULL, 't'},
+      {"verbose", no_argument, NULL, 'v'},
+      {NULL, 0, NULL, 0},
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:d:s:w:r:tv", options, NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      episodes = atoi(optarg);
+      break;
+    case 'd':
+      duration_s = atof(optarg);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 0);
+      break;
+    case 'w':
+      world_path = optarg;
+      break;
+    case 'r':
+      record_path = optarg;
+      break;
+    case 't':
+      print_trace = true;
+      break;
+    case 'v':
+      esp_log_level_set("*", ESP_LOG_INFO);
+      break;
+    default:
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  world w;
+  if (world_path == NULL) {
+    world_load_default(&w);
+  } else if (!world_load(&w, world_path)) {
+    fprintf(stderr, "could not load world map %s\n", world_path);
+    return 1;
+  }
+
+  double total_collisions = 0;
+  double total_coverage = 0;
+  for (int i = 0; i < episodes; i++) {
+    // Each episode gets its own log when there are several
+    char episode_record_path[256];
+    if (record_path != NULL && episodes > 1) {
+      snprintf(episode_record_path, sizeof(episode_record_path), "%s.%u",
+               record_path, seed + i);
+    } else if (record_path != NULL) {
+      snprintf(episode_record_path, sizeof(episode_record_path), "%s",
+               record_path);
+    }
+
+    episode_result result;
+    if (fork_episode(&w, seed + i, duration_s,
+                     record_path != NULL ? episode_record_path : NULL,
+                     &result) != 0) {
+      fprintf(stderr, "episode with seed %u failed\n", seed + i);
+      return 1;
+    }
+
+    double coverage = 100.0 * result.stats.cells_visited /
+                      result.stats.free_cells;
+    printf("seed=%u collisions=%d distance_cm=%.0f coverage=%.1f%%\n",
+           result.seed, result.stats.collisions, result.stats.distance_cm,
+           coverage);
+
+    for (int point = 0; print_trace && point < TRACE_POINT_COUNT; point++) {
+      const trace_stats *stats = &result.trace[point];
+      if (stats->count > 0) {
+        printf("  %-16s count=%u min=%uus avg=%uus p99=%uus max=%uus\n",
+               trace_point_name(point), stats->count, stats->min_us,
+               stats->avg_us, stats->p99_us, stats->max_us);
+      }
+    }
+
+    total_collisions += result.stats.collisions;
+    total_coverage += coverage;
+  }
+
+  printf("episodes=%d collisions_per_min=%.2f mean_coverage=%.1f%%\n",
+         episodes, total_collisions / (episodes * duration_s / 60),
+         total_coverage / episodes);
+
+  return 0;
+}
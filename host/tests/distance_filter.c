@@ -0,0 +1,80 @@
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "distance_filter.h"
+#include "ultrasonic.h"
+
+// After a gap in readings the alpha-beta tracker must not extrapolate its
+// old rate of change: a 1 s gap may not carry the estimate out of range,
+// and one past ULTRASONIC_STALE_MS starts over from the new sample.
+
+#define SAMPLE_PERIOD_US 50000
+#define GAP_US 1000000
+
+static const filter_stage stages[] = {
+    {.type = filter_alpha_beta,
+     .alpha_beta = {.alpha = 0.5,
+                    .beta = 0.1,
+                    .max_cm = ULTRASONIC_MAX_RANGE_CM,
+                    .max_gap_ms = ULTRASONIC_STALE_MS}},
+};
+static const filter_config config = {stages, 1};
+
+static distance_filter filter;
+static int64_t now_us;
+
+// Feed a target moving at speed cm/s for duration_us, ending at end_cm
+static void track(float end_cm, float speed, int64_t duration_us) {
+  for (int64_t t = 0; t <= duration_us; t += SAMPLE_PERIOD_US) {
+    float distance = end_cm - speed * (duration_us - t) / 1e6f;
+    distance_filter_push(&filter, distance, now_us + t);
+  }
+  now_us += duration_us;
+}
+
+static bool in_range(const char *what) {
+  printf("%s: %.1f cm at %.1f cm/s\n", what, filter.distance,
+         filter.velocity);
+  if (filter.distance < 0 || filter.distance > ULTRASONIC_MAX_RANGE_CM) {
+    fprintf(stderr, "%s: estimate %.1f cm is out of range\n", what,
+            filter.distance);
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  distance_filter_init(&filter, &config);
+
+  // Closing in at 100 cm/s, then the robot stops 40 cm away while the
+  // sensor is silent
+  track(40, -100, GAP_US);
+  now_us += GAP_US;
+  distance_filter_push(&filter, 40, now_us);
+  if (!in_range("stopped after 1 s gap")) {
+    return 1;
+  }
+
+  // Receding at 200 cm/s up to the edge of the range
+  now_us += SAMPLE_PERIOD_US;
+  track(ULTRASONIC_MAX_RANGE_CM, 200, GAP_US);
+  now_us += GAP_US;
+  distance_filter_push(&filter, ULTRASONIC_MAX_RANGE_CM, now_us);
+  if (!in_range("at range after 1 s gap")) {
+    return 1;
+  }
+
+  // Closing in again, then silent for longer than a reading stays fresh
+  now_us += SAMPLE_PERIOD_US;
+  track(100, -100, GAP_US);
+  now_us += ULTRASONIC_STALE_MS * 1000LL + SAMPLE_PERIOD_US;
+  distance_filter_push(&filter, 250, now_us);
+  if (!in_range("after stale gap")) {
+    return 1;
+  }
+  if (filter.distance != 250 || filter.velocity != 0) {
+    fprintf(stderr, "stale gap should re-seed at 250 cm, 0 cm/s\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,50 @@
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "link.h"
+
+// Sockets are reused as soon as they close. A client that gets the socket
+// of a driver that disconnected must not bring that driver's link back, or
+// the robot would keep driving on its last position.
+
+#define CLIENT_FD 5
+#define FRAME_GAP_US 50000
+
+static bool expect_lost(int64_t now, bool lost, const char *when) {
+  if (link_lost(now) != lost) {
+    fprintf(stderr, "link should be %s %s\n", lost ? "lost" : "up", when);
+    return false;
+  }
+  return true;
+}
+
+int main() {
+  int64_t now = 1000000;
+  link_frame_received(CLIENT_FD, now);
+  link_set_driver(CLIENT_FD);
+  if (!expect_lost(now, false, "while the driver sends frames")) {
+    return 1;
+  }
+
+  link_client_closed(CLIENT_FD);
+  if (!expect_lost(now, true, "once the driver disconnects")) {
+    return 1;
+  }
+
+  now += FRAME_GAP_US;
+  link_frame_received(CLIENT_FD, now);
+  if (!expect_lost(now, true, "when a new client reuses the socket")) {
+    return 1;
+  }
+
+  link_set_driver(CLIENT_FD);
+  if (!expect_lost(now, false, "once the new client is made driver")) {
+    return 1;
+  }
+
+  link_set_driver(LINK_NO_CLIENT);
+  if (!expect_lost(now, false, "with nobody driving")) {
+    return 1;
+  }
+  return 0;
+}
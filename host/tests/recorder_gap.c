@@ -0,0 +1,99 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "controller.h"
+#include "episode.h"
+#include "hal_sim.h"
+#include "recorder.h"
+#include "sim.h"
+#include "world.h"
+
+// While driving, the recorder drops what doesn't fit in the storage it
+// erased ahead of time. Once stopped it catches up and logs a gap. Records
+// stored after the gap must still decode to the time they were made.
+
+// Long enough to fill the first sector and start dropping
+#define STOP_AT_US 10000000
+// Long enough after stopping for the erase to catch up
+#define MARK_AT_US 11000000
+#define END_US 12000000
+
+static void submit_mode(enum control_mode new_mode) {
+  remote_event event = {.type = mode, .new_mode = new_mode};
+  control_submit(&event);
+}
+
+int main() {
+  char path[] = "/tmp/recorder_gap_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+
+  world w;
+  world_load_default(&w);
+  hal_sim_record_erase_stalls(true);
+  episode_boot(&w, (sim_pose){220, 220, 0}, 1, path);
+
+  sim_run_until(STOP_AT_US);
+  submit_mode(mode_off);
+  sim_run_until(MARK_AT_US);
+  // Marks a known time in the log
+  submit_mode(mode_off);
+  sim_run_until(END_US);
+  recorder_flush();
+
+  FILE *file = fopen(path, "rb");
+  static uint8_t log[1 << 20];
+  size_t len = file != NULL ? fread(log, 1, sizeof(log), file) : 0;
+  if (file != NULL) {
+    fclose(file);
+  }
+  unlink(path);
+
+  int64_t time_us;
+  if (!recorder_decode_header(log, len, &time_us)) {
+    fprintf(stderr, "no record log header\n");
+    return 1;
+  }
+
+  uint32_t dropped = 0;
+  bool marked = false;
+  int64_t mark_time_us = 0;
+  record rec;
+  size_t used;
+  for (size_t offset = RECORD_HEADER_LEN;
+       (used = recorder_decode(log + offset, len - offset, time_us, &rec)) > 0;
+       offset += used) {
+    time_us = rec.time_us;
+    if (rec.type == record_type_gap) {
+      dropped += rec.dropped;
+    } else if (rec.type == record_type_remote && rec.remote.type == mode &&
+               rec.time_us > STOP_AT_US) {
+      marked = true;
+      mark_time_us = rec.time_us;
+    }
+  }
+
+  printf("%u records dropped, mark decoded at %lld us\n", (unsigned)dropped,
+         (long long)mark_time_us);
+  if (dropped == 0) {
+    fprintf(stderr, "nothing was dropped, the test proves nothing\n");
+    return 1;
+  }
+  if (!marked) {
+    fprintf(stderr, "mark recorded at %d us is missing or decoded early\n",
+            MARK_AT_US);
+    return 1;
+  }
+  if (mark_time_us != MARK_AT_US) {
+    fprintf(stderr, "mark recorded at %d us decoded at %lld us\n",
+            MARK_AT_US, (long long)mark_time_us);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "controller.h"
+#include "episode.h"
+#include "params.h"
+#include "plant.h"
+#include "sim.h"
+#include "ultrasonic.h"
+#include "world.h"
+
+// Unplugging the front sensor mid-course must slow autonomous driving down,
+// not leave it cruising blind on what it last saw
+
+// Open floor ahead of the start, so nothing else makes the robot stop
+#define START_X_CM 220.0f
+#define START_Y_CM 220.0f
+
+#define SILENCE_AT_US 2000000
+#define END_US 12000000
+#define SAMPLE_US 20000
+// Speed cap while a forward sensor is silent, see controller.c
+#define STALE_LIMIT 30
+// Time allowed after the sensor goes stale to notice and re-command
+#define REACTION_US 100000
+
+// Wheel target of a straight forward course, or 0 when turning or stopped
+static float forward_target() {
+  controller_snapshot snapshot;
+  controller_read_snapshot(&snapshot);
+  if (snapshot.left_target != snapshot.right_target ||
+      snapshot.left_target <= 0) {
+    return 0;
+  }
+  return snapshot.left_target;
+}
+
+int main() {
+  world w;
+  world_load_default(&w);
+  episode_boot(&w, (sim_pose){START_X_CM, START_Y_CM, 0}, 1, NULL);
+
+  float fastest_before = 0;
+  float fastest_after = 0;
+  int64_t slowed_by =
+      SILENCE_AT_US + ULTRASONIC_STALE_MS * 1000LL + REACTION_US;
+  for (int64_t now = SAMPLE_US; now <= END_US; now += SAMPLE_US) {
+    if (now == SILENCE_AT_US) {
+      plant_silence_sensor(sensor_front);
+    }
+    sim_run_until(now);
+
+    float target = forward_target();
+    if (now < SILENCE_AT_US && target > fastest_before) {
+      fastest_before = target;
+    } else if (now >= slowed_by && target > fastest_after) {
+      fastest_after = target;
+    }
+  }
+
+  printf("fastest forward target: %.1f before, %.1f after silencing\n",
+         fastest_before, fastest_after);
+  if (fastest_before <= STALE_LIMIT) {
+    fprintf(stderr, "never cruised above the stale limit to begin with\n");
+    return 1;
+  }
+  if (fastest_after > STALE_LIMIT) {
+    fprintf(stderr, "still cruising at %.1f with the front sensor silent\n",
+            fastest_after);
+    return 1;
+  }
+  return 0;
+}
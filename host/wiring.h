@@ -0,0 +1,20 @@
+#pragma once
+
+// Same wiring as robot_esp32_main.c
+#define BIN1_GPIO 23
+#define BIN2_GPIO 22
+#define PWMB_GPIO 13
+
+#define AIN1_GPIO 14
+#define AIN2_GPIO 27
+#define PWMA_GPIO 26
+
+#define STDBY_GPIO 12
+
+#define LEFT_ENCODER_A_GPIO 36
+#define LEFT_ENCODER_B_GPIO 19
+#define LEFT_ENCODER_PCNT 0
+
+#define RIGHT_ENCODER_A_GPIO 39
+#define RIGHT_ENCODER_B_GPIO 21
+#define RIGHT_ENCODER_PCNT 1
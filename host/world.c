@@ -0,0 +1,162 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "world.h"
+
+// 4 m x 3 m room with a couple of boxes and a table leg field
+static const char *DEFAULT_MAP[] = {
+    "################################################################################",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#...........########...........................................................#",
+    "#...........########...........................................................#",
+    "#...........########...........................................................#",
+    "#...........########...........................................................#",
+    "#...........########...........................................................#",
+    "#...........########.......................................##..........##......#",
+    "#...........########.......................................##..........##......#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..........................................................##..........##......#",
+    "#..........................................................##..........##......#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................##########......................................#",
+    "#..............................##########......................................#",
+    "#..............................##########......................................#",
+    "#..............................##########......................................#",
+    "#..............................##########......................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#.........................................................................######",
+    "#.........................................................................######",
+    "#.........................................................................######",
+    "#.........................................................................######",
+    "#.........................................................................######",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "#..............................................................................#",
+    "################################################################################",
+};
+
+static void world_from_lines(world *w, const char **lines, int height) {
+  int width = 0;
+  for (int row = 0; row < height; row++) {
+    int len = strlen(lines[row]);
+    if (len > width) {
+      width = len;
+    }
+  }
+
+  w->width = width;
+  w->height = height;
+  w->cells = calloc(width * height, 1);
+  for (int row = 0; row < height; row++) {
+    int len = strlen(lines[row]);
+    for (int col = 0; col < width; col++) {
+      w->cells[row * width + col] = col >= len || lines[row][col] == '#';
+    }
+  }
+}
+
+void world_load_default(world *w) {
+  world_from_lines(w, DEFAULT_MAP, sizeof(DEFAULT_MAP) / sizeof(*DEFAULT_MAP));
+}
+
+bool world_load(world *w, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return false;
+  }
+
+  char *lines[1024];
+  char line[1024];
+  int height = 0;
+  while (height < 1024 && fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    lines[height++] = strdup(line);
+  }
+  fclose(file);
+
+  world_from_lines(w, (const char **)lines, height);
+  for (int row = 0; row < height; row++) {
+    free(lines[row]);
+  }
+
+  return height > 0;
+}
+
+bool world_occupied(const world *w, float x, float y) {
+  int col = (int)floorf(x / WORLD_CELL_CM);
+  int row = (int)floorf(y / WORLD_CELL_CM);
+  if (col < 0 || row < 0 || col >= w->width || row >= w->height) {
+    return true;
+  }
+  return w->cells[row * w->width + col];
+}
+
+bool world_collides(const world *w, float x, float y, float radius) {
+  // Sample the circle outline and center, fine enough for 5 cm cells
+  if (world_occupied(w, x, y)) {
+    return true;
+  }
+  for (int i = 0; i < 16; i++) {
+    float angle = i * (float)M_PI / 8;
+    if (world_occupied(w, x + radius * cosf(angle), y + radius * sinf(angle))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+float world_raycast(const world *w, float x, float y, float theta,
+                    float max_range) {
+  const float step = 0.5f;
+  float dx = cosf(theta);
+  float dy = sinf(theta);
+
+  for (float range = 0; range < max_range; range += step) {
+    if (world_occupied(w, x + dx * range, y + dy * range)) {
+      return range;
+    }
+  }
+  return max_range;
+}
+
+int world_free_cells(const world *w) {
+  int free_cells = 0;
+  for (int i = 0; i < w->width * w->height; i++) {
+    free_cells += !w->cells[i];
+  }
+  return free_cells;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// 2D occupancy map the simulated robot drives around in
+//
+// Maps are plain text, one character per WORLD_CELL_CM square cell: '#' is
+// a wall or obstacle, anything else is free floor. Everything outside the
+// map counts as a wall.
+#define WORLD_CELL_CM 5.0f
+
+typedef struct {
+  int width;
+  int height;
+  uint8_t *cells;
+} world;
+
+bool world_load(world *w, const char *path);
+void world_load_default(world *w);
+
+bool world_occupied(const world *w, float x, float y);
+
+// Whether a robot of the given radius centered at x, y overlaps a wall
+bool world_collides(const world *w, float x, float y, float radius);
+
+// Distance in cm along the ray until it hits a wall, capped at max_range
+float world_raycast(const world *w, float x, float y, float theta,
+                    float max_range);
+
+int world_free_cells(const world *w);
@@ -1,66 +1,133 @@
+#include <assert.h>
+
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include "freertos/task.h"
 #include "math.h"
 
 #include "controller.h"
+#include "deferred_log.h"
+#include "hal.h"
+#include "latch.h"
+#include "link.h"
 #include "motor.h"
-#include "server.h"
+#include "odometry.h"
+#include "params.h"
+#include "recorder.h"
+#include "tasks.h"
+#include "trace.h"
+#include "ultrasonic.h"
 
 static const char *TAG = "robot-controller";
 
+controller global_controller;
+
+// Each writer keeps its own working copy and publishes it through a latch
+// after every change. The remote state belongs to the remote_input task, the
+// sensor state to the ultrasonic task.
+static remote_state remote = {.remote_position = {0, 0}, .mode = mode_off};
+static sensor_state sensors;
+static LATCH(remote_state) remote_latch;
+static LATCH(sensor_state) sensor_latch;
+
+// Remote events waiting for the remote_input task, see control_submit()
+#define MODE_QUEUE_LENGTH 4
+static xQueueHandle position_mailbox;
+static xQueueHandle mode_queue;
+static uint32_t next_sequence = 0;
+
+static TaskHandle_t remote_task = NULL;
+static TaskHandle_t autonomous_task = NULL;
+
 static float clamped(float x) {
   float upper = 100;
   float lower = -100;
   return fmin(upper, fmax(x, lower));
 }
 
-static float X_FACTOR = 2;
+// Manual driving is slowed down near obstacles ahead. Full speed is allowed
+// GOVERNOR_SLOWDOWN_CM beyond the stop distance, tapering linearly to zero
+// at it, and further still when the time to contact gets short. Steering
+// and reversing are left alone so the driver can always get away.
+#define GOVERNOR_STOP_CM 20
+#define GOVERNOR_SLOWDOWN_CM 100
+#define GOVERNOR_MIN_CONTACT_S 1.0f
+// Smallest change in the governed speed worth re-commanding the motors for
+#define GOVERNOR_RESYNC_STEP 2
+
+// Forward speed cap, manual or autonomous, while a forward facing sensor is
+// silent. Slow enough to stop for whatever the sensors that still work can
+// see.
+#define GOVERNOR_STALE_LIMIT 30
+
+#define FORWARD_SENSORS                                                        \
+  ((1 << sensor_front) | (1 << sensor_front_left) | (1 << sensor_front_right))
+
+// Forward speed limit from the last control_sync()
+static float forward_limit = 100;
+
+static float forward_speed_limit(const sensor_state *view) {
+  float cap = view->stale & FORWARD_SENSORS ? GOVERNOR_STALE_LIMIT : 100;
+  float front = view->distances[sensor_front];
+  float clearance = fminf(front, fminf(view->distances[sensor_front_left],
+                                       view->distances[sensor_front_right]));
+  float limit = 100 * (clearance - GOVERNOR_STOP_CM) / GOVERNOR_SLOWDOWN_CM;
+
+  float closing = -view->distance_rates[sensor_front];
+  if (closing > 0) {
+    float contact_s = (front - GOVERNOR_STOP_CM) / closing;
+    if (contact_s < GOVERNOR_MIN_CONTACT_S) {
+      limit *= fmaxf(contact_s, 0) / GOVERNOR_MIN_CONTACT_S;
+    }
+  }
 
-static float left_target() {
-  float x = global_controller.remote_position[X_IDX];
-  float y = global_controller.remote_position[Y_IDX];
+  return fminf(cap, fmaxf(limit, 0));
+}
 
-  return clamped(y + (x / X_FACTOR));
+static float governed_forward(float limit) {
+  return fminf(remote.remote_position[Y_IDX], limit);
 }
 
-static float right_target() {
-  float x = global_controller.remote_position[X_IDX];
-  float y = global_controller.remote_position[Y_IDX];
+float control_mix(const float position[2], const sensor_state *view,
+                  float *left, float *right) {
+  float limit = forward_speed_limit(view);
+  float x = position[X_IDX] / param_get(param_steer_divisor);
+  float y = fminf(position[Y_IDX], limit);
 
-  return clamped(y - (x / X_FACTOR));
+  *left = clamped(y + x);
+  *right = clamped(y - x);
+  return limit;
 }
 
-static float MIN_SPEED = 7;
-
 static void control_sync() {
-  {
-    float target_speed = left_target();
+  sensor_state view;
+  controller_read_sensors(&view);
+  float left_target, right_target;
+  forward_limit =
+      control_mix(remote.remote_position, &view, &left_target, &right_target);
 
-    if (fabsf(target_speed) < MIN_SPEED) {
-      stop_motor(&global_controller.left_motor);
-    } else {
-      set_motor_speed(&global_controller.left_motor, target_speed);
-    }
+  if (fabsf(left_target) < param_get(param_left_deadband)) {
+    stop_motor(&global_controller.left_motor);
+  } else {
+    set_motor_speed(&global_controller.left_motor, left_target);
   }
-  {
-    float target_speed = right_target();
 
-    if (fabsf(target_speed) < 10) {
-      stop_motor(&global_controller.right_motor);
-    } else {
-      set_motor_speed(&global_controller.right_motor, target_speed);
-    }
+  if (fabsf(right_target) < param_get(param_right_deadband)) {
+    stop_motor(&global_controller.right_motor);
+  } else {
+    set_motor_speed(&global_controller.right_motor, right_target);
   }
 }
 
 static void update_position(float new_position[2]) {
-  if (global_controller.mode != mode_manual) {
+  if (remote.mode != mode_manual) {
     return;
   }
 
-  global_controller.remote_position[X_IDX] = new_position[X_IDX];
-  global_controller.remote_position[Y_IDX] = new_position[Y_IDX];
+  remote.remote_position[X_IDX] = new_position[X_IDX];
+  remote.remote_position[Y_IDX] = new_position[Y_IDX];
+  latch_publish(&remote_latch, &remote);
 
   if (new_position[X_IDX] == 0 && new_position[Y_IDX] == 0) {
     stop_motor(&global_controller.left_motor);
@@ -72,10 +139,21 @@ static void update_position(float new_position[2]) {
 static void update_mode(enum control_mode mode) {
   stop_motor(&global_controller.left_motor);
   stop_motor(&global_controller.right_motor);
-  global_controller.mode = mode;
+  remote.mode = mode;
+  latch_publish(&remote_latch, &remote);
+  control_notify(CONTROL_EVENT_MODE);
+}
+
+// Trace point against origin once the motors act on their next commands
+static void trace_next_commands(enum trace_point point, int64_t origin) {
+  trace_next_command(&global_controller.left_motor, point, origin);
+  trace_next_command(&global_controller.right_motor, point, origin);
 }
 
 static void update_state(remote_event *event) {
+  trace_record(trace_remote_decision, event->received_at);
+
+  trace_next_commands(trace_remote_motor, event->received_at);
   switch (event->type) {
   case position:
     update_position(event->new_position);
@@ -84,101 +162,412 @@ static void update_state(remote_event *event) {
     update_mode(event->new_mode);
     break;
   }
+  // Positions outside manual mode don't command the motors
+  trace_next_commands(trace_remote_motor, -1);
+}
+
+// How often manual driving checks that the remote is still there
+#define LINK_CHECK_MS 50
+
+// Ramp down to a stop if the driving client went quiet. The next position
+// it sends takes over again.
+static void check_link() {
+  bool moving = remote.remote_position[X_IDX] != 0 ||
+                remote.remote_position[Y_IDX] != 0;
+  if (!moving || !link_lost(hal_time_us())) {
+    return;
+  }
+
+  ESP_LOGW(TAG, "Control link lost, stopping");
+  remote.remote_position[X_IDX] = 0;
+  remote.remote_position[Y_IDX] = 0;
+  latch_publish(&remote_latch, &remote);
+  set_motor_speed(&global_controller.left_motor, 0);
+  set_motor_speed(&global_controller.right_motor, 0);
+}
+
+// Re-command the motors when new readings change how fast the driver may
+// go forward
+static void update_governor() {
+  if (remote.remote_position[Y_IDX] <= 0) {
+    return;
+  }
+
+  sensor_state view;
+  controller_read_sensors(&view);
+  float limit = forward_speed_limit(&view);
+  if (fabsf(governed_forward(limit) - governed_forward(forward_limit)) >=
+      GOVERNOR_RESYNC_STEP) {
+    control_sync();
+  }
 }
 
 static void remote_input() {
+  // Sequence of the last mode change applied, older positions were meant
+  // for the previous mode and are dropped
+  uint32_t mode_sequence = 0;
   remote_event event;
+
   while (true) {
-    if (xQueueReceive(control_queue, &event, portMAX_DELAY)) {
+    TickType_t wait = remote.mode == mode_manual
+                          ? LINK_CHECK_MS / portTICK_PERIOD_MS
+                          : portMAX_DELAY;
+    xTaskNotifyWait(0, 0, NULL, wait);
+
+    while (xQueueReceive(mode_queue, &event, 0)) {
+      mode_sequence = event.sequence;
       update_state(&event);
     }
+    if (xQueueReceive(position_mailbox, &event, 0) &&
+        (int32_t)(event.sequence - mode_sequence) > 0) {
+      update_state(&event);
+    }
+
+    if (remote.mode == mode_manual) {
+      check_link();
+      update_governor();
+    }
   }
 }
 
 typedef struct {
   int64_t last_changed;
-  enum { off, forward_motion, turning } status;
+  enum { off, forward_motion, braking, turning } status;
+  // Whether the current turn backs up
+  bool reversing;
+  // Speed commanded while in forward_motion
+  float speed;
 } autonomous_state;
 
-static void go_forward(autonomous_state *state, const int64_t current_time) {
+// Backing up is only safe with at least this much room behind
+#define REAR_CLEARANCE_CM 30
+
+// Cruise speed, held down like manual driving while a forward facing sensor
+// is silent
+static float cruise_speed(const sensor_state *view) {
+  float speed = param_get(param_cruise_speed);
+  if (view->stale & FORWARD_SENSORS) {
+    speed = fminf(speed, GOVERNOR_STALE_LIMIT);
+  }
+  return speed;
+}
+
+static void set_cruise(autonomous_state *state, float speed) {
+  state->speed = speed;
+  set_motor_speed(&global_controller.left_motor, speed);
+  set_motor_speed(&global_controller.right_motor, speed);
+}
+
+static void go_forward(autonomous_state *state, const int64_t current_time,
+                       const sensor_state *view) {
   state->status = forward_motion;
   state->last_changed = current_time;
-
-  set_motor_speed(&global_controller.left_motor, 40);
-  set_motor_speed(&global_controller.right_motor, 40);
+  set_cruise(state, cruise_speed(view));
 }
 
 static void forward_turn(autonomous_state *state, const int64_t current_time) {
   state->status = turning;
   state->last_changed = current_time;
+  state->reversing = false;
 
-  if ((esp_random() % 2) == 0) {
-    set_motor_speed(&global_controller.left_motor, 50);
+  float speed = param_get(param_turn_speed);
+  if ((record_random(hal_random()) % 2) == 0) {
+    set_motor_speed(&global_controller.left_motor, speed);
     stop_motor(&global_controller.right_motor);
   } else {
     stop_motor(&global_controller.left_motor);
-    set_motor_speed(&global_controller.right_motor, 50);
+    set_motor_speed(&global_controller.right_motor, speed);
   }
 }
 
-static void backward_turn(autonomous_state *state, const int64_t current_time) {
-  state->status = turning;
+// Stop dead, skipping the motion profile, before backing away
+static void emergency_stop(autonomous_state *state,
+                           const int64_t current_time) {
+  state->status = braking;
   state->last_changed = current_time;
 
-  if ((esp_random() % 2) == 0) {
+  brake_motor(&global_controller.left_motor);
+  brake_motor(&global_controller.right_motor);
+}
+
+// Back away from an obstacle, or spin on the spot when there is no room
+// behind us either
+static void backward_turn(autonomous_state *state, const int64_t current_time,
+                          const sensor_state *view) {
+  state->status = turning;
+  state->last_changed = current_time;
+  state->reversing = view->distances[sensor_rear] >= REAR_CLEARANCE_CM;
+
+  bool left = (record_random(hal_random()) % 2) == 0;
+  float speed = param_get(param_turn_speed);
+  if (!state->reversing) {
+    set_motor_speed(&global_controller.left_motor, left ? -speed : speed);
+    set_motor_speed(&global_controller.right_motor, left ? speed : -speed);
+  } else if (left) {
     stop_motor(&global_controller.left_motor);
-    set_motor_speed(&global_controller.right_motor, -50);
+    set_motor_speed(&global_controller.right_motor, -speed);
   } else {
-    set_motor_speed(&global_controller.left_motor, -50);
+    set_motor_speed(&global_controller.left_motor, -speed);
     stop_motor(&global_controller.right_motor);
   }
 }
 
+#define FORWARD_DURATION_US (param_get_int(param_forward_ms) * 1000LL)
+#define TURN_DURATION_US (param_get_int(param_turn_ms) * 1000LL)
+#define BRAKE_DURATION_US 300000
+#define NO_DEADLINE INT64_MAX
+
+// When the first forward facing sensor that is still fresh goes stale
+static int64_t next_stale(const sensor_state *view) {
+  int64_t earliest = NO_DEADLINE;
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    if ((FORWARD_SENSORS & (1 << i)) && !(view->stale & (1 << i))) {
+      int64_t stale_at =
+          view->distances_updated[i] + ULTRASONIC_STALE_MS * 1000LL + 1;
+      earliest = stale_at < earliest ? stale_at : earliest;
+    }
+  }
+  return earliest;
+}
+
+// Time at which the state machine wants to act even without new input
+static int64_t autonomous_deadline(const autonomous_state *state,
+                                   int64_t current_time,
+                                   const sensor_state *view) {
+  int64_t deadline;
+  switch (state->status) {
+  case forward_motion:
+    // Slow down as soon as a sensor goes silent, even if no other reading
+    // wakes us
+    deadline = state->last_changed + FORWARD_DURATION_US;
+    return deadline < next_stale(view) ? deadline : next_stale(view);
+  case braking:
+    return state->last_changed + BRAKE_DURATION_US;
+  case turning:
+    // Once the turn is done only a clear sensor reading can end it
+    if (current_time < state->last_changed + TURN_DURATION_US) {
+      return state->last_changed + TURN_DURATION_US;
+    }
+    return NO_DEADLINE;
+  default:
+    return NO_DEADLINE;
+  }
+}
+
+// How far ahead to extrapolate the front distance, roughly the time it takes
+// to read, decide and stop
+#define BRAKE_LOOKAHEAD_S 0.3f
+
+// Closest obstacle seen by any of the forward facing sensors. The front
+// distance is extrapolated by how fast we are closing in, so faster
+// approaches brake earlier.
+static float front_clearance(const sensor_state *view) {
+  float closing = fminf(0, view->distance_rates[sensor_front]);
+  float front = view->distances[sensor_front] + closing * BRAKE_LOOKAHEAD_S;
+  return fminf(front, fminf(view->distances[sensor_front_left],
+                            view->distances[sensor_front_right]));
+}
+
+// Echo time of the most recent reading from any sensor
+static int64_t latest_distance_update(const sensor_state *view) {
+  int64_t latest = 0;
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    if (view->distances_updated[i] > latest) {
+      latest = view->distances_updated[i];
+    }
+  }
+  return latest;
+}
+
+// origin is the echo time of the reading that woke us, or -1 when woken for
+// any other reason
+static void autonomous_step(autonomous_state *state, int64_t origin,
+                            const sensor_state *view) {
+  remote_state inputs;
+  controller_read_remote(&inputs);
+  if (inputs.mode != mode_autonomous) {
+    state->status = off;
+    return;
+  }
+
+  if (state->status == off) {
+    go_forward(state, hal_time_us(), view);
+  }
+
+  int64_t current_time = hal_time_us();
+
+  int64_t time_in_mode = current_time - state->last_changed;
+  bool obstructed = front_clearance(view) < param_get(param_obstructed_cm);
+
+  if (origin >= 0) {
+    trace_record(trace_sensor_decision, origin);
+    trace_next_commands(trace_sensor_motor, origin);
+  }
+
+  switch (state->status) {
+  case forward_motion:
+    if (obstructed) {
+      DLOGI(TAG, "Seeing obstacle ahead, stopping");
+      emergency_stop(state, current_time);
+    } else if (time_in_mode >= FORWARD_DURATION_US) {
+      DLOGI(TAG, "Getting bored of this course, switching it up");
+      forward_turn(state, current_time);
+    } else if (cruise_speed(view) != state->speed) {
+      set_cruise(state, cruise_speed(view));
+    }
+    break;
+  case braking:
+    if (time_in_mode >= BRAKE_DURATION_US) {
+      DLOGI(TAG, "Stopped, backing away");
+      backward_turn(state, current_time, view);
+    }
+    break;
+  case turning:
+    if (state->reversing &&
+        view->distances[sensor_rear] < REAR_CLEARANCE_CM) {
+      DLOGI(TAG, "Seeing obstacle behind, stopping");
+      emergency_stop(state, current_time);
+    } else if (time_in_mode >= TURN_DURATION_US && !obstructed) {
+      DLOGI(TAG, "Turn complete, resuming course");
+      go_forward(state, current_time, view);
+    }
+    break;
+  default:
+    break;
+  }
+
+  // Most readings leave the motors alone
+  trace_next_commands(trace_sensor_motor, -1);
+}
+
+// Ticks to wait for the deadline, rounded up so we never wake early
+static TickType_t ticks_until(int64_t deadline) {
+  if (deadline == NO_DEADLINE) {
+    return portMAX_DELAY;
+  }
+
+  int64_t remaining = deadline - hal_time_us();
+  if (remaining <= 0) {
+    return 0;
+  }
+
+  const int64_t tick_us = portTICK_PERIOD_MS * 1000;
+  return (remaining + tick_us - 1) / tick_us;
+}
+
+// Sleeps until a new distance reading, a mode change or the state machine's
+// own deadline, rather than polling
 static void autonomous_loop() {
   autonomous_state state = {.status = off,
-                            .last_changed = esp_timer_get_time()};
+                            .last_changed = hal_time_us()};
+  sensor_state view;
+  controller_read_sensors(&view);
 
   while (true) {
-    vTaskDelay(10 / portTICK_PERIOD_MS);
-    if (global_controller.mode != mode_autonomous) {
-      state.status = off;
-      continue;
+    int64_t deadline = autonomous_deadline(&state, hal_time_us(), &view);
+
+    uint32_t events;
+    bool notified =
+        xTaskNotifyWait(0, UINT32_MAX, &events, ticks_until(deadline));
+
+    controller_read_sensors(&view);
+
+    int64_t origin = -1;
+    if (notified && (events & CONTROL_EVENT_DISTANCE)) {
+      origin = latest_distance_update(&view);
     }
+    autonomous_step(&state, origin, &view);
+  }
+}
 
-    if (state.status == off) {
-      go_forward(&state, esp_timer_get_time());
+void control_notify(uint32_t events) {
+  if (autonomous_task != NULL) {
+    xTaskNotify(autonomous_task, events, eSetBits);
+  }
+}
+
+void controller_read_sensors(sensor_state *out) {
+  latch_read(&sensor_latch, out);
+
+  int64_t now = hal_time_us();
+  out->stale = 0;
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    int64_t updated = out->distances_updated[i];
+    if (updated == 0 || now - updated > ULTRASONIC_STALE_MS * 1000LL) {
+      out->stale |= 1 << i;
+      out->distances[i] = ULTRASONIC_MAX_RANGE_CM;
+      out->distance_rates[i] = 0;
     }
+  }
+}
+
+void controller_read_remote(remote_state *out) {
+  latch_read(&remote_latch, out);
+}
 
-    int64_t current_time = esp_timer_get_time();
-
-    int64_t time_in_mode = current_time - state.last_changed;
-    bool obstructed = global_controller.front_distance < 60;
-
-    switch (state.status) {
-    case forward_motion:
-      if (obstructed) {
-        ESP_LOGI(TAG, "Seeing obstacle ahead, backing away");
-        backward_turn(&state, current_time);
-      } else if (time_in_mode >= 3000000) {
-        ESP_LOGI(TAG, "Getting bored of this course, switching it up");
-        forward_turn(&state, current_time);
-      }
-      break;
-    case turning:
-      if (time_in_mode >= 1500000 && !obstructed) {
-        ESP_LOGI(TAG, "Turn complete, resuming course");
-        go_forward(&state, current_time);
-      }
-      break;
-    default:
-      break;
+// Each speed is a single word written by the motor task, so reading it is
+// atomic on its own
+static float read_speed(const float *speed) {
+  float value;
+  __atomic_load(speed, &value, __ATOMIC_RELAXED);
+  return value;
+}
+
+void controller_read_snapshot(controller_snapshot *out) {
+  out->left_speed = read_speed(&global_controller.left_motor.current_speed);
+  out->right_speed = read_speed(&global_controller.right_motor.current_speed);
+  out->left_target = read_speed(&global_controller.left_motor.target_speed);
+  out->right_target = read_speed(&global_controller.right_motor.target_speed);
+  controller_read_sensors(&out->sensors);
+  controller_read_remote(&out->remote);
+  odometry_read(&out->odometry);
+}
+
+void controller_publish_distance(enum sensor_position position, float distance,
+                                 float rate, int64_t timestamp) {
+  record_distance(position, distance, rate, timestamp);
+  sensors.distances[position] = distance;
+  sensors.distance_rates[position] = rate;
+  sensors.distances_updated[position] = timestamp;
+  latch_publish(&sensor_latch, &sensors);
+  control_notify(CONTROL_EVENT_DISTANCE);
+
+  // The manual speed governor needs to see it too
+  remote_state inputs;
+  controller_read_remote(&inputs);
+  if (inputs.mode == mode_manual && remote_task != NULL) {
+    xTaskNotify(remote_task, 0, eNoAction);
+  }
+}
+
+esp_err_t control_submit(const remote_event *event) {
+  assert(remote_task != NULL);
+  record_remote(event);
+
+  remote_event submitted = *event;
+  submitted.sequence =
+      __atomic_add_fetch(&next_sequence, 1, __ATOMIC_RELAXED);
+
+  esp_err_t ret = ESP_OK;
+  switch (submitted.type) {
+  case position:
+    xQueueOverwrite(position_mailbox, &submitted);
+    break;
+  case mode:
+    if (!xQueueSend(mode_queue, &submitted, 0)) {
+      ret = ESP_FAIL;
     }
+    break;
   }
+
+  xTaskNotify(remote_task, 0, eNoAction);
+  return ret;
 }
 
 void control_init() {
-  control_queue = xQueueCreate(3, sizeof(remote_event));
+  position_mailbox = xQueueCreate(1, sizeof(remote_event));
+  mode_queue = xQueueCreate(MODE_QUEUE_LENGTH, sizeof(remote_event));
 
-  xTaskCreate(remote_input, "remote_input", 2048, NULL, 10, NULL);
-  xTaskCreate(autonomous_loop, "autonomous_loop", 2048, NULL, 10, NULL);
+  remote_task = task_start(task_remote_input, remote_input, NULL);
+  autonomous_task = task_start(task_autonomous, autonomous_loop, NULL);
 }
@@ -1,9 +1,10 @@
 #pragma once
 
 #include "./motor.h"
+#include "./odometry.h"
 
+#include "esp_err.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
 
 // Indexes of x and y in remote_position vector
 #define X_IDX 0
@@ -11,16 +12,106 @@
 
 enum control_mode { mode_off, mode_autonomous, mode_manual };
 
+// Ultrasonic sensors around the chassis, indexes into controller.distances
+enum sensor_position {
+  sensor_front,
+  sensor_front_left,
+  sensor_front_right,
+  sensor_rear,
+  SENSOR_COUNT
+};
+
+// Readings published by the ultrasonic task
+typedef struct {
+  // Latest filtered reading from each sensor, in cm
+  float distances[SENSOR_COUNT];
+  // Rate of change of each distance in cm/s, negative when closing in. Only
+  // sensors whose filter tracks velocity report one, the rest stay 0.
+  float distance_rates[SENSOR_COUNT];
+  // Echo edge time of the reading behind each distance, 0 before the first
+  int64_t distances_updated[SENSOR_COUNT];
+  // Bit per sensor (1 << position) that hasn't reported within
+  // ULTRASONIC_STALE_MS. Their distance reads as ULTRASONIC_MAX_RANGE_CM
+  // and their rate as 0, so a silent sensor never looks like an obstacle.
+  uint32_t stale;
+} sensor_state;
+
+// Inputs from the remote, only changed by the remote_input task
 typedef struct {
-  motor left_motor;
-  motor right_motor;
   float remote_position[2];
-  float front_distance;
   enum control_mode mode;
+} remote_state;
+
+// Everything a status report needs, read in one go
+typedef struct {
+  float left_speed;
+  float right_speed;
+  float left_target;
+  float right_target;
+  sensor_state sensors;
+  remote_state remote;
+  // Dead-reckoned from the wheels, see odometry.h
+  pose odometry;
+} controller_snapshot;
+
+typedef struct {
+  motor left_motor;
+  motor right_motor;
 } controller;
 
-xQueueHandle control_queue;
+enum remote_event_type { position, mode };
+
+typedef struct {
+  enum remote_event_type type;
+  // When the frame carrying this event arrived, for latency tracing
+  int64_t received_at;
+  // Submission order, filled in by control_submit()
+  uint32_t sequence;
+
+  union {
+    // Position update
+    struct {
+      float new_position[2];
+    };
+    // Mode update
+    struct {
+      enum control_mode new_mode;
+    };
+  };
+} remote_event;
+
+// Events that wake the autonomous loop, see control_notify()
+#define CONTROL_EVENT_DISTANCE (1 << 0)
+#define CONTROL_EVENT_MODE (1 << 1)
 
 void control_init();
 
+// Hand a remote event to the controller without blocking
+//
+// Positions go through a single slot mailbox, so a newer one replaces any
+// the controller hasn't picked up yet. Mode changes are queued and applied
+// in order, before any position submitted after them. Returns ESP_FAIL if
+// the mode queue is full.
+esp_err_t control_submit(const remote_event *event);
+
+// Wake the autonomous loop because its inputs changed
+void control_notify(uint32_t events);
+
+// Shared state is double buffered, see latch.h. Reads are safe from any task
+// and never block the writers, or each other.
+void controller_read_sensors(sensor_state *out);
+void controller_read_remote(remote_state *out);
+void controller_read_snapshot(controller_snapshot *out);
+
+// Wheel speed targets for a manual driving position, with forward speed
+// limited by how close the readings in view are, and capped lower while a
+// forward facing sensor is stale. Returns that limit. Pure, so safe from
+// anywhere.
+float control_mix(const float position[2], const sensor_state *view,
+                  float *left, float *right);
+
+// Record a new reading. Must only be called from the ultrasonic task.
+void controller_publish_distance(enum sensor_position position, float distance,
+                                 float rate, int64_t timestamp);
+
 extern controller global_controller;
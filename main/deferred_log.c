@@ -0,0 +1,179 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "deferred_log.h"
+#include "hal.h"
+#include "tasks.h"
+
+static const char *TAG = "robot-log";
+
+// Must be a power of two so sequence numbers wrap cleanly
+#define RING_SIZE 64
+#define FLUSH_PERIOD_MS 50
+#define MESSAGE_LEN 160
+
+typedef struct {
+  // Stored relative to the slot index so that the zeroed ring starts out
+  // free: slot is writable at position seq + index, readable one after
+  uint32_t seq;
+  uint32_t timestamp_ms;
+  uint8_t level;
+  uint8_t arg_count;
+  const char *tag;
+  const char *format;
+  deferred_log_arg args[DEFERRED_LOG_MAX_ARGS];
+} log_record;
+
+static log_record ring[RING_SIZE];
+static uint32_t write_pos = 0;
+static uint32_t read_pos = 0;
+static uint32_t dropped = 0;
+
+// Bounded multi-producer queue, producers claim a slot with a CAS and then
+// publish it by bumping its sequence number
+void deferred_log_write(esp_log_level_t level, const char *tag,
+                        const char *format, int arg_count,
+                        const deferred_log_arg *args) {
+  uint32_t pos = __atomic_load_n(&write_pos, __ATOMIC_RELAXED);
+  log_record *record;
+
+  while (true) {
+    record = &ring[pos % RING_SIZE];
+    uint32_t seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) +
+                   pos % RING_SIZE;
+    int32_t diff = (int32_t)(seq - pos);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&write_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Consumer has not caught up yet
+      __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&write_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  record->timestamp_ms = hal_time_us() / 1000;
+  record->level = level;
+  record->tag = tag;
+  record->format = format;
+  record->arg_count = arg_count;
+  if (arg_count > 0) {
+    memcpy(record->args, args, arg_count * sizeof(deferred_log_arg));
+  }
+
+  __atomic_store_n(&record->seq, pos + 1 - pos % RING_SIZE, __ATOMIC_RELEASE);
+}
+
+uint32_t deferred_log_dropped() {
+  return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+static bool is_conversion(char c) { return strchr("diouxXcsfFeEgGp", c); }
+
+// Expand the record's format one conversion at a time, feeding each the
+// matching stored argument
+static void format_record(const log_record *record, char *out,
+                          size_t out_len) {
+  const char *format = record->format;
+  size_t len = 0;
+  int arg = 0;
+
+  while (*format != '\0' && len + 1 < out_len) {
+    if (*format != '%') {
+      out[len++] = *format++;
+      continue;
+    }
+    if (format[1] == '%') {
+      out[len++] = '%';
+      format += 2;
+      continue;
+    }
+
+    char spec[16];
+    size_t spec_len = 0;
+    do {
+      spec[spec_len++] = *format++;
+    } while (*format != '\0' && !is_conversion(*format) &&
+             spec_len < sizeof(spec) - 2);
+    if (*format == '\0') {
+      break;
+    }
+    char conversion = *format++;
+    spec[spec_len++] = conversion;
+    spec[spec_len] = '\0';
+
+    if (arg >= record->arg_count) {
+      break;
+    }
+
+    const deferred_log_arg *value = &record->args[arg++];
+    int written;
+    if (value->type == deferred_log_float) {
+      written = snprintf(&out[len], out_len - len, spec, (double)value->f);
+    } else if (value->type == deferred_log_string) {
+      written = snprintf(&out[len], out_len - len, spec, value->s);
+    } else if (strchr(spec, 'l') != NULL) {
+      written = snprintf(&out[len], out_len - len, spec, (long)value->i);
+    } else {
+      written = snprintf(&out[len], out_len - len, spec, value->i);
+    }
+
+    if (written < 0) {
+      break;
+    }
+    len += written;
+  }
+
+  out[len < out_len ? len : out_len - 1] = '\0';
+}
+
+static bool pop_record(log_record *out) {
+  uint32_t index = read_pos % RING_SIZE;
+  log_record *record = &ring[index];
+  uint32_t seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) + index;
+  if (seq != read_pos + 1) {
+    return false;
+  }
+
+  *out = *record;
+  __atomic_store_n(&record->seq, read_pos + RING_SIZE - index,
+                   __ATOMIC_RELEASE);
+  read_pos++;
+  return true;
+}
+
+static void deferred_log_task() {
+  log_record record;
+  char message[MESSAGE_LEN];
+  uint32_t reported_dropped = 0;
+
+  while (true) {
+    while (pop_record(&record)) {
+      format_record(&record, message, sizeof(message));
+      ESP_LOG_LEVEL(record.level, record.tag, "[%u] %s",
+                    record.timestamp_ms, message);
+    }
+
+    uint32_t now_dropped = deferred_log_dropped();
+    if (now_dropped != reported_dropped) {
+      ESP_LOGW(TAG, "Dropped %u deferred log records",
+               now_dropped - reported_dropped);
+      reported_dropped = now_dropped;
+    }
+
+    vTaskDelay(FLUSH_PERIOD_MS / portTICK_PERIOD_MS);
+  }
+}
+
+void deferred_log_init() {
+  task_start(task_deferred_log, deferred_log_task, NULL);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_log.h"
+
+// Deferred logging for hot paths
+//
+// DLOGx() has the same shape as ESP_LOGx() but only copies the format string
+// pointer and up to DEFERRED_LOG_MAX_ARGS raw arguments into a lock-free
+// ring. A low priority task does the formatting and the UART write later.
+// When the ring is full records are dropped and counted rather than blocking.
+//
+// Since formatting happens later, format strings and any %s arguments must
+// be string literals or otherwise outlive the call.
+
+#define DEFERRED_LOG_MAX_ARGS 4
+
+typedef enum {
+  deferred_log_int,
+  deferred_log_float,
+  deferred_log_string
+} deferred_log_arg_type;
+
+typedef struct {
+  deferred_log_arg_type type;
+  union {
+    int32_t i;
+    float f;
+    const char *s;
+  };
+} deferred_log_arg;
+
+static inline deferred_log_arg deferred_log_from_int(int32_t value) {
+  return (deferred_log_arg){.type = deferred_log_int, .i = value};
+}
+
+static inline deferred_log_arg deferred_log_from_float(double value) {
+  return (deferred_log_arg){.type = deferred_log_float, .f = value};
+}
+
+static inline deferred_log_arg deferred_log_from_string(const char *value) {
+  return (deferred_log_arg){.type = deferred_log_string, .s = value};
+}
+
+#define DEFERRED_LOG_ARG(x)                                                    \
+  _Generic((x), float                                                          \
+           : deferred_log_from_float, double                                   \
+           : deferred_log_from_float, char *                                   \
+           : deferred_log_from_string, const char *                            \
+           : deferred_log_from_string, default                                 \
+           : deferred_log_from_int)(x)
+
+#define DEFERRED_LOG_COUNT(...) DEFERRED_LOG_COUNT_(_, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define DEFERRED_LOG_COUNT_(_, a, b, c, d, n, ...) n
+
+#define DEFERRED_LOG_ARGS_0() NULL
+#define DEFERRED_LOG_ARGS_1(a) (deferred_log_arg[]){DEFERRED_LOG_ARG(a)}
+#define DEFERRED_LOG_ARGS_2(a, b)                                              \
+  (deferred_log_arg[]) { DEFERRED_LOG_ARG(a), DEFERRED_LOG_ARG(b) }
+#define DEFERRED_LOG_ARGS_3(a, b, c)                                           \
+  (deferred_log_arg[]) {                                                       \
+    DEFERRED_LOG_ARG(a), DEFERRED_LOG_ARG(b), DEFERRED_LOG_ARG(c)              \
+  }
+#define DEFERRED_LOG_ARGS_4(a, b, c, d)                                        \
+  (deferred_log_arg[]) {                                                       \
+    DEFERRED_LOG_ARG(a), DEFERRED_LOG_ARG(b), DEFERRED_LOG_ARG(c),             \
+        DEFERRED_LOG_ARG(d)                                                    \
+  }
+#define DEFERRED_LOG_ARGS_(n, ...) DEFERRED_LOG_ARGS_##n(__VA_ARGS__)
+#define DEFERRED_LOG_ARGS(n, ...) DEFERRED_LOG_ARGS_(n, ##__VA_ARGS__)
+
+#define DLOG(level, tag, format, ...)                                          \
+  do {                                                                         \
+    if (LOG_LOCAL_LEVEL >= level) {                                            \
+      deferred_log_write(level, tag, format, DEFERRED_LOG_COUNT(__VA_ARGS__),  \
+                         DEFERRED_LOG_ARGS(DEFERRED_LOG_COUNT(__VA_ARGS__),    \
+                                           ##__VA_ARGS__));                    \
+    }                                                                          \
+  } while (0)
+
+#define DLOGE(tag, format, ...) DLOG(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define DLOGW(tag, format, ...) DLOG(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define DLOGI(tag, format, ...) DLOG(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define DLOGD(tag, format, ...) DLOG(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+
+// Start the task that formats and emits deferred records
+void deferred_log_init();
+
+void deferred_log_write(esp_log_level_t level, const char *tag,
+                        const char *format, int arg_count,
+                        const deferred_log_arg *args);
+
+// Records dropped because the ring was full
+uint32_t deferred_log_dropped();
@@ -0,0 +1,158 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "distance_filter.h"
+
+static bool reject_step(const filter_stage *stage, filter_stage_state *state,
+                        float *value) {
+  if (*value < stage->reject.min_cm) {
+    return false;
+  }
+  *value = fminf(*value, stage->reject.max_cm);
+
+  if (state->primed &&
+      fabsf(*value - state->reject.last) > stage->reject.max_jump_cm) {
+    // A real step change shows up twice in a row, a glitch doesn't
+    bool confirmed =
+        state->reject.has_candidate &&
+        fabsf(*value - state->reject.candidate) <= stage->reject.max_jump_cm;
+    if (!confirmed) {
+      state->reject.candidate = *value;
+      state->reject.has_candidate = true;
+      return false;
+    }
+  }
+
+  state->primed = true;
+  state->reject.last = *value;
+  state->reject.has_candidate = false;
+  return true;
+}
+
+static bool median_step(const filter_stage *stage, filter_stage_state *state,
+                        float *value) {
+  int taps = stage->median.taps;
+  state->median.window[state->median.next] = *value;
+  state->median.next = (state->median.next + 1) % taps;
+  if (state->median.count < taps) {
+    state->median.count++;
+  }
+
+  // Insertion sort a copy, the window is only a handful of samples
+  float sorted[FILTER_MAX_MEDIAN_TAPS];
+  int count = state->median.count;
+  for (int i = 0; i < count; i++) {
+    float x = state->median.window[i];
+    int j = i;
+    while (j > 0 && sorted[j - 1] > x) {
+      sorted[j] = sorted[j - 1];
+      j--;
+    }
+    sorted[j] = x;
+  }
+
+  *value = count % 2 ? sorted[count / 2]
+                     : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+  return true;
+}
+
+static bool ema_step(const filter_stage *stage, filter_stage_state *state,
+                     float *value) {
+  if (!state->primed) {
+    state->ema.value = *value;
+    state->primed = true;
+  } else {
+    state->ema.value += stage->ema.alpha * (*value - state->ema.value);
+  }
+
+  *value = state->ema.value;
+  return true;
+}
+
+static float clamp_distance(const filter_stage *stage, float distance) {
+  return fminf(fmaxf(distance, 0), stage->alpha_beta.max_cm);
+}
+
+static bool alpha_beta_step(const filter_stage *stage,
+                            filter_stage_state *state, float *value,
+                            int64_t timestamp_us, float *velocity) {
+  int64_t gap_us = timestamp_us - state->alpha_beta.updated;
+  if (!state->primed || gap_us > stage->alpha_beta.max_gap_ms * 1000LL) {
+    state->alpha_beta.distance = clamp_distance(stage, *value);
+    state->alpha_beta.velocity = 0;
+    state->alpha_beta.updated = timestamp_us;
+    state->primed = true;
+    *value = state->alpha_beta.distance;
+    *velocity = 0;
+    return true;
+  }
+
+  float dt = gap_us / 1e6f;
+  if (dt <= 0) {
+    *value = state->alpha_beta.distance;
+    *velocity = state->alpha_beta.velocity;
+    return true;
+  }
+
+  float predicted =
+      state->alpha_beta.distance + state->alpha_beta.velocity * dt;
+  float residual = *value - predicted;
+  state->alpha_beta.distance =
+      clamp_distance(stage, predicted + stage->alpha_beta.alpha * residual);
+  state->alpha_beta.velocity += stage->alpha_beta.beta * residual / dt;
+  state->alpha_beta.updated = timestamp_us;
+
+  *value = state->alpha_beta.distance;
+  *velocity = state->alpha_beta.velocity;
+  return true;
+}
+
+void distance_filter_init(distance_filter *filter,
+                          const filter_config *config) {
+  assert(config->stage_count <= FILTER_MAX_STAGES);
+  memset(filter, 0, sizeof(*filter));
+  filter->config = config;
+
+  for (int i = 0; i < config->stage_count; i++) {
+    if (config->stages[i].type == filter_median) {
+      assert(config->stages[i].median.taps > 0 &&
+             config->stages[i].median.taps <= FILTER_MAX_MEDIAN_TAPS);
+    }
+  }
+}
+
+bool distance_filter_push(distance_filter *filter, float distance_cm,
+                          int64_t timestamp_us) {
+  float value = distance_cm;
+  float velocity = 0;
+
+  for (int i = 0; i < filter->config->stage_count; i++) {
+    const filter_stage *stage = &filter->config->stages[i];
+    filter_stage_state *state = &filter->stages[i];
+    bool keep = true;
+
+    switch (stage->type) {
+    case filter_reject:
+      keep = reject_step(stage, state, &value);
+      break;
+    case filter_median:
+      keep = median_step(stage, state, &value);
+      break;
+    case filter_ema:
+      keep = ema_step(stage, state, &value);
+      break;
+    case filter_alpha_beta:
+      keep = alpha_beta_step(stage, state, &value, timestamp_us, &velocity);
+      break;
+    }
+
+    if (!keep) {
+      return false;
+    }
+  }
+
+  filter->distance = value;
+  filter->velocity = velocity;
+  return true;
+}
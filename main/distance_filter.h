@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Distance sample filtering
+//
+// A filter is a fixed pipeline of stages described by a const config, so
+// each sensor can pick its own at compile time. All state lives in the
+// distance_filter struct, nothing is allocated.
+
+#define FILTER_MAX_STAGES 4
+#define FILTER_MAX_MEDIAN_TAPS 7
+
+enum filter_stage_type {
+  // Drop samples closer than min_cm and clamp anything past max_cm, which is
+  // also what a no-target echo turns into. A sample more than max_jump_cm
+  // away from the last one is dropped unless the next sample agrees with it.
+  filter_reject,
+  // Median of the last taps samples
+  filter_median,
+  // Exponential moving average, alpha is the weight of the new sample
+  filter_ema,
+  // Alpha-beta tracker, estimating the rate of change of the distance. Its
+  // estimate is kept within 0 and max_cm, and starts over from the sample
+  // after a gap longer than max_gap_ms, since the rate is stale by then.
+  filter_alpha_beta,
+};
+
+typedef struct {
+  enum filter_stage_type type;
+  union {
+    struct {
+      float min_cm;
+      float max_cm;
+      float max_jump_cm;
+    } reject;
+    struct {
+      int taps;
+    } median;
+    struct {
+      float alpha;
+    } ema;
+    struct {
+      float alpha;
+      float beta;
+      float max_cm;
+      int max_gap_ms;
+    } alpha_beta;
+  };
+} filter_stage;
+
+typedef struct {
+  const filter_stage *stages;
+  int stage_count;
+} filter_config;
+
+typedef struct {
+  bool primed;
+  union {
+    struct {
+      float last;
+      float candidate;
+      bool has_candidate;
+    } reject;
+    struct {
+      float window[FILTER_MAX_MEDIAN_TAPS];
+      int count;
+      int next;
+    } median;
+    struct {
+      float value;
+    } ema;
+    struct {
+      float distance;
+      float velocity;
+      int64_t updated;
+    } alpha_beta;
+  };
+} filter_stage_state;
+
+typedef struct {
+  const filter_config *config;
+  filter_stage_state stages[FILTER_MAX_STAGES];
+  // Output of the last accepted sample
+  float distance;
+  // Rate of change in cm/s, negative when closing in. Only estimated when
+  // the pipeline has an alpha-beta stage, 0 otherwise.
+  float velocity;
+} distance_filter;
+
+void distance_filter_init(distance_filter *filter, const filter_config *config);
+
+// Run a raw sample taken at timestamp_us through the pipeline
+//
+// Returns false if a stage dropped it, leaving the outputs unchanged.
+bool distance_filter_push(distance_filter *filter, float distance_cm,
+                          int64_t timestamp_us);
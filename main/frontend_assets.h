@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Web frontend, gzipped at build time by frontend/embed_assets.py
+typedef struct {
+  const char *uri;
+  const char *content_type;
+  // Quoted strong validator derived from the compressed content
+  const char *etag;
+  const uint8_t *data;
+  size_t len;
+} frontend_asset;
+
+extern const frontend_asset frontend_assets[];
+extern const size_t frontend_asset_count;
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "driver/gpio.h"
+#include "driver/mcpwm.h"
+#include "esp_err.h"
+
+// Thin hardware abstraction layer
+//
+// Control code talks to pins, PWM and the clock only through these calls so
+// that it can be linked against either the ESP32 drivers (hal_esp32.c) or
+// the host simulator (host/hal_sim.c).
+
+typedef void (*hal_isr_t)(void *arg);
+
+// Called from interrupt context with the width of a completed high pulse and
+// the time its falling edge was handled. Returns whether it woke a higher
+// priority task, so the interrupt can yield to it on exit.
+typedef bool (*hal_pulse_handler_t)(void *arg, uint32_t width_ns,
+                                    int64_t timestamp);
+
+void hal_gpio_output(gpio_num_t pin);
+void hal_gpio_input(gpio_num_t pin);
+esp_err_t hal_gpio_set_level(gpio_num_t pin, int level);
+int hal_gpio_get_level(gpio_num_t pin);
+
+// Call handler from interrupt context on every edge of pin
+void hal_gpio_isr_add(gpio_num_t pin, hal_isr_t handler, void *arg);
+
+// Measure high pulses on pin in hardware. Up to six pins can be captured.
+esp_err_t hal_pulse_capture_add(gpio_num_t pin, hal_pulse_handler_t handler,
+                                void *arg);
+
+// Quadrature wheel encoder on pulse counter unit, counting every edge of both
+// channels
+esp_err_t hal_encoder_init(int unit, gpio_num_t a, gpio_num_t b);
+// Counts since init, positive when a leads b
+int32_t hal_encoder_count(int unit);
+
+typedef struct hal_timer *hal_timer_t;
+
+// Call callback every period_us from a high priority context. It must not
+// block.
+esp_err_t hal_timer_start_periodic(uint32_t period_us, hal_isr_t callback,
+                                   void *arg, hal_timer_t *out);
+// Stop calling back, so the CPU can sleep through the period, and start
+// again a whole period after resuming
+esp_err_t hal_timer_pause(hal_timer_t timer);
+esp_err_t hal_timer_resume(hal_timer_t timer);
+
+void hal_pwm_init(gpio_num_t pin, mcpwm_unit_t unit, mcpwm_timer_t timer,
+                  int frequency);
+void hal_pwm_set_duty(mcpwm_unit_t unit, mcpwm_timer_t timer,
+                      mcpwm_operator_t op, float duty);
+
+// Microseconds since boot
+int64_t hal_time_us();
+
+uint32_t hal_random();
+
+// Storage for the input recorder, see recorder.h. Offsets are from its
+// start. Writes only land on erased space, which reads back as 0xff, and
+// erasing goes by whole sectors. Both stall the CPUs while the flash is busy.
+#define HAL_RECORD_SECTOR_SIZE 4096
+// 0 when there is nowhere to record to
+size_t hal_record_storage_size();
+esp_err_t hal_record_storage_erase(size_t offset, size_t len);
+esp_err_t hal_record_storage_write(size_t offset, const void *data,
+                                   size_t len);
+esp_err_t hal_record_storage_read(size_t offset, void *data, size_t len);
+// Whether erasing stalls the CPUs at all. Only the robot's flash does.
+bool hal_record_storage_erase_stalls();
+
+// Small persistent store for settings, kept across reboots and reflashing.
+// Keys are at most 15 characters. get returns ESP_ERR_NOT_FOUND for a key
+// that was never set.
+esp_err_t hal_settings_get(const char *key, uint32_t *value);
+esp_err_t hal_settings_set(const char *key, uint32_t value);
+esp_err_t hal_settings_erase(const char *key);
+
+// Power saving while the robot is idle. Init sets up frequency scaling and
+// keeps the clocks at full speed, which the ultrasonic capture and WiFi
+// latency rely on. Enabling lets the CPU clock down and the WiFi modem sleep
+// between beacons, disabling brings both back. Call after WiFi is started.
+esp_err_t hal_power_init();
+esp_err_t hal_power_save(bool enable);
+
+// Core the caller is running on
+int hal_core_id();
@@ -0,0 +1,418 @@
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "driver/gpio.h"
+#include "driver/mcpwm.h"
+#include "driver/pcnt.h"
+#include "esp_attr.h"
+#include "esp_partition.h"
+#include "esp_pm.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+#include "soc/mcpwm_periph.h"
+
+#include "hal.h"
+
+#define ESP_INTR_FLAG_DEFAULT 0
+
+void hal_gpio_output(gpio_num_t pin) {
+  gpio_pad_select_gpio(pin);
+  gpio_set_direction(pin, GPIO_MODE_OUTPUT);
+}
+
+void hal_gpio_input(gpio_num_t pin) {
+  gpio_pad_select_gpio(pin);
+  gpio_set_direction(pin, GPIO_MODE_INPUT);
+}
+
+esp_err_t hal_gpio_set_level(gpio_num_t pin, int level) {
+  return gpio_set_level(pin, level);
+}
+
+int hal_gpio_get_level(gpio_num_t pin) { return gpio_get_level(pin); }
+
+void hal_gpio_isr_add(gpio_num_t pin, hal_isr_t handler, void *arg) {
+  gpio_set_intr_type(pin, GPIO_INTR_ANYEDGE);
+  // Returns ESP_ERR_INVALID_STATE when already installed, which is fine
+  gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
+  gpio_isr_handler_add(pin, handler, arg);
+}
+
+// Capture uses the MCPWM capture blocks, which are independent of the PWM
+// timers driving the motors. Each channel latches both edges of its pin and
+// reports which one it saw, so every unit can measure three pins.
+#define CAPTURE_CHANNELS_PER_UNIT 3
+#define CAPTURE_CHANNELS (MCPWM_UNIT_MAX * CAPTURE_CHANNELS_PER_UNIT)
+// Capture mode bits: bit 0 latches falling edges, bit 1 rising edges
+#define CAPTURE_BOTH_EDGES 3
+
+typedef struct {
+  hal_pulse_handler_t handler;
+  void *arg;
+  uint32_t rise_ticks;
+} capture_channel;
+
+static mcpwm_dev_t *const capture_units[MCPWM_UNIT_MAX] = {&MCPWM0, &MCPWM1};
+static capture_channel capture_channels[CAPTURE_CHANNELS];
+static int capture_channel_count = 0;
+static bool capture_isr_installed[MCPWM_UNIT_MAX];
+
+static void IRAM_ATTR capture_isr(void *arg) {
+  int unit = (int)arg;
+  mcpwm_dev_t *dev = capture_units[unit];
+  uint32_t status = dev->int_st.val;
+  uint32_t edges = dev->cap_status.val;
+  bool woken = false;
+
+  for (int i = 0; i < CAPTURE_CHANNELS_PER_UNIT; i++) {
+    if (!(status & (MCPWM_CAP0_INT_ST << i))) {
+      continue;
+    }
+
+    capture_channel *channel =
+        &capture_channels[unit * CAPTURE_CHANNELS_PER_UNIT + i];
+    uint32_t ticks = dev->cap_val_ch[i];
+    bool falling = edges & (1 << i);
+    if (!falling) {
+      channel->rise_ticks = ticks;
+    } else {
+      // Capture timer runs off the 80 MHz APB clock, 12.5 ns per tick
+      uint32_t width_ns = (uint64_t)(ticks - channel->rise_ticks) * 25 / 2;
+      woken |= channel->handler(channel->arg, width_ns, esp_timer_get_time());
+    }
+  }
+
+  dev->int_clr.val = status;
+  if (woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+esp_err_t hal_pulse_capture_add(gpio_num_t pin, hal_pulse_handler_t handler,
+                                void *arg) {
+  if (capture_channel_count >= CAPTURE_CHANNELS) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  int index = capture_channel_count++;
+  mcpwm_unit_t unit = index / CAPTURE_CHANNELS_PER_UNIT;
+  int channel = index % CAPTURE_CHANNELS_PER_UNIT;
+  capture_channels[index] = (capture_channel){.handler = handler, .arg = arg};
+
+  mcpwm_gpio_init(unit, MCPWM_CAP_0 + channel, pin);
+  mcpwm_capture_enable(unit, MCPWM_SELECT_CAP0 + channel, MCPWM_POS_EDGE, 0);
+  capture_units[unit]->cap_cfg_ch[channel].mode = CAPTURE_BOTH_EDGES;
+  capture_units[unit]->int_ena.val |= MCPWM_CAP0_INT_ENA << channel;
+
+  if (capture_isr_installed[unit]) {
+    return ESP_OK;
+  }
+  capture_isr_installed[unit] = true;
+  return mcpwm_isr_register(unit, capture_isr, (void *)unit,
+                            ESP_INTR_FLAG_IRAM, NULL);
+}
+
+// The hardware counter is only 16 bits, so it is reset at these limits and
+// the overflow is accumulated in software
+#define ENCODER_LIMIT 30000
+
+static volatile int32_t encoder_overflow[PCNT_UNIT_MAX];
+// Last count hal_encoder_count() returned for each unit
+static int32_t encoder_last[PCNT_UNIT_MAX];
+static portMUX_TYPE encoder_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool encoder_isr_installed = false;
+
+static void IRAM_ATTR encoder_isr(void *arg) {
+  int unit = (int)arg;
+  uint32_t status;
+  pcnt_get_event_status(unit, &status);
+
+  portENTER_CRITICAL_ISR(&encoder_lock);
+  if (status & PCNT_EVT_H_LIM) {
+    encoder_overflow[unit] += ENCODER_LIMIT;
+  } else if (status & PCNT_EVT_L_LIM) {
+    encoder_overflow[unit] -= ENCODER_LIMIT;
+  }
+  portEXIT_CRITICAL_ISR(&encoder_lock);
+}
+
+esp_err_t hal_encoder_init(int unit, gpio_num_t a, gpio_num_t b) {
+  // Channel 0 counts edges of a, channel 1 edges of b, each using the other
+  // pin for direction, for 4x decoding. With a leading, a rises while b is
+  // low and falls while it is high, and b rises while a is high and falls
+  // while it is low, all of which count up.
+  pcnt_config_t config = {
+      .pulse_gpio_num = a,
+      .ctrl_gpio_num = b,
+      .channel = PCNT_CHANNEL_0,
+      .unit = unit,
+      .pos_mode = PCNT_COUNT_INC,
+      .neg_mode = PCNT_COUNT_DEC,
+      .lctrl_mode = PCNT_MODE_KEEP,
+      .hctrl_mode = PCNT_MODE_REVERSE,
+      .counter_h_lim = ENCODER_LIMIT,
+      .counter_l_lim = -ENCODER_LIMIT,
+  };
+  esp_err_t ret = pcnt_unit_config(&config);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  config.pulse_gpio_num = b;
+  config.ctrl_gpio_num = a;
+  config.channel = PCNT_CHANNEL_1;
+  config.pos_mode = PCNT_COUNT_DEC;
+  config.neg_mode = PCNT_COUNT_INC;
+  ret = pcnt_unit_config(&config);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  // Filter out glitches shorter than 1 us (filter counts APB cycles)
+  pcnt_set_filter_value(unit, 80);
+  pcnt_filter_enable(unit);
+
+  pcnt_event_enable(unit, PCNT_EVT_H_LIM);
+  pcnt_event_enable(unit, PCNT_EVT_L_LIM);
+  if (!encoder_isr_installed) {
+    ret = pcnt_isr_service_install(0);
+    if (ret != ESP_OK) {
+      return ret;
+    }
+    encoder_isr_installed = true;
+  }
+  pcnt_isr_handler_add(unit, encoder_isr, (void *)unit);
+
+  pcnt_counter_pause(unit);
+  pcnt_counter_clear(unit);
+  encoder_overflow[unit] = 0;
+  encoder_last[unit] = 0;
+  return pcnt_counter_resume(unit);
+}
+
+int32_t hal_encoder_count(int unit) {
+  int16_t count;
+
+  portENTER_CRITICAL(&encoder_lock);
+  pcnt_get_counter_value(unit, &count);
+  int32_t total = encoder_overflow[unit] + count;
+  // The counter resets itself at a limit a moment before encoder_isr() gets
+  // to account for it, and a read in between comes out ENCODER_LIMIT off. No
+  // wheel turns anywhere near half the limit between speed loop reads, so a
+  // jump that big is a wrap still in flight.
+  int32_t jump = total - encoder_last[unit];
+  if (jump > ENCODER_LIMIT / 2) {
+    total -= ENCODER_LIMIT;
+  } else if (jump < -ENCODER_LIMIT / 2) {
+    total += ENCODER_LIMIT;
+  }
+  encoder_last[unit] = total;
+  portEXIT_CRITICAL(&encoder_lock);
+
+  return total;
+}
+
+struct hal_timer {
+  esp_timer_handle_t handle;
+  uint32_t period_us;
+};
+
+esp_err_t hal_timer_start_periodic(uint32_t period_us, hal_isr_t callback,
+                                   void *arg, hal_timer_t *out) {
+  esp_timer_create_args_t args = {
+      .callback = callback,
+      .arg = arg,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "hal_periodic",
+  };
+  hal_timer_t timer = malloc(sizeof(struct hal_timer));
+  if (timer == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  timer->period_us = period_us;
+
+  esp_err_t ret = esp_timer_create(&args, &timer->handle);
+  if (ret == ESP_OK) {
+    ret = esp_timer_start_periodic(timer->handle, period_us);
+  }
+  if (ret != ESP_OK) {
+    free(timer);
+    return ret;
+  }
+  if (out != NULL) {
+    *out = timer;
+  }
+  return ESP_OK;
+}
+
+esp_err_t hal_timer_pause(hal_timer_t timer) {
+  return esp_timer_stop(timer->handle);
+}
+
+esp_err_t hal_timer_resume(hal_timer_t timer) {
+  return esp_timer_start_periodic(timer->handle, timer->period_us);
+}
+
+void hal_pwm_init(gpio_num_t pin, mcpwm_unit_t unit, mcpwm_timer_t timer,
+                  int frequency) {
+  mcpwm_gpio_init(MCPWM_UNIT_0, MCPWM0A, pin);
+
+  mcpwm_config_t pwm_config;
+  pwm_config.frequency = frequency;
+  pwm_config.cmpr_a = 0;
+  pwm_config.cmpr_b = 0;
+  pwm_config.counter_mode = MCPWM_UP_COUNTER;
+  pwm_config.duty_mode = MCPWM_DUTY_MODE_0;
+  mcpwm_init(unit, timer, &pwm_config);
+}
+
+void hal_pwm_set_duty(mcpwm_unit_t unit, mcpwm_timer_t timer,
+                      mcpwm_operator_t op, float duty) {
+  mcpwm_set_duty(unit, timer, op, duty);
+}
+
+// Called from the echo ISR, so keep it out of flash
+int64_t IRAM_ATTR hal_time_us() { return esp_timer_get_time(); }
+
+uint32_t hal_random() { return esp_random(); }
+
+// Data partition of this subtype in partitions.csv
+#define RECORD_PARTITION_SUBTYPE 0x40
+
+static const esp_partition_t *record_partition() {
+  static const esp_partition_t *partition = NULL;
+  if (partition == NULL) {
+    partition = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, RECORD_PARTITION_SUBTYPE, "replay");
+  }
+  return partition;
+}
+
+size_t hal_record_storage_size() {
+  const esp_partition_t *partition = record_partition();
+  return partition != NULL ? partition->size : 0;
+}
+
+esp_err_t hal_record_storage_erase(size_t offset, size_t len) {
+  const esp_partition_t *partition = record_partition();
+  if (partition == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  return esp_partition_erase_range(partition, offset, len);
+}
+
+esp_err_t hal_record_storage_write(size_t offset, const void *data,
+                                   size_t len) {
+  const esp_partition_t *partition = record_partition();
+  if (partition == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  return esp_partition_write(partition, offset, data, len);
+}
+
+esp_err_t hal_record_storage_read(size_t offset, void *data, size_t len) {
+  const esp_partition_t *partition = record_partition();
+  if (partition == NULL) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  return esp_partition_read(partition, offset, data, len);
+}
+
+bool hal_record_storage_erase_stalls() { return true; }
+
+// NVS namespace for hal_settings_*(), NVS itself is initialized by app_main()
+#define SETTINGS_NAMESPACE "settings"
+
+esp_err_t hal_settings_get(const char *key, uint32_t *value) {
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(SETTINGS_NAMESPACE, NVS_READONLY, &handle);
+  if (ret == ESP_OK) {
+    ret = nvs_get_u32(handle, key, value);
+    nvs_close(handle);
+  }
+  // A namespace that was never written doesn't exist yet either
+  return ret == ESP_ERR_NVS_NOT_FOUND ? ESP_ERR_NOT_FOUND : ret;
+}
+
+esp_err_t hal_settings_set(const char *key, uint32_t value) {
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &handle);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  ret = nvs_set_u32(handle, key, value);
+  if (ret == ESP_OK) {
+    ret = nvs_commit(handle);
+  }
+  nvs_close(handle);
+  return ret;
+}
+
+esp_err_t hal_settings_erase(const char *key) {
+  nvs_handle_t handle;
+  esp_err_t ret = nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &handle);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+  ret = nvs_erase_key(handle, key);
+  if (ret == ESP_OK) {
+    ret = nvs_commit(handle);
+  } else if (ret == ESP_ERR_NVS_NOT_FOUND) {
+    ret = ESP_OK;
+  }
+  nvs_close(handle);
+  return ret;
+}
+
+int IRAM_ATTR hal_core_id() { return xPortGetCoreID(); }
+
+#if CONFIG_PM_ENABLE
+// Held whenever the robot is awake. Only when it is released may the clocks
+// scale down, and the chip light sleep if tickless idle is on.
+static esp_pm_lock_handle_t awake_lock = NULL;
+#endif
+
+esp_err_t hal_power_init() {
+#if CONFIG_PM_ENABLE
+  esp_err_t ret = esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "robot_awake",
+                                     &awake_lock);
+  if (ret == ESP_OK) {
+    ret = esp_pm_lock_acquire(awake_lock);
+  }
+  if (ret != ESP_OK) {
+    return ret;
+  }
+
+  esp_pm_config_esp32_t config = {
+      .max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ,
+      .min_freq_mhz = 40,
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+      .light_sleep_enable = true,
+#endif
+  };
+  ret = esp_pm_configure(&config);
+  if (ret != ESP_OK) {
+    return ret;
+  }
+#endif
+  // Station mode dozes between beacons by default, which delays every
+  // inbound frame
+  return esp_wifi_set_ps(WIFI_PS_NONE);
+}
+
+esp_err_t hal_power_save(bool enable) {
+  esp_err_t ret = esp_wifi_set_ps(enable ? WIFI_PS_MIN_MODEM : WIFI_PS_NONE);
+#if CONFIG_PM_ENABLE
+  esp_err_t lock_ret = enable ? esp_pm_lock_release(awake_lock)
+                              : esp_pm_lock_acquire(awake_lock);
+  if (ret == ESP_OK) {
+    ret = lock_ret;
+  }
+#endif
+  return ret;
+}
@@ -0,0 +1,78 @@
+#include <string.h>
+
+#include "cJSON.h"
+#include "esp_log.h"
+
+#include "json_protocol.h"
+
+static const char *TAG = "robot-json";
+
+static const char *const mode_names[] = {
+    [mode_off] = "off",
+    [mode_autonomous] = "autonomous",
+    [mode_manual] = "manual",
+};
+
+#define MODE_COUNT (sizeof(mode_names) / sizeof(mode_names[0]))
+
+const char *json_mode_name(enum control_mode mode) {
+  return (size_t)mode < MODE_COUNT ? mode_names[mode] : "";
+}
+
+size_t json_decode(const char *payload, remote_event events[JSON_MAX_EVENTS]) {
+  cJSON *msg = cJSON_Parse(payload);
+  if (msg == NULL) {
+    ESP_LOGW(TAG, "Dropping malformed text frame");
+    return 0;
+  }
+
+  size_t count = 0;
+  cJSON *json_position = cJSON_GetObjectItem(msg, "position");
+  if (json_position != NULL) {
+    cJSON *x = cJSON_GetObjectItem(json_position, "x");
+    cJSON *y = cJSON_GetObjectItem(json_position, "y");
+    if (cJSON_IsNumber(x) && cJSON_IsNumber(y)) {
+      events[count++] = (remote_event){
+          .type = position, .new_position = {x->valuedouble, y->valuedouble}};
+    } else {
+      ESP_LOGW(TAG, "Position without x and y");
+    }
+  }
+
+  cJSON *json_mode = cJSON_GetObjectItem(msg, "mode");
+  if (cJSON_IsString(json_mode)) {
+    size_t new_mode = 0;
+    while (new_mode < MODE_COUNT &&
+           strcmp(json_mode->valuestring, mode_names[new_mode]) != 0) {
+      new_mode++;
+    }
+    if (new_mode < MODE_COUNT) {
+      events[count++] = (remote_event){.type = mode, .new_mode = new_mode};
+    } else {
+      ESP_LOGI(TAG, "Unrecognized mode %s", json_mode->valuestring);
+    }
+  }
+
+  cJSON_Delete(msg);
+  return count;
+}
+
+char *json_encode_state(const controller_snapshot *snapshot) {
+  cJSON *msg = cJSON_CreateObject();
+  if (msg == NULL) {
+    return NULL;
+  }
+
+  cJSON_AddNumberToObject(msg, "left", snapshot->left_speed);
+  cJSON_AddNumberToObject(msg, "right", snapshot->right_speed);
+  cJSON_AddNumberToObject(msg, "front_distance",
+                          snapshot->sensors.distances[sensor_front]);
+  cJSON_AddNumberToObject(msg, "x", snapshot->odometry.x);
+  cJSON_AddNumberToObject(msg, "y", snapshot->odometry.y);
+  cJSON_AddNumberToObject(msg, "theta", snapshot->odometry.theta);
+  cJSON_AddStringToObject(msg, "mode", json_mode_name(snapshot->remote.mode));
+
+  char *result = cJSON_Print(msg);
+  cJSON_Delete(msg);
+  return result;
+}
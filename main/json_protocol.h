@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "controller.h"
+
+// JSON text frames, kept as a fallback for clients that predate the binary
+// protocol in protocol.h
+//
+// Inbound frames are objects that may carry a position {"x", "y"} and a mode
+// name, and every one is answered with a state report object.
+
+// A frame carries at most a position and a mode
+#define JSON_MAX_EVENTS 2
+
+// Decode an inbound text frame into events, position before mode, returning
+// how many were filled in
+size_t json_decode(const char *payload, remote_event events[JSON_MAX_EVENTS]);
+
+// Encode the state report sent in reply to a text frame
+//
+// Returns a string the caller must free(), or NULL when out of memory.
+char *json_encode_state(const controller_snapshot *snapshot);
+
+// Name of a mode as it appears in JSON frames
+const char *json_mode_name(enum control_mode mode);
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Double-buffered snapshot for state with a single writer
+//
+// The writer updates the two copies one after the other, bumping the
+// sequence before each, and readers always read the copy that isn't being
+// written (sequence & 1). Readers never wait on the writer, even when they
+// preempt it mid-update on the same core; they only retry if a whole update
+// finished while they were copying.
+//
+// Declare one with LATCH(type) and only ever call latch_publish() from the
+// task that owns it.
+
+#define LATCH(type)                                                            \
+  struct {                                                                     \
+    uint32_t sequence;                                                         \
+    type copies[2];                                                            \
+  }
+
+#define latch_publish(latch, value)                                            \
+  latch_write(&(latch)->sequence, (latch)->copies,                             \
+              sizeof((latch)->copies[0]), (value))
+
+#define latch_read(latch, out)                                                 \
+  latch_copy(&(latch)->sequence, (latch)->copies,                              \
+             sizeof((latch)->copies[0]), (out))
+
+static inline void latch_write(uint32_t *sequence, void *copies, size_t size,
+                               const void *value) {
+  uint8_t *bytes = (uint8_t *)copies;
+  uint32_t next = *sequence + 1;
+
+  // Point readers at copy 1 while copy 0 is rewritten, then the other way
+  // round
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(sequence, next, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(bytes, value, size);
+
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(sequence, next + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(bytes + size, value, size);
+}
+
+static inline void latch_copy(const uint32_t *sequence, const void *copies,
+                              size_t size, void *out) {
+  const uint8_t *bytes = (const uint8_t *)copies;
+  uint32_t seen;
+
+  do {
+    seen = __atomic_load_n(sequence, __ATOMIC_ACQUIRE);
+    memcpy(out, bytes + (seen & 1) * size, size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(sequence, __ATOMIC_RELAXED) != seen);
+}
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "latch.h"
+#include "link.h"
+#include "recorder.h"
+
+static const char *TAG = "robot-link";
+
+#define LINK_MAX_CLIENTS CONFIG_ROBOT_MAX_CLIENTS
+#define LINK_TIMEOUT_US (CONFIG_ROBOT_LINK_TIMEOUT_MS * 1000LL)
+// Gain of the jitter estimator, as in RFC 3550
+#define JITTER_GAIN (1.0f / 16)
+// Heartbeats counted for loss before old history is halved away
+#define LOSS_WINDOW 64
+
+typedef struct {
+  int client;
+  // Tells apart connections that got the same socket one after the other
+  uint32_t session;
+  int64_t last_frame;
+  int64_t last_gap;
+  float jitter_ms;
+  bool sequenced;
+  uint16_t last_sequence;
+  uint32_t expected;
+  uint32_t received;
+} client_link;
+
+// Only touched from the httpd task
+static client_link clients[LINK_MAX_CLIENTS] = {
+    [0 ... LINK_MAX_CLIENTS - 1] = {.client = LINK_NO_CLIENT}};
+static uint32_t next_session = 1;
+// A closed driver's socket is soon handed to the next client, so the driver
+// is its socket and session together
+static int driver = LINK_NO_CLIENT;
+static uint32_t driver_session = 0;
+
+static LATCH(link_stats) stats_latch = {
+    .copies = {{.client = LINK_NO_CLIENT}, {.client = LINK_NO_CLIENT}}};
+
+static client_link *find_client(int client) {
+  for (int i = 0; i < LINK_MAX_CLIENTS; i++) {
+    if (clients[i].client == client) {
+      return &clients[i];
+    }
+  }
+  return NULL;
+}
+
+static client_link *find_or_add_client(int client) {
+  client_link *link = find_client(client);
+  if (link == NULL) {
+    link = find_client(LINK_NO_CLIENT);
+    if (link == NULL) {
+      return NULL;
+    }
+    *link = (client_link){.client = client, .session = next_session++};
+  }
+  return link;
+}
+
+static bool is_driver(const client_link *link) {
+  return link->client == driver && link->session == driver_session;
+}
+
+static void publish_driver() {
+  link_stats stats = {.client = driver, .connected = false};
+  client_link *link = driver != LINK_NO_CLIENT ? find_client(driver) : NULL;
+  if (link != NULL && !is_driver(link)) {
+    link = NULL;
+  }
+
+  if (link != NULL) {
+    stats.connected = true;
+    stats.last_frame = link->last_frame;
+    stats.jitter_ms = link->jitter_ms;
+    stats.loss_percent =
+        link->expected > 0
+            ? 100.0f * (link->expected - link->received) / link->expected
+            : 0;
+  }
+  latch_publish(&stats_latch, &stats);
+}
+
+void link_frame_received(int client, int64_t received_at) {
+  record_link(record_link_frame, client, 0);
+  client_link *link = find_or_add_client(client);
+  if (link == NULL) {
+    return;
+  }
+
+  if (link->last_frame > 0) {
+    int64_t gap = received_at - link->last_frame;
+    if (link->last_gap > 0) {
+      float variation = llabs(gap - link->last_gap) / 1000.0f;
+      link->jitter_ms += (variation - link->jitter_ms) * JITTER_GAIN;
+    }
+    link->last_gap = gap;
+  }
+  link->last_frame = received_at;
+
+  if (is_driver(link)) {
+    publish_driver();
+  }
+}
+
+void link_heartbeat_received(int client, uint16_t sequence) {
+  record_link(record_link_heartbeat, client, sequence);
+  client_link *link = find_client(client);
+  if (link == NULL) {
+    return;
+  }
+
+  if (link->sequenced) {
+    uint16_t advance = sequence - link->last_sequence;
+    // A step back is a reordered or restarted stream, count it as one
+    link->expected += advance > 0 && advance < UINT16_MAX / 2 ? advance : 1;
+  } else {
+    link->expected++;
+  }
+  link->received++;
+  link->sequenced = true;
+  link->last_sequence = sequence;
+
+  if (link->expected > LOSS_WINDOW) {
+    link->expected /= 2;
+    link->received /= 2;
+  }
+
+  if (is_driver(link)) {
+    publish_driver();
+  }
+}
+
+void link_set_driver(int client) {
+  record_link(record_link_driver, client, 0);
+  uint32_t session = 0;
+  if (client != LINK_NO_CLIENT) {
+    client_link *link = find_or_add_client(client);
+    session = link != NULL ? link->session : 0;
+  }
+
+  if (client != driver || session != driver_session) {
+    ESP_LOGI(TAG, "Client %d is now driving", client);
+    driver = client;
+    driver_session = session;
+    publish_driver();
+  }
+}
+
+void link_client_closed(int client) {
+  record_link(record_link_closed, client, 0);
+  client_link *link = find_client(client);
+  bool was_driver = link != NULL && is_driver(link);
+  if (link != NULL) {
+    link->client = LINK_NO_CLIENT;
+  }
+
+  // Keep the driver recorded so link_lost() sees a dropped link rather than
+  // an idle one. Its socket's next client only takes over by being made
+  // driver itself.
+  if (was_driver) {
+    ESP_LOGW(TAG, "Driving client %d disconnected", client);
+    publish_driver();
+  }
+}
+
+void link_read_stats(link_stats *out) { latch_read(&stats_latch, out); }
+
+bool link_lost(int64_t now) {
+  link_stats stats;
+  link_read_stats(&stats);
+
+  if (stats.client == LINK_NO_CLIENT) {
+    return false;
+  }
+  return !stats.connected || now - stats.last_frame > LINK_TIMEOUT_US;
+}
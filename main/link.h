@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Control link supervision
+//
+// Tracks when frames arrive from each WebSocket client, how regular they are
+// and how many sequenced heartbeats go missing. The client that last sent a
+// position or mode is the driver: if nothing arrives from it for
+// CONFIG_ROBOT_LINK_TIMEOUT_MS, or it disconnects, the link counts as lost
+// and manual driving ramps down to a stop. A driver of LINK_NO_CLIENT means
+// nobody is driving, which is never a lost link. A new client that gets a
+// disconnected driver's socket doesn't revive the link until it is made
+// driver with link_set_driver().
+//
+// The link_*_received(), link_set_driver() and link_client_closed() calls
+// must all come from the httpd task. Reads are safe from anywhere.
+
+#define LINK_NO_CLIENT -1
+
+typedef struct {
+  // Socket of the driving client, or LINK_NO_CLIENT
+  int client;
+  // False once the driving client has disconnected
+  bool connected;
+  // Arrival time of its latest frame
+  int64_t last_frame;
+  // Smoothed variation between consecutive frame gaps, in ms
+  float jitter_ms;
+  // Share of sequenced heartbeats that never arrived, in percent
+  float loss_percent;
+} link_stats;
+
+void link_frame_received(int client, int64_t received_at);
+void link_heartbeat_received(int client, uint16_t sequence);
+void link_set_driver(int client);
+void link_client_closed(int client);
+
+void link_read_stats(link_stats *out);
+
+// Whether manual driving should stop because the driver went quiet
+bool link_lost(int64_t now);
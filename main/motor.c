@@ -1,40 +1,298 @@
-#include "driver/gpio.h"
-#include "driver/mcpwm.h"
-#include "esp_log.h"
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include "deferred_log.h"
+#include "hal.h"
 #include "motor.h"
+#include "odometry.h"
+#include "recorder.h"
+#include "tasks.h"
+#include "trace.h"
 
 static char *TAG = "robot-motor";
 
-// Select pin number as a GPIO and set it to output mode
-static void initialize_output_gpio(int pin_number) {
-  gpio_pad_select_gpio(pin_number);
-  gpio_set_direction(pin_number, GPIO_MODE_OUTPUT);
+#define PWM_FREQUENCY 10000
+
+#define SPEED_LOOP_PERIOD_US 10000
+// Limits on how fast the setpoint may change, in percent of full speed per
+// second and per second squared
+#define MAX_ACCEL ((float)CONFIG_ROBOT_MOTOR_MAX_ACCEL)
+#define MAX_JERK ((float)CONFIG_ROBOT_MOTOR_MAX_JERK)
+
+// Speed loop gains, acting on errors in percent of full speed. The target is
+// fed forward as the duty, so these only have to correct for the motor.
+#define SPEED_KP 0.6f
+#define SPEED_KI 4.0f
+// Cap on the integral's share of the duty, in percent
+#define SPEED_INTEGRAL_LIMIT 40.0f
+// Weight of the newest sample in the measured speed. A period only sees a
+// handful of encoder counts, so raw samples are coarse.
+#define SPEED_SMOOTHING 0.5f
+
+#define MOTOR_EVENT_TICK (1 << 0)
+#define MOTOR_EVENT_COMMAND(index) (1 << (1 + (index)))
+#define MOTOR_EVENT_STANDBY (1 << 3)
+
+#define CONTROLLED_MOTORS 2
+
+static motor *controlled[CONTROLLED_MOTORS];
+static TaskHandle_t motor_task = NULL;
+static hal_timer_t speed_loop_timer = NULL;
+// When the speed loop timer was last started. Ticks are due every
+// SPEED_LOOP_PERIOD_US after it, which is what their lateness is traced
+// against.
+static int64_t tick_origin = 0;
+
+// Asked for by set_motor_standby(), and what the pins are set to
+static bool standby_requested = false;
+static bool in_standby = false;
+
+static float clamp(float x, float limit) {
+  return fminf(limit, fmaxf(x, -limit));
+}
+
+static void write_duty(motor *m, float duty) {
+  duty = clamp(duty, 100);
+
+  if (duty >= 0) {
+    // Forward motion
+    hal_gpio_set_level(m->in1, 0);
+    hal_gpio_set_level(m->in2, 1);
+    hal_pwm_set_duty(m->pwm_unit, m->pwm_timer, m->pwm_op, duty);
+  } else {
+    // Backward motion
+    hal_gpio_set_level(m->in1, 1);
+    hal_gpio_set_level(m->in2, 0);
+    hal_pwm_set_duty(m->pwm_unit, m->pwm_timer, m->pwm_op, -duty);
+  }
+}
+
+// Record the reaction that led to the command now on the pins, once
+static void trace_applied(motor *m) {
+  if (m->applied_origin >= 0) {
+    trace_record(m->applied_point, m->applied_origin);
+    m->applied_origin = -1;
+  }
+}
+
+// Put the latest command on the pins. Driving is left to the next tick so
+// that it can be ramped.
+static void apply_command(motor *m) {
+  enum motor_command command = m->command;
+  m->applied_point = m->origin_point;
+  m->applied_origin = m->origin;
+
+  switch (command) {
+  case motor_coast:
+    hal_gpio_set_level(m->in1, 0);
+    hal_gpio_set_level(m->in2, 0);
+    trace_applied(m);
+    break;
+  case motor_brake:
+    hal_gpio_set_level(m->in1, 1);
+    hal_gpio_set_level(m->in2, 1);
+    trace_applied(m);
+    break;
+  case motor_drive:
+    if (m->applied != motor_drive) {
+      // Pick up from however fast the wheel is still turning
+      float speed = m->encoder_unit == MOTOR_NO_ENCODER ? 0 : m->current_speed;
+      m->profile = (motion_profile){.speed = speed, .accel = 0};
+      m->pid.integral = 0;
+    }
+    break;
+  }
+
+  m->applied = command;
+}
+
+// Move the setpoint towards target. The acceleration is capped at what can
+// still be wound down to zero at the jerk limit by the time the target is
+// reached, so the setpoint doesn't overshoot.
+static void profile_step(motion_profile *p, float target, float dt) {
+  float error = target - p->speed;
+  if (error == 0 && p->accel == 0) {
+    return;
+  }
+
+  float reachable = sqrtf(2 * MAX_JERK * fabsf(error));
+  float desired = copysignf(fminf(MAX_ACCEL, reachable), error);
+  p->accel += clamp(desired - p->accel, MAX_JERK * dt);
+
+  float next = p->speed + p->accel * dt;
+  if ((target - next) * error <= 0) {
+    p->speed = target;
+    p->accel = 0;
+  } else {
+    p->speed = next;
+  }
+}
+
+// Hand a new command to the motor task, or apply it straight away if the
+// speed loop isn't running yet
+static void submit_command(motor *m) {
+  m->origin_point = m->next_point;
+  m->origin = m->next_origin;
+  m->next_origin = -1;
+
+  if (motor_task == NULL) {
+    apply_command(m);
+    return;
+  }
+
+  for (int i = 0; i < CONTROLLED_MOTORS; i++) {
+    if (controlled[i] == m) {
+      xTaskNotify(motor_task, MOTOR_EVENT_COMMAND(i), eSetBits);
+    }
+  }
+}
+
+static void measure_speed(motor *m, float dt) {
+  int32_t count = hal_encoder_count(m->encoder_unit);
+  int32_t delta = count - m->pid.last_count;
+  m->pid.last_count = count;
+  m->travel_cm =
+      (float)delta / ENCODER_COUNTS_PER_REV * MOTOR_WHEEL_CIRCUMFERENCE_CM;
+
+  const float full_speed = ENCODER_COUNTS_PER_REV * MOTOR_FULL_SPEED_RPS;
+  float measured = delta / dt / full_speed * 100;
+  m->current_speed += SPEED_SMOOTHING * (measured - m->current_speed);
+}
+
+// Duty that makes the wheel follow setpoint
+static float speed_correction(motor *m, float setpoint, float dt) {
+  float error = setpoint - m->current_speed;
+  float integral =
+      clamp(m->pid.integral + SPEED_KI * error * dt, SPEED_INTEGRAL_LIMIT);
+  // Stop integrating while saturated so it doesn't wind up
+  if (fabsf(setpoint + SPEED_KP * error + integral) < 100) {
+    m->pid.integral = integral;
+  }
+
+  return setpoint + SPEED_KP * error + m->pid.integral;
 }
 
-static void initialize_pwm_output(int pin_number, int pwm_unit, int pwm_timer,
-                                  mcpwm_operator_t pwm_op) {
-  mcpwm_gpio_init(MCPWM_UNIT_0, MCPWM0A, pin_number);
+static void update_speed(motor *m, int64_t now) {
+  float dt = (now - m->pid.last_sample) / 1e6f;
+  m->pid.last_sample = now;
+  m->travel_cm = 0;
+  if (dt <= 0) {
+    return;
+  }
+
+  bool closed_loop = m->encoder_unit != MOTOR_NO_ENCODER;
+  if (closed_loop) {
+    measure_speed(m, dt);
+  }
+  if (m->applied != motor_drive) {
+    return;
+  }
 
-  mcpwm_config_t pwm_config;
-  pwm_config.frequency = 10000;
-  pwm_config.cmpr_a = 0;
-  pwm_config.cmpr_b = 0;
-  pwm_config.counter_mode = MCPWM_UP_COUNTER;
-  pwm_config.duty_mode = MCPWM_DUTY_MODE_0;
-  mcpwm_init(pwm_unit, pwm_timer, &pwm_config);
+  profile_step(&m->profile, m->target_speed, dt);
+  float setpoint = m->profile.speed;
+  if (!closed_loop) {
+    m->current_speed = setpoint;
+    m->travel_cm = setpoint / 100 * MOTOR_FULL_SPEED_RPS *
+                   MOTOR_WHEEL_CIRCUMFERENCE_CM * dt;
+    write_duty(m, setpoint);
+  } else if (setpoint == 0) {
+    m->pid.integral = 0;
+    write_duty(m, 0);
+  } else {
+    write_duty(m, speed_correction(m, setpoint, dt));
+  }
+  trace_applied(m);
+}
+
+static void speed_loop_tick(void *arg) {
+  xTaskNotify(motor_task, MOTOR_EVENT_TICK, eSetBits);
+}
+
+static void apply_standby(int64_t now) {
+  bool standby = __atomic_load_n(&standby_requested, __ATOMIC_ACQUIRE);
+  if (standby == in_standby) {
+    return;
+  }
+
+  in_standby = standby;
+  for (int i = 0; i < CONTROLLED_MOTORS; i++) {
+    hal_gpio_set_level(controlled[i]->stdby, !standby);
+  }
+  if (standby) {
+    hal_timer_pause(speed_loop_timer);
+    return;
+  }
+
+  // Don't take the time in standby for one long tick
+  for (int i = 0; i < CONTROLLED_MOTORS; i++) {
+    motor *m = controlled[i];
+    m->pid.last_sample = now;
+    if (m->encoder_unit != MOTOR_NO_ENCODER) {
+      m->pid.last_count = hal_encoder_count(m->encoder_unit);
+    }
+  }
+  tick_origin = hal_time_us();
+  hal_timer_resume(speed_loop_timer);
+}
+
+// Only this task writes to the motor pins once it is running, so commands
+// and speed loop corrections can't interleave
+static void motor_control_loop() {
+  for (;;) {
+    uint32_t events;
+    xTaskNotifyWait(0, UINT32_MAX, &events, portMAX_DELAY);
+    int64_t now = hal_time_us();
+
+    if (events & MOTOR_EVENT_STANDBY) {
+      apply_standby(now);
+    }
+
+    for (int i = 0; i < CONTROLLED_MOTORS; i++) {
+      motor *m = controlled[i];
+      if (events & MOTOR_EVENT_COMMAND(i)) {
+        apply_command(m);
+      }
+      if (events & MOTOR_EVENT_TICK) {
+        update_speed(m, now);
+      }
+    }
+
+    if (events & MOTOR_EVENT_TICK) {
+      odometry_update(controlled[0]->travel_cm, controlled[1]->travel_cm);
+      trace_record(trace_motor_tick,
+                   now - (now - tick_origin) % SPEED_LOOP_PERIOD_US);
+    }
+  }
 }
 
 void stop_motor(motor *m) {
-  gpio_set_level(m->in1, 0);
-  gpio_set_level(m->in2, 0);
-  m->current_speed = 0;
+  record_command(m->pwm_unit, motor_coast, 0);
+  m->command = motor_coast;
+  m->target_speed = 0;
+  if (m->encoder_unit == MOTOR_NO_ENCODER) {
+    m->current_speed = 0;
+  }
+  submit_command(m);
 }
 
 void brake_motor(motor *m) {
-  gpio_set_level(m->in1, 1);
-  gpio_set_level(m->in2, 1);
-  m->current_speed = 0;
+  record_command(m->pwm_unit, motor_brake, 0);
+  m->command = motor_brake;
+  m->target_speed = 0;
+  if (m->encoder_unit == MOTOR_NO_ENCODER) {
+    m->current_speed = 0;
+  }
+  submit_command(m);
+}
+
+void trace_next_command(motor *m, enum trace_point point, int64_t origin) {
+  m->next_point = point;
+  m->next_origin = origin;
 }
 
 motor initialize_motor(int in1, int in2, int stdb, int pwm,
@@ -43,26 +301,59 @@ motor initialize_motor(int in1, int in2, int stdb, int pwm,
   motor new_motor = {
       .in1 = in1,
       .in2 = in2,
+      .stdby = stdb,
       .pwm = pwm,
       .pwm_unit = pwm_unit,
       .pwm_timer = pwm_timer,
       .pwm_op = pwm_op,
+      .encoder_unit = MOTOR_NO_ENCODER,
       .current_speed = 0,
+      .next_origin = -1,
+      .origin = -1,
+      .applied_origin = -1,
   };
 
-  initialize_output_gpio(in1);
-  initialize_output_gpio(in2);
+  hal_gpio_output(in1);
+  hal_gpio_output(in2);
   // are we allowed to re-initialize when sharing between motors?
-  initialize_output_gpio(stdb);
+  hal_gpio_output(stdb);
   stop_motor(&new_motor);
-  initialize_pwm_output(pwm, pwm_unit, pwm_timer, pwm_op);
+  hal_pwm_init(pwm, pwm_unit, pwm_timer, PWM_FREQUENCY);
 
   // Disable standby mode
-  gpio_set_level(stdb, 1);
+  hal_gpio_set_level(stdb, 1);
 
   return new_motor;
 }
 
+void attach_encoder(motor *m, int unit, int a, int b) {
+  ESP_ERROR_CHECK(hal_encoder_init(unit, a, b));
+  m->encoder_unit = unit;
+}
+
+void start_motor_control(motor *left, motor *right) {
+  controlled[0] = left;
+  controlled[1] = right;
+  for (int i = 0; i < CONTROLLED_MOTORS; i++) {
+    motor *m = controlled[i];
+    m->pid.last_sample = hal_time_us();
+    if (m->encoder_unit != MOTOR_NO_ENCODER) {
+      m->pid.last_count = hal_encoder_count(m->encoder_unit);
+    }
+  }
+
+  motor_task = task_start(task_motor_control, motor_control_loop, NULL);
+  tick_origin = hal_time_us();
+  ESP_ERROR_CHECK(hal_timer_start_periodic(
+      SPEED_LOOP_PERIOD_US, speed_loop_tick, NULL, &speed_loop_timer));
+}
+
+void set_motor_standby(bool standby) {
+  assert(motor_task != NULL);
+  __atomic_store_n(&standby_requested, standby, __ATOMIC_RELEASE);
+  xTaskNotify(motor_task, MOTOR_EVENT_STANDBY, eSetBits);
+}
+
 // Set motor to run at a percentage of it's maximum speed
 //
 // Can be specified as negative for backwards motion
@@ -70,19 +361,10 @@ void set_motor_speed(motor *m, float speed) {
   assert(speed <= 100);
   assert(speed >= -100);
 
-  ESP_LOGI(TAG, "Setting motor speed to %f", speed);
-
-  if (speed >= 0) {
-    // Forward motion
-    gpio_set_level(m->in1, 0);
-    gpio_set_level(m->in2, 1);
-    mcpwm_set_duty(m->pwm_unit, m->pwm_timer, m->pwm_op, speed);
-  } else {
-    // Backward motion
-    gpio_set_level(m->in1, 1);
-    gpio_set_level(m->in2, 0);
-    mcpwm_set_duty(m->pwm_unit, m->pwm_timer, m->pwm_op, -speed);
-  }
+  DLOGI(TAG, "Setting motor speed to %f", speed);
+  record_command(m->pwm_unit, motor_drive, speed);
 
-  m->current_speed = speed;
+  m->target_speed = speed;
+  m->command = motor_drive;
+  submit_command(m);
 }
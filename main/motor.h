@@ -1,21 +1,100 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "driver/mcpwm.h"
 
+#include "trace.h"
+
+// Encoder counts per wheel revolution, counting every edge of both channels
+#define ENCODER_COUNTS_PER_REV 1320
+// Wheel revolutions per second at full duty. Measured speeds are reported as
+// a percentage of this, the same scale set_motor_speed() takes.
+#define MOTOR_FULL_SPEED_RPS 2.9f
+// Distance rolled per wheel revolution
+#define MOTOR_WHEEL_CIRCUMFERENCE_CM 20.7f
+
+#define MOTOR_NO_ENCODER -1
+
+enum motor_command { motor_coast, motor_brake, motor_drive };
+
+typedef struct {
+  float integral;
+  int32_t last_count;
+  int64_t last_sample;
+} speed_pid;
+
+// Setpoint that ramps towards target_speed within the accel and jerk limits
+typedef struct {
+  float speed;
+  float accel;
+} motion_profile;
+
 typedef struct {
   int in1;
   int in2;
+  // Driver standby pin, may be shared with the other motor
+  int stdby;
   int pwm;
   mcpwm_unit_t pwm_unit;
   mcpwm_timer_t pwm_timer;
   mcpwm_operator_t pwm_op;
+  // Pulse counter unit of the wheel encoder, or MOTOR_NO_ENCODER to run open
+  // loop
+  int encoder_unit;
+  enum motor_command command;
+  // What the pins are currently set up for
+  enum motor_command applied;
+  // Speed last asked for by set_motor_speed()
+  float target_speed;
+  // Measured speed, or the commanded one when running open loop
   float current_speed;
+  // Distance rolled during the last speed loop tick, in cm. Counted by the
+  // encoder, or estimated from the setpoint when running open loop.
+  float travel_cm;
+  speed_pid pid;
+  motion_profile profile;
+  // Reaction the next command completes, see trace_next_command()
+  enum trace_point next_point;
+  int64_t next_origin;
+  // Reaction the latest command completes, -1 for none. Handed to the motor
+  // task along with the command itself.
+  enum trace_point origin_point;
+  int64_t origin;
+  // Held by the motor task until the command reaches the pins
+  enum trace_point applied_point;
+  int64_t applied_origin;
 } motor;
 
 motor initialize_motor(int in1, int in2, int stdb, int pwm,
                        mcpwm_unit_t pwm_unit, mcpwm_timer_t pwm_timer,
                        mcpwm_operator_t pwm_op);
 
+// Close the speed loop using a quadrature encoder on pulse counter unit
+void attach_encoder(motor *m, int unit, int a, int b);
+
+// Start the task that applies motor commands and runs the speed loop
+//
+// Speeds are ramped on the loop's fixed tick, so set_motor_speed() has no
+// effect until this is called.
+void start_motor_control(motor *left, motor *right);
+
+// Ramp towards speed within the acceleration and jerk limits
 void set_motor_speed(motor *m, float speed);
+// Short the motor terminals right away, bypassing the limits. Meant for
+// emergency stops.
 void brake_motor(motor *m);
+// Let the motor coast
 void stop_motor(motor *m);
+
+// Record point against origin once the next command given to m reaches the
+// pins: straight away for a brake or coast, and on the first duty written
+// for a speed. An origin of -1 clears it.
+void trace_next_command(motor *m, enum trace_point point, int64_t origin);
+
+// Put the driver chip into standby and pause the speed loop, or bring both
+// back. Meant for when the motors are stopped anyway: they can't drive until
+// woken, though commands still go through and take effect then. Needs
+// start_motor_control().
+void set_motor_standby(bool standby);
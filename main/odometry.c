@@ -0,0 +1,28 @@
+#include <math.h>
+
+#include "latch.h"
+#include "odometry.h"
+#include "recorder.h"
+
+static pose current = {.x = 0, .y = 0, .theta = 0};
+static LATCH(pose) pose_latch;
+
+void odometry_update(float left_cm, float right_cm) {
+  if (left_cm == 0 && right_cm == 0) {
+    return;
+  }
+  record_odometry(left_cm, right_cm);
+
+  float distance = (left_cm + right_cm) / 2;
+  float turn = (right_cm - left_cm) / ROBOT_TRACK_WIDTH_CM;
+
+  // Move along the average heading over the tick
+  float heading = current.theta + turn / 2;
+  current.x += distance * cosf(heading);
+  current.y += distance * sinf(heading);
+  current.theta = remainderf(current.theta + turn, 2 * (float)M_PI);
+
+  latch_publish(&pose_latch, &current);
+}
+
+void odometry_read(pose *out) { latch_read(&pose_latch, out); }
@@ -0,0 +1,23 @@
+#pragma once
+
+// Dead-reckoned pose of the robot
+//
+// The motor task integrates how far each wheel rolled on every speed loop
+// tick. The pose starts out at the origin facing along +x when the firmware
+// boots; x and y are in cm and theta in radians, counter-clockwise.
+
+// Distance between the wheels' contact points
+#define ROBOT_TRACK_WIDTH_CM 12.0f
+
+typedef struct {
+  float x;
+  float y;
+  float theta;
+} pose;
+
+// Advance the pose by one tick's wheel travel. Must only be called from the
+// motor task.
+void odometry_update(float left_cm, float right_cm);
+
+// Latest pose, safe to call from any task
+void odometry_read(pose *out);
@@ -0,0 +1,164 @@
+#include <math.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "controller.h"
+#include "hal.h"
+#include "params.h"
+#include "recorder.h"
+#include "tasks.h"
+
+static const char *TAG = "robot-params";
+
+static const param_info registry[PARAM_COUNT] = {
+    [param_steer_divisor] = {"steer_divisor", param_type_float, 2, 0.5, 10},
+    [param_left_deadband] = {"left_deadband", param_type_float, 7, 0, 50},
+    [param_right_deadband] = {"right_deadband", param_type_float, 10, 0, 50},
+    [param_obstructed_cm] = {"obstructed_cm", param_type_int, 60, 20, 200},
+    [param_forward_ms] = {"forward_ms", param_type_int, 3000, 500, 30000},
+    [param_turn_ms] = {"turn_ms", param_type_int, 1500, 200, 10000},
+    [param_cruise_speed] = {"cruise_speed", param_type_float, 40, 10, 100},
+    [param_turn_speed] = {"turn_speed", param_type_float, 50, 10, 100},
+    [param_slot_guard_ms] = {"slot_guard_ms", param_type_int, 10, 0, 100},
+};
+
+// How often changes waiting to be stored check whether the robot stopped
+#define STORE_RETRY_MS 1000
+
+static float values[PARAM_COUNT];
+
+// Bit per parameter changed since it was last stored, and per parameter
+// whose stored value is to be forgotten rather than written
+static uint32_t unsaved = 0;
+static uint32_t unsaved_resets = 0;
+static TaskHandle_t store_task = NULL;
+
+// Stored as the float's bits, which round trip exactly
+static uint32_t to_bits(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static float from_bits(uint32_t bits) {
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static void publish(enum param_id id, float value) {
+  __atomic_store(&values[id], &value, __ATOMIC_RELEASE);
+  record_param(id, value);
+}
+
+void params_init() {
+  for (int id = 0; id < PARAM_COUNT; id++) {
+    float value = registry[id].fallback;
+    uint32_t bits;
+    if (hal_settings_get(registry[id].name, &bits) == ESP_OK) {
+      if (param_valid(id, from_bits(bits))) {
+        value = from_bits(bits);
+        ESP_LOGI(TAG, "%s = %g", registry[id].name, value);
+      } else {
+        // Probably stored by a build with a different range
+        ESP_LOGW(TAG, "Ignoring stored %s, out of range",
+                 registry[id].name);
+      }
+    }
+    publish(id, value);
+  }
+}
+
+float param_get(enum param_id id) {
+  float value;
+  __atomic_load(&values[id], &value, __ATOMIC_ACQUIRE);
+  return value;
+}
+
+const param_info *param_get_info(enum param_id id) { return &registry[id]; }
+
+bool param_find(const char *name, enum param_id *id) {
+  for (int i = 0; i < PARAM_COUNT; i++) {
+    if (strcmp(registry[i].name, name) == 0) {
+      *id = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool param_valid(enum param_id id, float value) {
+  const param_info *info = &registry[id];
+  if (!(value >= info->min && value <= info->max)) {
+    return false;
+  }
+  return info->type != param_type_int || value == truncf(value);
+}
+
+static void mark_unsaved(enum param_id id, bool reset) {
+  if (reset) {
+    __atomic_fetch_or(&unsaved_resets, 1u << id, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_and(&unsaved_resets, ~(1u << id), __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_or(&unsaved, 1u << id, __ATOMIC_RELEASE);
+  if (store_task != NULL) {
+    xTaskNotify(store_task, 0, eNoAction);
+  }
+}
+
+esp_err_t param_set(enum param_id id, float value) {
+  if (!param_valid(id, value)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  publish(id, value);
+  mark_unsaved(id, false);
+  return ESP_OK;
+}
+
+void param_reset(enum param_id id) {
+  publish(id, registry[id].fallback);
+  mark_unsaved(id, true);
+}
+
+static void store(enum param_id id, bool reset) {
+  const char *name = registry[id].name;
+  esp_err_t ret = reset ? hal_settings_erase(name)
+                        : hal_settings_set(name, to_bits(param_get(id)));
+  if (ret != ESP_OK && ret != ESP_ERR_NOT_FOUND) {
+    ESP_LOGW(TAG, "Storing %s failed, it will reset on reboot: %s", name,
+             esp_err_to_name(ret));
+  }
+}
+
+// Writing flash stalls both cores, so changes are only stored while the
+// robot is off, never in the middle of driving
+static void store_loop(void *arg) {
+  for (;;) {
+    bool pending = __atomic_load_n(&unsaved, __ATOMIC_ACQUIRE) != 0;
+    xTaskNotifyWait(0, UINT32_MAX, NULL,
+                    pending ? pdMS_TO_TICKS(STORE_RETRY_MS) : portMAX_DELAY);
+
+    remote_state inputs;
+    controller_read_remote(&inputs);
+    if (inputs.mode != mode_off) {
+      continue;
+    }
+
+    uint32_t changed = __atomic_exchange_n(&unsaved, 0, __ATOMIC_ACQUIRE);
+    uint32_t resets = __atomic_load_n(&unsaved_resets, __ATOMIC_RELAXED);
+    for (int id = 0; id < PARAM_COUNT; id++) {
+      if (changed & (1u << id)) {
+        store(id, resets & (1u << id));
+      }
+    }
+  }
+}
+
+void params_start_storing() {
+  store_task = task_start(task_params, store_loop, NULL);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// Runtime tunable parameters
+//
+// The driving constants that need retuning for each floor surface, kept in
+// RAM and persisted in the settings store (see hal.h) so they survive a
+// reboot. Reads are a single atomic load, safe from any task or ISR and
+// cheap enough to do on every use, so a change takes effect the next time
+// the control code looks. Only the httpd task changes them. Storing a
+// change waits until the robot is off, since writing flash stalls both
+// cores.
+
+enum param_id {
+  param_steer_divisor,  // manual turn rate, x is divided by this
+  param_left_deadband,  // manual speeds below this stop the left motor
+  param_right_deadband, // same for the right motor
+  param_obstructed_cm,  // anything closer ahead stops autonomous driving
+  param_forward_ms,     // autonomous driving changes course this often
+  param_turn_ms,        // longest autonomous turn
+  param_cruise_speed,   // autonomous forward speed
+  param_turn_speed,     // autonomous turning speed
+  param_slot_guard_ms,  // pause between ultrasonic trigger slots
+  PARAM_COUNT,
+};
+
+enum param_type { param_type_float, param_type_int };
+
+typedef struct {
+  // Also the settings key, so at most 15 characters
+  const char *name;
+  enum param_type type;
+  float fallback;
+  float min;
+  float max;
+} param_info;
+
+// Load the stored values, falling back to the defaults. Call once at boot
+// before anything reads a parameter, and after recorder_start() so that a
+// replay starts from the same values.
+void params_init();
+
+// Start the low priority task that stores changes. Until then they are kept
+// in RAM only, which is all the host builds want.
+void params_start_storing();
+
+float param_get(enum param_id id);
+static inline int32_t param_get_int(enum param_id id) {
+  return (int32_t)param_get(id);
+}
+
+const param_info *param_get_info(enum param_id id);
+
+// Returns false if no parameter has that name
+bool param_find(const char *name, enum param_id *id);
+
+// Whether value is in range, and whole for integer parameters
+bool param_valid(enum param_id id, float value);
+
+// Change a parameter, storing it once the robot is off. Returns
+// ESP_ERR_INVALID_ARG if the value isn't valid, leaving the parameter as it
+// was.
+esp_err_t param_set(enum param_id id, float value);
+
+// Go back to the default, forgetting the stored value once the robot is off
+void param_reset(enum param_id id);
@@ -0,0 +1,98 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+
+#include "controller.h"
+#include "hal.h"
+#include "motor.h"
+#include "power.h"
+#include "tasks.h"
+#include "ultrasonic.h"
+
+static const char *TAG = "robot-power";
+
+#define IDLE_TIMEOUT_MS ((uint32_t)CONFIG_ROBOT_IDLE_TIMEOUT_S * 1000)
+// How often an awake robot checks whether it has gone idle
+#define IDLE_CHECK_MS 1000
+
+static TaskHandle_t power_task = NULL;
+static bool idle = false;
+// Time of the latest input in ms, kept to a word so it can be stored from
+// any task atomically. Wraps after 49 days, which the subtraction in
+// idle_due() doesn't mind.
+static uint32_t last_activity_ms = 0;
+
+static uint32_t now_ms() { return (uint32_t)(hal_time_us() / 1000); }
+
+static bool idle_due() {
+  if (IDLE_TIMEOUT_MS == 0) {
+    return false;
+  }
+
+  remote_state inputs;
+  controller_read_remote(&inputs);
+  uint32_t last = __atomic_load_n(&last_activity_ms, __ATOMIC_SEQ_CST);
+  return inputs.mode == mode_off && now_ms() - last >= IDLE_TIMEOUT_MS;
+}
+
+static void check(esp_err_t ret) {
+  if (ret != ESP_OK) {
+    ESP_LOGW(TAG, "Changing power saving failed: %s", esp_err_to_name(ret));
+  }
+}
+
+static void enter_idle() {
+  // Input racing with this either shows up in the second look, or sees idle
+  // already set and wakes us straight back up
+  __atomic_store_n(&idle, true, __ATOMIC_SEQ_CST);
+  if (!idle_due()) {
+    __atomic_store_n(&idle, false, __ATOMIC_SEQ_CST);
+    ultrasonic_wake();
+    return;
+  }
+
+  ESP_LOGI(TAG, "Idle, saving power");
+  set_motor_standby(true);
+  check(hal_power_save(true));
+}
+
+// Clocks first, so the rest wakes at full speed
+static void wake() {
+  check(hal_power_save(false));
+  set_motor_standby(false);
+  __atomic_store_n(&idle, false, __ATOMIC_RELEASE);
+  ultrasonic_wake();
+  ESP_LOGI(TAG, "Awake");
+}
+
+static void power_loop() {
+  for (;;) {
+    TickType_t wait = idle ? portMAX_DELAY : pdMS_TO_TICKS(IDLE_CHECK_MS);
+    bool woken = xTaskNotifyWait(0, UINT32_MAX, NULL, wait);
+
+    if (idle && woken) {
+      wake();
+    } else if (!idle && idle_due()) {
+      enter_idle();
+    }
+  }
+}
+
+void power_init() {
+  check(hal_power_init());
+  __atomic_store_n(&last_activity_ms, now_ms(), __ATOMIC_RELAXED);
+  power_task = task_start(task_power, power_loop, NULL);
+}
+
+void power_activity() {
+  __atomic_store_n(&last_activity_ms, now_ms(), __ATOMIC_SEQ_CST);
+  if (power_task != NULL && __atomic_load_n(&idle, __ATOMIC_SEQ_CST)) {
+    xTaskNotify(power_task, 0, eNoAction);
+  }
+}
+
+bool power_idle() { return __atomic_load_n(&idle, __ATOMIC_ACQUIRE); }
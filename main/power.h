@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Power saving while the robot sits idle
+//
+// Once the robot has been off (mode_off) for CONFIG_ROBOT_IDLE_TIMEOUT_S
+// with no input from the remote, the ultrasonic sensors stop firing, the
+// motor driver goes into standby and the clocks and WiFi modem are allowed
+// to sleep (see hal_power_save()). The next input wakes it all up before
+// the input itself is acted on. Heartbeats don't count as input, a remote
+// left open on a table shouldn't keep the robot awake.
+
+// Start the power manager task. Call once WiFi is up.
+void power_init();
+
+// Input arrived from the remote. Cheap, call it for every frame that isn't
+// a heartbeat.
+void power_activity();
+
+// Whether the robot is idling. Safe from any task.
+bool power_idle();
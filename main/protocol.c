@@ -0,0 +1,151 @@
+#include "math.h"
+
+#include "protocol.h"
+
+static int16_t read_i16(const uint8_t *buf) {
+  return (int16_t)(buf[0] | (buf[1] << 8));
+}
+
+static uint16_t read_u16(const uint8_t *buf) {
+  return (uint16_t)(buf[0] | (buf[1] << 8));
+}
+
+static void write_i16(uint8_t *buf, int16_t value) {
+  buf[0] = (uint16_t)value & 0xff;
+  buf[1] = ((uint16_t)value >> 8) & 0xff;
+}
+
+static void write_u16(uint8_t *buf, uint16_t value) {
+  buf[0] = value & 0xff;
+  buf[1] = (value >> 8) & 0xff;
+}
+
+// Convert a percentage to hundredths, saturating at the int16 range
+static int16_t to_centi(float value) {
+  float scaled = roundf(value * 100);
+  return (int16_t)fminf(INT16_MAX, fmaxf(scaled, INT16_MIN));
+}
+
+static uint16_t to_millimeters(float centimeters) {
+  float scaled = roundf(centimeters * 10);
+  return (uint16_t)fminf(UINT16_MAX, fmaxf(scaled, 0));
+}
+
+// Positions saturate at the int16 range, about 32 m either way
+static int16_t to_signed_millimeters(float centimeters) {
+  float scaled = roundf(centimeters * 10);
+  return (int16_t)fminf(INT16_MAX, fmaxf(scaled, INT16_MIN));
+}
+
+esp_err_t protocol_decode(const uint8_t *buf, size_t len,
+                          remote_event *event) {
+  if (len < PROTOCOL_HEADER_LEN) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+  if (buf[0] != PROTOCOL_VERSION) {
+    return ESP_ERR_INVALID_VERSION;
+  }
+
+  switch (buf[1]) {
+  case msg_heartbeat:
+  case msg_control:
+    return ESP_ERR_NOT_FOUND;
+  case msg_position:
+    if (len < POSITION_MSG_LEN) {
+      return ESP_ERR_INVALID_SIZE;
+    }
+    event->type = position;
+    event->new_position[0] = read_i16(&buf[2]) / 100.0f;
+    event->new_position[1] = read_i16(&buf[4]) / 100.0f;
+    return ESP_OK;
+  case msg_mode:
+    if (len < MODE_MSG_LEN) {
+      return ESP_ERR_INVALID_SIZE;
+    }
+    if (buf[2] > mode_manual) {
+      return ESP_ERR_INVALID_ARG;
+    }
+    event->type = mode;
+    event->new_mode = (enum control_mode)buf[2];
+    return ESP_OK;
+  default:
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+}
+
+esp_err_t protocol_decode_heartbeat(const uint8_t *buf, size_t len,
+                                    uint16_t *sequence) {
+  if (len < PROTOCOL_HEADER_LEN || buf[0] != PROTOCOL_VERSION ||
+      buf[1] != msg_heartbeat) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (len < HEARTBEAT_MSG_LEN) {
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  *sequence = read_u16(&buf[2]);
+  return ESP_OK;
+}
+
+esp_err_t protocol_decode_control(const uint8_t *buf, size_t len, bool *take) {
+  if (len < CONTROL_MSG_LEN || buf[0] != PROTOCOL_VERSION ||
+      buf[1] != msg_control) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  *take = buf[2] != 0;
+  return ESP_OK;
+}
+
+static uint16_t to_link_age(float milliseconds) {
+  if (milliseconds < 0) {
+    return TELEMETRY_NO_LINK;
+  }
+  return (uint16_t)fminf(UINT16_MAX - 1, roundf(milliseconds));
+}
+
+size_t protocol_encode_telemetry(const telemetry *state, uint8_t *buf,
+                                 size_t buf_len) {
+  if (buf_len < TELEMETRY_MSG_LEN) {
+    return 0;
+  }
+
+  buf[0] = PROTOCOL_VERSION;
+  buf[1] = msg_telemetry;
+  write_i16(&buf[2], to_centi(state->left_speed));
+  write_i16(&buf[4], to_centi(state->right_speed));
+  write_u16(&buf[6], to_millimeters(state->distances[sensor_front]));
+  buf[8] = state->mode;
+
+  uint8_t *field = &buf[9];
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    if (i != sensor_front) {
+      write_u16(field, to_millimeters(state->distances[i]));
+      field += 2;
+    }
+  }
+  write_i16(&field[0], to_centi(state->left_target));
+  write_i16(&field[2], to_centi(state->right_target));
+  write_u16(&field[4], to_link_age(state->link_age_ms));
+  write_u16(&field[6],
+            (uint16_t)fminf(UINT16_MAX, roundf(state->link_jitter_ms)));
+  field[8] = (uint8_t)fminf(100, roundf(state->link_loss_percent));
+  write_i16(&field[9], to_signed_millimeters(state->odometry.x));
+  write_i16(&field[11], to_signed_millimeters(state->odometry.y));
+  write_i16(&field[13], (int16_t)roundf(state->odometry.theta * 1000));
+
+  return TELEMETRY_MSG_LEN;
+}
+
+size_t protocol_encode_session(enum session_role role, uint8_t *buf,
+                               size_t buf_len) {
+  if (buf_len < SESSION_MSG_LEN) {
+    return 0;
+  }
+
+  buf[0] = PROTOCOL_VERSION;
+  buf[1] = msg_session;
+  buf[2] = role;
+
+  return SESSION_MSG_LEN;
+}
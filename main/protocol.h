@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#include "controller.h"
+
+// Binary WebSocket frame format
+//
+// Every frame starts with a two byte header: protocol version, then message
+// type. All multi-byte fields are little-endian. Positions and speeds are
+// sent as signed hundredths of a percent, distances as millimeters. Decoders
+// ignore trailing bytes so fields can be appended without a version bump.
+//
+// Telemetry carries the measured wheel speeds at offsets 2 and 4, the front
+// distance at 6 and the mode at 8. Then come the remaining sensors' distances
+// in enum sensor_position order, the target wheel speeds, and the driving
+// client's link stats: frame age and jitter in ms, then loss in percent.
+// Last is the odometry pose: x and y in mm, then heading in milliradians.
+//
+// Heartbeats may carry a 16 bit sequence number at offset 2, which lets the
+// link supervisor count lost frames.
+//
+// Only one client at a time may drive. A control message asks to take (1) or
+// give up (0) that role, and the server answers every change with a session
+// message carrying the client's new enum session_role.
+#define PROTOCOL_VERSION 1
+#define PROTOCOL_HEADER_LEN 2
+
+enum protocol_msg_type {
+  msg_heartbeat = 0x00,
+  msg_position = 0x01,
+  msg_mode = 0x02,
+  msg_control = 0x03,
+  msg_telemetry = 0x80,
+  msg_session = 0x81,
+};
+
+enum session_role { role_spectator, role_operator };
+
+// Byte offsets and sizes of each message, including the header
+#define HEARTBEAT_MSG_LEN (PROTOCOL_HEADER_LEN + 2)
+#define POSITION_MSG_LEN (PROTOCOL_HEADER_LEN + 4)
+#define MODE_MSG_LEN (PROTOCOL_HEADER_LEN + 1)
+#define CONTROL_MSG_LEN (PROTOCOL_HEADER_LEN + 1)
+#define SESSION_MSG_LEN (PROTOCOL_HEADER_LEN + 1)
+#define TELEMETRY_MSG_LEN (PROTOCOL_HEADER_LEN + 22 + 2 * (SENSOR_COUNT - 1))
+
+// Link age sent when no client is driving
+#define TELEMETRY_NO_LINK UINT16_MAX
+
+typedef struct {
+  float left_speed;
+  float right_speed;
+  float left_target;
+  float right_target;
+  float distances[SENSOR_COUNT];
+  enum control_mode mode;
+  // Negative when no client is driving
+  float link_age_ms;
+  float link_jitter_ms;
+  float link_loss_percent;
+  pose odometry;
+} telemetry;
+
+// Decode an inbound binary frame
+//
+// Returns ESP_OK and fills in event for position and mode messages.
+// Heartbeats and control messages return ESP_ERR_NOT_FOUND since they carry
+// no event.
+esp_err_t protocol_decode(const uint8_t *buf, size_t len, remote_event *event);
+
+// Read the sequence number of a heartbeat frame
+//
+// Returns ESP_ERR_NOT_FOUND for heartbeats from clients that don't number
+// them, and ESP_ERR_INVALID_ARG for anything that isn't a heartbeat.
+esp_err_t protocol_decode_heartbeat(const uint8_t *buf, size_t len,
+                                    uint16_t *sequence);
+
+// Read whether a control message takes or gives up the operator role
+//
+// Returns ESP_ERR_INVALID_ARG for anything that isn't a control message.
+esp_err_t protocol_decode_control(const uint8_t *buf, size_t len, bool *take);
+
+// Encode a telemetry message into buf, returning the number of bytes written
+// or 0 if buf is too small
+size_t protocol_encode_telemetry(const telemetry *state, uint8_t *buf,
+                                 size_t buf_len);
+
+// Encode a session message, returning the number of bytes written or 0 if
+// buf is too small
+size_t protocol_encode_session(enum session_role role, uint8_t *buf,
+                               size_t buf_len);
@@ -0,0 +1,571 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "hal.h"
+#include "recorder.h"
+#include "tasks.h"
+
+static const char *TAG = "robot-recorder";
+
+#define RECORD_MAGIC 0x43455252 // "RREC"
+#define RECORD_VERSION 1
+// End of the log, which is what erased storage reads as
+#define RECORD_END 0xff
+
+// Must be a power of two so sequence numbers wrap cleanly
+#define RING_SIZE 128
+#define FLUSH_PERIOD_MS 50
+
+enum recorder_mode { recorder_off, recorder_recording, recorder_replaying };
+
+typedef struct {
+  // Same scheme as the deferred log ring: relative to the slot index so the
+  // zeroed ring starts out free
+  uint32_t seq;
+  record rec;
+} ring_slot;
+
+static ring_slot ring[RING_SIZE];
+static uint32_t write_pos = 0;
+static uint32_t read_pos = 0;
+static uint32_t dropped = 0;
+
+static enum recorder_mode state = recorder_off;
+static recorder_replay_hooks replay_hooks;
+
+// Storage state, only touched by whoever drains the ring
+static size_t storage_size = 0;
+static size_t stored = 0;
+static size_t erased_until = 0;
+static int64_t last_encoded_us = 0;
+
+static bool recording() {
+  return __atomic_load_n(&state, __ATOMIC_ACQUIRE) == recorder_recording;
+}
+
+// Stamp rec and push it into the ring, dropping it if the ring is full
+static void push(record *rec) {
+  rec->time_us = hal_time_us();
+  uint32_t pos = __atomic_load_n(&write_pos, __ATOMIC_RELAXED);
+  ring_slot *slot;
+
+  while (true) {
+    slot = &ring[pos % RING_SIZE];
+    uint32_t seq =
+        __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) + pos % RING_SIZE;
+    int32_t diff = (int32_t)(seq - pos);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&write_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&write_pos, __ATOMIC_RELAXED);
+    }
+  }
+
+  slot->rec = *rec;
+  __atomic_store_n(&slot->seq, pos + 1 - pos % RING_SIZE, __ATOMIC_RELEASE);
+}
+
+static bool pop(record *out) {
+  uint32_t index = read_pos % RING_SIZE;
+  ring_slot *slot = &ring[index];
+  uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) + index;
+  if (seq != read_pos + 1) {
+    return false;
+  }
+
+  *out = slot->rec;
+  __atomic_store_n(&slot->seq, read_pos + RING_SIZE - index,
+                   __ATOMIC_RELEASE);
+  read_pos++;
+  return true;
+}
+
+void record_distance(enum sensor_position sensor, float distance, float rate,
+                     int64_t echo_us) {
+  if (!recording()) {
+    return;
+  }
+  record rec = {.type = record_type_distance,
+                .distance = {.sensor = sensor,
+                             .distance = distance,
+                             .rate = rate,
+                             .echo_us = echo_us}};
+  push(&rec);
+}
+
+void record_remote(const remote_event *event) {
+  if (!recording()) {
+    return;
+  }
+  record rec = {.type = record_type_remote, .remote = {.type = event->type}};
+  if (event->type == position) {
+    rec.remote.position[X_IDX] = event->new_position[X_IDX];
+    rec.remote.position[Y_IDX] = event->new_position[Y_IDX];
+  } else {
+    rec.remote.mode = event->new_mode;
+  }
+  push(&rec);
+}
+
+void record_link(enum record_link_kind kind, int client, uint16_t sequence) {
+  if (!recording()) {
+    return;
+  }
+  record rec = {
+      .type = record_type_link,
+      .link = {.kind = kind, .client = client, .sequence = sequence}};
+  push(&rec);
+}
+
+void record_odometry(float left_cm, float right_cm) {
+  if (!recording()) {
+    return;
+  }
+  record rec = {.type = record_type_odometry,
+                .odometry = {.left_cm = left_cm, .right_cm = right_cm}};
+  push(&rec);
+}
+
+void record_param(uint8_t id, float value) {
+  if (!recording()) {
+    return;
+  }
+  record rec = {.type = record_type_param,
+                .param = {.id = id, .value = value}};
+  push(&rec);
+}
+
+void record_command(uint8_t motor, enum motor_command command, float speed) {
+  record rec = {
+      .type = record_type_command,
+      .command = {.motor = motor, .command = command, .speed = speed}};
+  switch (__atomic_load_n(&state, __ATOMIC_ACQUIRE)) {
+  case recorder_recording:
+    push(&rec);
+    break;
+  case recorder_replaying:
+    rec.time_us = hal_time_us();
+    replay_hooks.command(&rec, replay_hooks.arg);
+    break;
+  default:
+    break;
+  }
+}
+
+uint32_t record_random(uint32_t live) {
+  switch (__atomic_load_n(&state, __ATOMIC_ACQUIRE)) {
+  case recorder_recording: {
+    record rec = {.type = record_type_random, .random = live};
+    push(&rec);
+    return live;
+  }
+  case recorder_replaying:
+    return replay_hooks.random(replay_hooks.arg);
+  default:
+    return live;
+  }
+}
+
+// Encoding: the type, the time since the previous record as a zigzag
+// varint, then a fixed payload per type. Floats are stored raw so a replay
+// computes with exactly the recorded values.
+
+static uint8_t *put_u8(uint8_t *buf, uint8_t value) {
+  *buf = value;
+  return buf + 1;
+}
+
+static uint8_t *put_u16(uint8_t *buf, uint16_t value) {
+  buf[0] = value & 0xff;
+  buf[1] = (value >> 8) & 0xff;
+  return buf + 2;
+}
+
+static uint8_t *put_u32(uint8_t *buf, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    buf[i] = (value >> (8 * i)) & 0xff;
+  }
+  return buf + 4;
+}
+
+static uint8_t *put_f32(uint8_t *buf, float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return put_u32(buf, bits);
+}
+
+static uint8_t *put_varint(uint8_t *buf, int64_t value) {
+  uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+  while (zigzag >= 0x80) {
+    *buf++ = (zigzag & 0x7f) | 0x80;
+    zigzag >>= 7;
+  }
+  *buf++ = zigzag;
+  return buf;
+}
+
+static size_t encode(const record *rec, int64_t previous_us, uint8_t *buf) {
+  uint8_t *p = put_u8(buf, rec->type);
+  p = put_varint(p, rec->time_us - previous_us);
+
+  switch (rec->type) {
+  case record_type_distance:
+    p = put_u8(p, rec->distance.sensor);
+    p = put_f32(p, rec->distance.distance);
+    p = put_f32(p, rec->distance.rate);
+    p = put_varint(p, rec->time_us - rec->distance.echo_us);
+    break;
+  case record_type_remote:
+    p = put_u8(p, rec->remote.type);
+    if (rec->remote.type == position) {
+      p = put_f32(p, rec->remote.position[X_IDX]);
+      p = put_f32(p, rec->remote.position[Y_IDX]);
+    } else {
+      p = put_u8(p, rec->remote.mode);
+    }
+    break;
+  case record_type_link:
+    p = put_u8(p, rec->link.kind);
+    p = put_varint(p, rec->link.client);
+    p = put_u16(p, rec->link.sequence);
+    break;
+  case record_type_odometry:
+    p = put_f32(p, rec->odometry.left_cm);
+    p = put_f32(p, rec->odometry.right_cm);
+    break;
+  case record_type_random:
+    p = put_u32(p, rec->random);
+    break;
+  case record_type_command:
+    p = put_u8(p, rec->command.motor);
+    p = put_u8(p, rec->command.command);
+    p = put_f32(p, rec->command.speed);
+    break;
+  case record_type_gap:
+    p = put_varint(p, rec->dropped);
+    break;
+  case record_type_param:
+    p = put_u8(p, rec->param.id);
+    p = put_f32(p, rec->param.value);
+    break;
+  default:
+    break;
+  }
+
+  return p - buf;
+}
+
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+  bool truncated;
+} reader;
+
+static bool has(reader *r, size_t len) {
+  if (r->end - r->p < (ptrdiff_t)len) {
+    r->truncated = true;
+  }
+  return !r->truncated;
+}
+
+static uint8_t get_u8(reader *r) { return has(r, 1) ? *r->p++ : 0; }
+
+static uint16_t get_u16(reader *r) {
+  if (!has(r, 2)) {
+    return 0;
+  }
+  uint16_t value = r->p[0] | (r->p[1] << 8);
+  r->p += 2;
+  return value;
+}
+
+static uint32_t get_u32(reader *r) {
+  if (!has(r, 4)) {
+    return 0;
+  }
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= (uint32_t)r->p[i] << (8 * i);
+  }
+  r->p += 4;
+  return value;
+}
+
+static float get_f32(reader *r) {
+  uint32_t bits = get_u32(r);
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static int64_t get_varint(reader *r) {
+  uint64_t zigzag = 0;
+  for (int shift = 0; shift < 64 && has(r, 1); shift += 7) {
+    uint8_t byte = *r->p++;
+    zigzag |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+    }
+  }
+  r->truncated = true;
+  return 0;
+}
+
+size_t recorder_decode(const uint8_t *buf, size_t len, int64_t previous_us,
+                       record *out) {
+  reader r = {.p = buf, .end = buf + len, .truncated = false};
+  uint8_t type = get_u8(&r);
+  if (r.truncated || type == RECORD_END || type >= RECORD_TYPE_COUNT) {
+    return 0;
+  }
+
+  memset(out, 0, sizeof(*out));
+  out->type = type;
+  out->time_us = previous_us + get_varint(&r);
+
+  switch (out->type) {
+  case record_type_distance:
+    out->distance.sensor = get_u8(&r);
+    out->distance.distance = get_f32(&r);
+    out->distance.rate = get_f32(&r);
+    out->distance.echo_us = out->time_us - get_varint(&r);
+    break;
+  case record_type_remote:
+    out->remote.type = get_u8(&r);
+    if (out->remote.type == position) {
+      out->remote.position[X_IDX] = get_f32(&r);
+      out->remote.position[Y_IDX] = get_f32(&r);
+    } else {
+      out->remote.mode = get_u8(&r);
+    }
+    break;
+  case record_type_link:
+    out->link.kind = get_u8(&r);
+    out->link.client = get_varint(&r);
+    out->link.sequence = get_u16(&r);
+    break;
+  case record_type_odometry:
+    out->odometry.left_cm = get_f32(&r);
+    out->odometry.right_cm = get_f32(&r);
+    break;
+  case record_type_random:
+    out->random = get_u32(&r);
+    break;
+  case record_type_command:
+    out->command.motor = get_u8(&r);
+    out->command.command = get_u8(&r);
+    out->command.speed = get_f32(&r);
+    break;
+  case record_type_gap:
+    out->dropped = get_varint(&r);
+    break;
+  case record_type_param:
+    out->param.id = get_u8(&r);
+    out->param.value = get_f32(&r);
+    break;
+  default:
+    break;
+  }
+
+  return r.truncated ? 0 : r.p - buf;
+}
+
+bool recorder_decode_header(const uint8_t *buf, size_t len, int64_t *start_us) {
+  reader r = {.p = buf, .end = buf + len, .truncated = false};
+  uint32_t magic = get_u32(&r);
+  uint8_t version = get_u8(&r);
+  r.p += 3;
+  uint64_t start = get_u32(&r);
+  start |= (uint64_t)get_u32(&r) << 32;
+
+  if (r.truncated || magic != RECORD_MAGIC || version != RECORD_VERSION) {
+    return false;
+  }
+  *start_us = (int64_t)start;
+  return true;
+}
+
+// Erase storage ahead of a write that ends at end
+static bool erase_until(size_t end) {
+  while (erased_until < end) {
+    esp_err_t ret =
+        hal_record_storage_erase(erased_until, HAL_RECORD_SECTOR_SIZE);
+    if (ret != ESP_OK) {
+      ESP_LOGE(TAG, "Erasing record storage failed: %s", esp_err_to_name(ret));
+      return false;
+    }
+    erased_until += HAL_RECORD_SECTOR_SIZE;
+  }
+  return true;
+}
+
+enum store_result { store_ok, store_not_erased, store_failed };
+
+// On the robot this only writes to space recorder_task() has already
+// erased, since erasing here would stall both cores in the middle of
+// whatever is being recorded
+static enum store_result store(const uint8_t *data, size_t len) {
+  if (stored + len > storage_size) {
+    ESP_LOGW(TAG, "Record storage full after %u bytes, stopping",
+             (unsigned)stored);
+    return store_failed;
+  }
+  if (stored + len > erased_until) {
+    if (hal_record_storage_erase_stalls()) {
+      return store_not_erased;
+    }
+    if (!erase_until(stored + len)) {
+      return store_failed;
+    }
+  }
+
+  esp_err_t ret = hal_record_storage_write(stored, data, len);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Writing record storage failed: %s", esp_err_to_name(ret));
+    return store_failed;
+  }
+  __atomic_store_n(&stored, stored + len, __ATOMIC_RELEASE);
+  return store_ok;
+}
+
+void recorder_flush() {
+  static uint8_t buf[512];
+  size_t len = 0;
+  // Records in buf, counting those a gap record in it stands for
+  uint32_t records = 0;
+  // What buf is delta encoded from, to go back to if it is dropped
+  int64_t buf_start_us = last_encoded_us;
+  record rec;
+
+  uint32_t now_dropped = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+  if (now_dropped > 0) {
+    record gap = {.type = record_type_gap,
+                  .time_us = last_encoded_us,
+                  .dropped = now_dropped};
+    len += encode(&gap, last_encoded_us, &buf[len]);
+    records += now_dropped;
+  }
+
+  while (recording()) {
+    bool more = pop(&rec);
+    if (more) {
+      len += encode(&rec, last_encoded_us, &buf[len]);
+      last_encoded_us = rec.time_us;
+      records++;
+    }
+    if (len > 0 && (!more || len > sizeof(buf) - RECORD_MAX_LEN)) {
+      switch (store(buf, len)) {
+      case store_ok:
+        break;
+      case store_not_erased:
+        // Left for a gap record once the idle erase has caught up. Whatever
+        // comes next must be encoded against the last record stored.
+        __atomic_fetch_add(&dropped, records, __ATOMIC_RELAXED);
+        last_encoded_us = buf_start_us;
+        break;
+      case store_failed:
+        __atomic_store_n(&state, recorder_off, __ATOMIC_RELEASE);
+        break;
+      }
+      len = 0;
+      records = 0;
+      buf_start_us = last_encoded_us;
+    }
+    if (!more) {
+      break;
+    }
+  }
+}
+
+static bool robot_stopped() {
+  remote_state inputs;
+  controller_read_remote(&inputs);
+  return inputs.mode == mode_off;
+}
+
+// Erase the first sector and write the header, then start recording
+static bool begin_log() {
+  int64_t start = hal_time_us();
+  uint8_t header[RECORD_HEADER_LEN] = {0};
+  uint8_t *p = put_u32(header, RECORD_MAGIC);
+  p = put_u8(p, RECORD_VERSION);
+  p += 3;
+  p = put_u32(p, (uint64_t)start & UINT32_MAX);
+  put_u32(p, (uint64_t)start >> 32);
+
+  stored = 0;
+  erased_until = 0;
+  last_encoded_us = start;
+  if (!erase_until(HAL_RECORD_SECTOR_SIZE) ||
+      store(header, sizeof(header)) != store_ok) {
+    return false;
+  }
+
+  ESP_LOGI(TAG, "Recording inputs to %u bytes of storage",
+           (unsigned)storage_size);
+  __atomic_store_n(&state, recorder_recording, __ATOMIC_RELEASE);
+  return true;
+}
+
+static void recorder_task(void *arg) {
+  // Started while driving, so the log begins once the robot is stopped
+  if (!recording()) {
+    while (!robot_stopped()) {
+      vTaskDelay(FLUSH_PERIOD_MS / portTICK_PERIOD_MS);
+    }
+    begin_log();
+  }
+
+  while (recording()) {
+    recorder_flush();
+
+    // Erasing stalls both cores, so get it done ahead of time while nothing
+    // is moving
+    if (robot_stopped() && erased_until < storage_size) {
+      erase_until(erased_until + HAL_RECORD_SECTOR_SIZE);
+    }
+
+    vTaskDelay(FLUSH_PERIOD_MS / portTICK_PERIOD_MS);
+  }
+
+  // The storage is full or broken, nothing left to do
+  while (true) {
+    vTaskDelay(portMAX_DELAY);
+  }
+}
+
+void recorder_start() {
+  storage_size = hal_record_storage_size();
+  if (storage_size < HAL_RECORD_SECTOR_SIZE) {
+    ESP_LOGW(TAG, "No record storage, not recording");
+    return;
+  }
+
+  // Erasing the first sector right away is only fine while nothing is
+  // moving, otherwise the task does it later
+  if ((!hal_record_storage_erase_stalls() || robot_stopped()) &&
+      !begin_log()) {
+    return;
+  }
+  task_start(task_recorder, recorder_task, NULL);
+}
+
+size_t recorder_stored_bytes() {
+  return __atomic_load_n(&stored, __ATOMIC_ACQUIRE);
+}
+
+void recorder_replay(const recorder_replay_hooks *hooks) {
+  replay_hooks = *hooks;
+  __atomic_store_n(&state, recorder_replaying, __ATOMIC_RELEASE);
+}
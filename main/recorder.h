@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "controller.h"
+
+// Record and replay of everything the controller reacts to
+//
+// While recording, every input is stamped with the time it arrived and
+// pushed into a lock-free RAM ring: sensor readings, remote events, link
+// supervisor frames, odometry increments, parameter changes and the
+// controller's random draws.
+// The motor commands the controller issues in response go in as well. A low
+// priority task encodes the ring into a compact log on the record storage
+// (see hal.h), from boot until the storage is full.
+//
+// Replaying feeds a log back into the controller on the host simulator's
+// virtual clock, in place of the live sources, and checks that it issues the
+// same motor commands. Recording has to start before any of the tasks that
+// produce inputs so that the replay begins from the same state.
+
+enum record_type {
+  record_type_distance, // controller_publish_distance()
+  record_type_remote,   // control_submit()
+  record_type_link,     // link_frame_received() and friends
+  record_type_odometry, // odometry_update()
+  record_type_random,   // random draw made by the controller
+  record_type_command,  // motor command, an output that replay checks
+  record_type_gap,      // records dropped because the ring was full
+  record_type_param,    // tunable parameter set, see params.h
+  RECORD_TYPE_COUNT,
+};
+
+enum record_link_kind {
+  record_link_frame,
+  record_link_heartbeat,
+  record_link_driver,
+  record_link_closed,
+};
+
+typedef struct {
+  enum record_type type;
+  int64_t time_us;
+  union {
+    struct {
+      uint8_t sensor;
+      float distance;
+      float rate;
+      int64_t echo_us;
+    } distance;
+    struct {
+      enum remote_event_type type;
+      enum control_mode mode;
+      float position[2];
+    } remote;
+    struct {
+      enum record_link_kind kind;
+      int client;
+      uint16_t sequence;
+    } link;
+    struct {
+      float left_cm;
+      float right_cm;
+    } odometry;
+    uint32_t random;
+    struct {
+      // PWM unit of the motor, which tells the two apart
+      uint8_t motor;
+      enum motor_command command;
+      float speed;
+    } command;
+    uint32_t dropped;
+    struct {
+      uint8_t id;
+      float value;
+    } param;
+  };
+} record;
+
+// Hooks for the input sources, no-ops unless recording. Safe to call from
+// any task.
+void record_distance(enum sensor_position sensor, float distance, float rate,
+                     int64_t echo_us);
+void record_remote(const remote_event *event);
+void record_link(enum record_link_kind kind, int client, uint16_t sequence);
+void record_odometry(float left_cm, float right_cm);
+void record_command(uint8_t motor, enum motor_command command, float speed);
+void record_param(uint8_t id, float value);
+
+// Random draw for the controller: records and returns live while
+// recording, and hands back the logged draw instead while replaying
+uint32_t record_random(uint32_t live);
+
+// Start recording to the record storage, overwriting what was there. Does
+// nothing if there is no storage. Where erasing stalls the robot and it is
+// not in mode_off, recording only begins once it is.
+void recorder_start();
+
+// Bytes of log written to the record storage so far
+size_t recorder_stored_bytes();
+
+// Write out everything still in the ring. Only for when the recorder task
+// can't be running at the same time, like the end of a simulator run.
+void recorder_flush();
+
+typedef struct {
+  // Next logged random draw
+  uint32_t (*random)(void *arg);
+  // A motor command the replayed controller issued
+  void (*command)(const record *issued, void *arg);
+  void *arg;
+} recorder_replay_hooks;
+
+// Stop recording and route random draws and motor commands through hooks
+void recorder_replay(const recorder_replay_hooks *hooks);
+
+// Log layout: a header, then records until the first erased (0xff) byte
+#define RECORD_HEADER_LEN 16
+// Longest encoded record
+#define RECORD_MAX_LEN 32
+
+// Parse the header at the start of a log, returning when recording started
+// in *start_us. Returns false if buf doesn't hold a log.
+bool recorder_decode_header(const uint8_t *buf, size_t len, int64_t *start_us);
+
+// Decode the record at buf, given the time of the one before it. Returns the
+// bytes it took up, or 0 at the end of the log or on a truncated record.
+size_t recorder_decode(const uint8_t *buf, size_t len, int64_t previous_us,
+                       record *out);
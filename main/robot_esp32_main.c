@@ -17,15 +17,25 @@
 
 #define STDBY_GPIO 12
 
+#define LEFT_ENCODER_A_GPIO 36
+#define LEFT_ENCODER_B_GPIO 19
+#define LEFT_ENCODER_PCNT 0
+
+#define RIGHT_ENCODER_A_GPIO 39
+#define RIGHT_ENCODER_B_GPIO 21
+#define RIGHT_ENCODER_PCNT 1
+
 #include "./controller.h"
+#include "./deferred_log.h"
 #include "./motor.h"
+#include "./params.h"
+#include "./power.h"
+#include "./recorder.h"
 #include "./server.h"
+#include "./tasks.h"
 #include "./ultrasonic.h"
 #include "./wifi.h"
 
-controller global_controller = {
-    .remote_position = {0, 0}, .front_distance = 0, .mode = mode_off};
-
 void app_main(void) {
   printf("Hello world!\n");
 
@@ -54,6 +64,13 @@ void app_main(void) {
   }
   ESP_ERROR_CHECK(ret);
 
+  deferred_log_init();
+#if CONFIG_ROBOT_RECORDER
+  // Before anything that feeds the controller starts
+  recorder_start();
+#endif
+  params_init();
+
   motor left_motor =
       initialize_motor(BIN1_GPIO, BIN2_GPIO, STDBY_GPIO, PWMB_GPIO,
                        MCPWM_UNIT_0, MCPWM_TIMER_0, MCPWM_OPR_A);
@@ -64,8 +81,19 @@ void app_main(void) {
                        MCPWM_UNIT_1, MCPWM_TIMER_1, MCPWM_OPR_B);
   global_controller.right_motor = right_motor;
 
-  xTaskCreate(poll_distance, "poll_distance", 2048, NULL, 10, NULL);
+#if CONFIG_ROBOT_WHEEL_ENCODERS
+  attach_encoder(&global_controller.left_motor, LEFT_ENCODER_PCNT,
+                 LEFT_ENCODER_A_GPIO, LEFT_ENCODER_B_GPIO);
+  attach_encoder(&global_controller.right_motor, RIGHT_ENCODER_PCNT,
+                 RIGHT_ENCODER_A_GPIO, RIGHT_ENCODER_B_GPIO);
+#endif
+  start_motor_control(&global_controller.left_motor,
+                      &global_controller.right_motor);
+
+  task_start(task_poll_distance, poll_distance, NULL);
 
   control_init();
+  params_start_storing();
   init_wifi(&start_webserver);
+  power_init();
 }
@@ -1,106 +1,225 @@
+#include <string.h>
+#include <unistd.h>
+
 #include "cJSON.h"
 #include "esp_http_server.h"
 #include "esp_log.h"
-#include "freertos/queue.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
 
+#include "deferred_log.h"
+#include "frontend_assets.h"
+#include "hal.h"
+#include "json_protocol.h"
+#include "link.h"
+#include "params.h"
+#include "power.h"
+#include "protocol.h"
+#include "recorder.h"
 #include "server.h"
+#include "tasks.h"
+#include "trace.h"
 
 static char *TAG = "robot-server";
 
-static esp_err_t get_handler(httpd_req_t *req) {
-  extern const char remote_html_start[] asm("_binary_remote_html_start");
-  extern const char remote_html_end[] asm("_binary_remote_html_end");
-  const size_t remote_html_len = (remote_html_end - remote_html_start);
-  httpd_resp_send(req, remote_html_start, remote_html_len);
+// Longest If-None-Match list we look through for our ETag
+#define IF_NONE_MATCH_LEN 128
 
-  return ESP_OK;
+static bool etag_matches(httpd_req_t *req, const char *etag) {
+  char if_none_match[IF_NONE_MATCH_LEN];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match,
+                                  sizeof(if_none_match)) != ESP_OK) {
+    return false;
+  }
+  return strstr(if_none_match, etag) != NULL;
 }
 
-static void send_control_event(remote_event *event) {
-  assert(control_queue != NULL);
-  if (!xQueueSend(control_queue, event, 10 / portTICK_PERIOD_MS)) {
-    ESP_LOGE(TAG, "Control queue is full, dropping event");
+// Serve a frontend asset from the gzipped copy baked into the firmware
+//
+// Browsers still revalidate on every load since a reflash changes what sits
+// behind the same URI, but an unchanged asset only costs a 304.
+static esp_err_t asset_handler(httpd_req_t *req) {
+  const frontend_asset *asset = (const frontend_asset *)req->user_ctx;
+
+  httpd_resp_set_hdr(req, "ETag", asset->etag);
+  httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+  httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+
+  if (etag_matches(req, asset->etag)) {
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
   }
+
+  httpd_resp_set_type(req, asset->content_type);
+  httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+  return httpd_resp_send(req, (const char *)asset->data, asset->len);
 }
 
-static void handle_message(char *payload) {
-  cJSON *msg = cJSON_Parse(payload);
-  cJSON *jsonPosition = cJSON_GetObjectItem(msg, "position");
-  cJSON *jsonMode = cJSON_GetObjectItem(msg, "mode");
+// Connected WebSocket clients. Only ever touched from the httpd task.
+#define MAX_SESSIONS CONFIG_ROBOT_MAX_CLIENTS
 
-  if (jsonPosition) {
-    ESP_LOGI(TAG, "Got packet with message: %s", payload);
-    float x = cJSON_GetObjectItem(jsonPosition, "x")->valuedouble;
-    float y = cJSON_GetObjectItem(jsonPosition, "y")->valuedouble;
+typedef struct {
+  int fd;
+  // Speaks the binary protocol, so gets telemetry pushed to it
+  bool binary;
+  // Already told off for driving without holding control
+  bool warned;
+} session;
 
-    remote_event event = {.type = position, .new_position = {x, y}};
+static session sessions[MAX_SESSIONS] = {
+    [0 ... MAX_SESSIONS - 1] = {.fd = -1}};
+// Socket of the one client allowed to drive, or -1 while nobody holds control
+static int operator_fd = -1;
+static httpd_handle_t session_server = NULL;
 
-    assert(control_queue != NULL);
-    if (!xQueueSend(control_queue, &event, 10 / portTICK_PERIOD_MS)) {
-      ESP_LOGE(TAG, "Control queue is full, dropping event");
+static session *find_session(int fd) {
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (sessions[i].fd == fd) {
+      return &sessions[i];
     }
   }
+  return NULL;
+}
 
-  if (jsonMode) {
-    ESP_LOGI(TAG, "Got mode change event with new mode %s",
-             jsonMode->valuestring);
-    bool was_set = false;
-    enum control_mode new_mode;
+static session *open_session(int fd) {
+  session *s = find_session(fd);
+  if (s == NULL) {
+    s = find_session(-1);
+    if (s == NULL) {
+      ESP_LOGW(TAG, "Too many sessions, ignoring fd %d", fd);
+      return NULL;
+    }
+    *s = (session){.fd = fd};
+  }
+  return s;
+}
 
-    if (strcmp(jsonMode->valuestring, "off") == 0) {
-      new_mode = mode_off;
-      was_set = true;
-    } else if (strcmp(jsonMode->valuestring, "autonomous") == 0) {
-      new_mode = mode_autonomous;
-      was_set = true;
-    } else if (strcmp(jsonMode->valuestring, "manual") == 0) {
-      new_mode = mode_manual;
-      was_set = true;
-    };
+static void send_role(int fd, enum session_role role) {
+  session *s = find_session(fd);
+  if (s == NULL || !s->binary) {
+    return;
+  }
 
-    if (was_set) {
-      remote_event event = {.type = mode, .new_mode = new_mode};
-      send_control_event(&event);
-    } else {
-      ESP_LOGI(TAG, "Unrecognized mode %s", jsonMode->valuestring);
-    }
+  uint8_t data[SESSION_MSG_LEN];
+  size_t len = protocol_encode_session(role, data, sizeof(data));
+  httpd_ws_frame_t frame = {.payload = data,
+                            .len = len,
+                            .type = HTTPD_WS_TYPE_BINARY,
+                            .final = true};
+  httpd_ws_send_frame_async(session_server, fd, &frame);
+}
+
+static void set_operator(int fd) {
+  int previous = operator_fd;
+  if (fd == previous) {
+    return;
   }
 
-  cJSON_Delete(msg);
+  operator_fd = fd;
+  if (previous >= 0) {
+    send_role(previous, role_spectator);
+  }
+  if (fd >= 0) {
+    ESP_LOGI(TAG, "Client %d took control", fd);
+    session *s = find_session(fd);
+    s->warned = false;
+    send_role(fd, role_operator);
+    link_set_driver(fd);
+  }
 }
 
-static char *current_state_json() {
-  cJSON *msg = cJSON_CreateObject();
+// Hand control to client if nobody else can use it, returning whether it now
+// holds it
+static bool take_control(int client) {
+  if (client == operator_fd) {
+    return true;
+  }
+  if (find_session(client) == NULL) {
+    return false;
+  }
+  // An operator whose link timed out has stopped the robot, so anyone may
+  // take over rather than wait for the socket to close
+  if (operator_fd < 0 || link_lost(hal_time_us())) {
+    set_operator(client);
+    return true;
+  }
+  return false;
+}
 
-  cJSON_AddNumberToObject(msg, "left",
-                          global_controller.left_motor.current_speed);
-  cJSON_AddNumberToObject(msg, "right",
-                          global_controller.right_motor.current_speed);
-  cJSON_AddNumberToObject(msg, "front_distance",
-                          global_controller.front_distance);
-  char *mode = "";
-  switch (global_controller.mode) {
-  case mode_off:
-    mode = "off";
-    break;
-  case mode_autonomous:
-    mode = "autonomous";
-    break;
-  case mode_manual:
-    mode = "manual";
-    break;
-  }
-  cJSON_AddStringToObject(msg, "mode", mode);
-
-  char *result = cJSON_Print(msg);
+static void release_control(int client) {
+  if (client != operator_fd) {
+    return;
+  }
 
-  cJSON_Delete(msg);
+  ESP_LOGI(TAG, "Client %d released control", client);
+  // Nobody is driving any more, so don't leave the last position applied
+  remote_event stop = {.type = position,
+                       .received_at = hal_time_us(),
+                       .new_position = {0, 0}};
+  control_submit(&stop);
+  link_set_driver(LINK_NO_CLIENT);
+  set_operator(-1);
+}
+
+static void close_session(int fd) {
+  session *s = find_session(fd);
+  if (s != NULL) {
+    s->fd = -1;
+  }
+  // The link supervisor still stops the robot, since the driver is left
+  // recorded as disconnected
+  if (fd == operator_fd) {
+    ESP_LOGW(TAG, "Operator %d disconnected", fd);
+    operator_fd = -1;
+  }
+}
+
+static void send_control_event(int client, remote_event *event) {
+  power_activity();
+  if (!take_control(client)) {
+    session *s = find_session(client);
+    if (s != NULL && !s->warned) {
+      ESP_LOGW(TAG, "Client %d is not in control, ignoring its input",
+               client);
+      s->warned = true;
+      send_role(client, role_spectator);
+    }
+    return;
+  }
+
+  if (control_submit(event) != ESP_OK) {
+    ESP_LOGE(TAG, "Mode queue is full, dropping event");
+  }
+}
+
+static void handle_message(int client, const char *payload,
+                           int64_t received_at) {
+  remote_event events[JSON_MAX_EVENTS];
+  size_t count = json_decode(payload, events);
 
-  return result;
+  for (size_t i = 0; i < count; i++) {
+    remote_event *event = &events[i];
+    event->received_at = received_at;
+    if (event->type == position) {
+      DLOGI(TAG, "Got position packet x: %f y: %f",
+            event->new_position[X_IDX], event->new_position[Y_IDX]);
+    } else {
+      ESP_LOGI(TAG, "Got mode change event with new mode %s",
+               json_mode_name(event->new_mode));
+    }
+    send_control_event(client, event);
+  }
 }
 
-static esp_err_t send_ws_response(httpd_req_t *req) {
-  char *data = current_state_json();
+static esp_err_t send_ws_response(httpd_req_t *req, int64_t received_at) {
+  controller_snapshot snapshot;
+  controller_read_snapshot(&snapshot);
+  char *data = json_encode_state(&snapshot);
+  if (data == NULL) {
+    ESP_LOGE(TAG, "Out of memory for the state report");
+    return ESP_ERR_NO_MEM;
+  }
 
   httpd_ws_frame_t ws_response = {.payload = (uint8_t *)data,
                                   .len = strlen(data),
@@ -109,6 +228,7 @@ static esp_err_t send_ws_response(httpd_req_t *req) {
 
   esp_err_t ret = httpd_ws_send_frame(req, &ws_response);
   free(data);
+  trace_record(trace_ws_send, received_at);
 
   if (ret != ESP_OK) {
     ESP_LOGE(TAG, "httpd_ws_send_frame failed with %d", ret);
@@ -117,7 +237,180 @@ static esp_err_t send_ws_response(httpd_req_t *req) {
   return ret;
 }
 
+static void handle_binary_message(int client, const uint8_t *payload,
+                                  size_t len, int64_t received_at) {
+  remote_event event;
+  esp_err_t ret = protocol_decode(payload, len, &event);
+
+  if (ret == ESP_OK) {
+    event.received_at = received_at;
+    send_control_event(client, &event);
+  } else if (ret == ESP_ERR_NOT_FOUND) {
+    uint16_t sequence;
+    bool take;
+    if (protocol_decode_heartbeat(payload, len, &sequence) == ESP_OK) {
+      link_heartbeat_received(client, sequence);
+    } else if (protocol_decode_control(payload, len, &take) == ESP_OK) {
+      power_activity();
+      if (!take) {
+        release_control(client);
+      } else if (!take_control(client)) {
+        send_role(client, role_spectator);
+      }
+    }
+  } else {
+    ESP_LOGW(TAG, "Dropping malformed binary frame: %s", esp_err_to_name(ret));
+  }
+}
+
+static void current_state_telemetry(telemetry *state) {
+  controller_snapshot snapshot;
+  controller_read_snapshot(&snapshot);
+
+  state->left_speed = snapshot.left_speed;
+  state->right_speed = snapshot.right_speed;
+  state->left_target = snapshot.left_target;
+  state->right_target = snapshot.right_target;
+  memcpy(state->distances, snapshot.sensors.distances,
+         sizeof(state->distances));
+  state->mode = snapshot.remote.mode;
+  state->odometry = snapshot.odometry;
+
+  link_stats link;
+  link_read_stats(&link);
+  if (link.client != LINK_NO_CLIENT && link.connected) {
+    state->link_age_ms = (hal_time_us() - link.last_frame) / 1000.0f;
+    state->link_jitter_ms = link.jitter_ms;
+    state->link_loss_percent = link.loss_percent;
+  } else {
+    state->link_age_ms = -1;
+    state->link_jitter_ms = 0;
+    state->link_loss_percent = 0;
+  }
+}
+
+static void close_handler(httpd_handle_t server, int fd) {
+  close_session(fd);
+  link_client_closed(fd);
+  close(fd);
+}
+
+typedef struct {
+  httpd_handle_t server;
+  // Set while a broadcast is queued on the httpd task, so a slow link only
+  // ever has one frame in flight and later ticks are coalesced into it
+  bool pending;
+  int64_t queued_at;
+  // When the last broadcast was queued and the state it was queued for.
+  // Only the telemetry task touches these.
+  int64_t last_queued;
+  telemetry last_state;
+} telemetry_publisher;
+
+static telemetry_publisher publisher = {.server = NULL, .pending = false};
+
+// Runs on the httpd task: encode the freshest state once and send the same
+// frame to every session, whatever its role
+static void broadcast_telemetry(void *arg) {
+  telemetry_publisher *pub = (telemetry_publisher *)arg;
+
+  telemetry state;
+  current_state_telemetry(&state);
+
+  uint8_t data[TELEMETRY_MSG_LEN];
+  size_t len = protocol_encode_telemetry(&state, data, sizeof(data));
+  httpd_ws_frame_t frame = {.payload = data,
+                            .len = len,
+                            .type = HTTPD_WS_TYPE_BINARY,
+                            .final = true};
+
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    session *s = &sessions[i];
+    if (s->fd < 0 || !s->binary) {
+      continue;
+    }
+
+    esp_err_t ret = httpd_ws_send_frame_async(pub->server, s->fd, &frame);
+    if (ret != ESP_OK) {
+      ESP_LOGW(TAG, "Not streaming to client %d: %s", s->fd,
+               esp_err_to_name(ret));
+      s->binary = false;
+    }
+  }
+
+  trace_record(trace_ws_send, pub->queued_at);
+  __atomic_store_n(&pub->pending, false, __ATOMIC_RELEASE);
+}
+
+// Even in on-change mode, resend this often so clients know we are alive
+#define TELEMETRY_KEEPALIVE_US 1000000
+
+static bool should_publish(const telemetry_publisher *pub,
+                           const telemetry *state, int64_t now) {
+#if CONFIG_ROBOT_TELEMETRY_ON_CHANGE
+  const telemetry *last = &pub->last_state;
+
+  return state->left_speed != last->left_speed ||
+         state->right_speed != last->right_speed ||
+         state->left_target != last->left_target ||
+         state->right_target != last->right_target ||
+         memcmp(state->distances, last->distances,
+                sizeof(state->distances)) ||
+         state->mode != last->mode ||
+         // Link age grows every tick, so only jitter and loss count
+         state->link_jitter_ms != last->link_jitter_ms ||
+         state->link_loss_percent != last->link_loss_percent ||
+         memcmp(&state->odometry, &last->odometry,
+                sizeof(state->odometry)) ||
+         now - pub->last_queued >= TELEMETRY_KEEPALIVE_US;
+#else
+  return true;
+#endif
+}
+
+static void telemetry_publish_loop(void *arg) {
+  telemetry_publisher *pub = (telemetry_publisher *)arg;
+  TickType_t last_wake = xTaskGetTickCount();
+
+  while (true) {
+    // Nothing changes while the robot idles, so only keep clients posted
+    uint32_t period_ms = power_idle() ? TELEMETRY_KEEPALIVE_US / 1000
+                                      : CONFIG_ROBOT_TELEMETRY_PERIOD_MS;
+    vTaskDelayUntil(&last_wake, period_ms / portTICK_PERIOD_MS);
+
+    if (__atomic_load_n(&pub->pending, __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+
+    int64_t now = hal_time_us();
+    telemetry state;
+    current_state_telemetry(&state);
+    if (!should_publish(pub, &state, now)) {
+      continue;
+    }
+
+    pub->pending = true;
+    pub->queued_at = now;
+    if (httpd_queue_work(pub->server, broadcast_telemetry, pub) == ESP_OK) {
+      pub->last_queued = now;
+      pub->last_state = state;
+    } else {
+      pub->pending = false;
+    }
+  }
+}
+
 static esp_err_t ws_handler(httpd_req_t *req) {
+  // Spectators may never send anything, so they get a session as soon as
+  // they connect
+  if (req->method == HTTP_GET) {
+    open_session(httpd_req_to_sockfd(req));
+    return ESP_OK;
+  }
+
+  // The handler runs once the socket is readable, so reading the frame is
+  // the first part of its latency
+  int64_t received_at = hal_time_us();
   uint8_t buf[128] = {0};
   httpd_ws_frame_t ws_pkt;
   memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
@@ -128,15 +421,222 @@ static esp_err_t ws_handler(httpd_req_t *req) {
     ESP_LOGE(TAG, "httpd_ws_recv_frame failed with %d", ret);
     return ret;
   }
+
+  int client = httpd_req_to_sockfd(req);
+  trace_record(trace_ws_recv, received_at);
+  link_frame_received(client, received_at);
+  session *s = open_session(client);
+  if (ws_pkt.type == HTTPD_WS_TYPE_BINARY) {
+    // Binary clients get telemetry pushed rather than as a response
+    if (s != NULL) {
+      s->binary = true;
+    }
+    handle_binary_message(client, ws_pkt.payload, ws_pkt.len, received_at);
+    return ESP_OK;
+  }
+
+  // JSON is kept as a fallback for older clients
   if (ws_pkt.type == HTTPD_WS_TYPE_TEXT) {
-    handle_message((char *)ws_pkt.payload);
+    handle_message(client, (const char *)ws_pkt.payload, received_at);
+  }
+
+  return send_ws_response(req, received_at);
+}
+
+// Latency histogram of every trace point as JSON
+static esp_err_t trace_handler(httpd_req_t *req) {
+  cJSON *msg = cJSON_CreateObject();
+
+  for (int point = 0; point < TRACE_POINT_COUNT; point++) {
+    trace_stats stats;
+    trace_get_stats(point, &stats);
+
+    cJSON *jsonStats = cJSON_AddObjectToObject(msg, trace_point_name(point));
+    cJSON_AddNumberToObject(jsonStats, "count", stats.count);
+    cJSON_AddNumberToObject(jsonStats, "min_us", stats.min_us);
+    cJSON_AddNumberToObject(jsonStats, "avg_us", stats.avg_us);
+    cJSON_AddNumberToObject(jsonStats, "p99_us", stats.p99_us);
+    cJSON_AddNumberToObject(jsonStats, "max_us", stats.max_us);
+  }
+
+  char *data = cJSON_Print(msg);
+  cJSON_Delete(msg);
+
+  httpd_resp_set_type(req, "application/json");
+  esp_err_t ret = httpd_resp_send(req, data, strlen(data));
+  free(data);
+
+  return ret;
+}
+
+// Start the latency histograms afresh, e.g. before a test run
+static esp_err_t trace_reset_handler(httpd_req_t *req) {
+  trace_reset();
+  httpd_resp_set_status(req, "204 No Content");
+  return httpd_resp_send(req, NULL, 0);
+}
+
+// Stack and CPU use of every task since the last request
+static esp_err_t tasks_handler(httpd_req_t *req) {
+  size_t count;
+  task_report *reports = task_get_reports(&count);
+
+  cJSON *msg = cJSON_CreateArray();
+  for (size_t i = 0; i < count; i++) {
+    cJSON *task = cJSON_CreateObject();
+    cJSON_AddStringToObject(task, "name", reports[i].name);
+    cJSON_AddNumberToObject(task, "priority", reports[i].priority);
+    cJSON_AddNumberToObject(task, "core", reports[i].core);
+    cJSON_AddNumberToObject(task, "stack_free", reports[i].stack_free);
+    cJSON_AddNumberToObject(task, "cpu_percent", reports[i].cpu_percent);
+    cJSON_AddItemToArray(msg, task);
+  }
+  free(reports);
+
+  char *data = cJSON_Print(msg);
+  cJSON_Delete(msg);
+
+  httpd_resp_set_type(req, "application/json");
+  esp_err_t ret = httpd_resp_send(req, data, strlen(data));
+  free(data);
+
+  return ret;
+}
+
+static const char *param_type_name(enum param_type type) {
+  return type == param_type_int ? "int" : "float";
+}
+
+static esp_err_t send_params(httpd_req_t *req) {
+  cJSON *msg = cJSON_CreateArray();
+  for (int id = 0; id < PARAM_COUNT; id++) {
+    const param_info *info = param_get_info(id);
+    cJSON *param = cJSON_CreateObject();
+    cJSON_AddStringToObject(param, "name", info->name);
+    cJSON_AddStringToObject(param, "type", param_type_name(info->type));
+    cJSON_AddNumberToObject(param, "value", param_get(id));
+    cJSON_AddNumberToObject(param, "default", info->fallback);
+    cJSON_AddNumberToObject(param, "min", info->min);
+    cJSON_AddNumberToObject(param, "max", info->max);
+    cJSON_AddItemToArray(msg, param);
+  }
+
+  char *data = cJSON_Print(msg);
+  cJSON_Delete(msg);
+
+  httpd_resp_set_type(req, "application/json");
+  esp_err_t ret = httpd_resp_send(req, data, strlen(data));
+  free(data);
+
+  return ret;
+}
+
+// Every tunable parameter with its range
+static esp_err_t params_handler(httpd_req_t *req) { return send_params(req); }
+
+// Largest update accepted, plenty for every parameter at once
+#define PARAMS_BODY_MAX 512
+
+// Takes an object of parameter names to new values, or to null to go back to
+// the default. Nothing changes unless every entry is valid. Answers with the
+// parameters as they are now, like GET.
+static esp_err_t params_update_handler(httpd_req_t *req) {
+  static char body[PARAMS_BODY_MAX + 1];
+  if (req->content_len > PARAMS_BODY_MAX) {
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Body too long");
   }
 
-  return send_ws_response(req);
+  size_t received = 0;
+  while (received < req->content_len) {
+    int ret = httpd_req_recv(req, &body[received], req->content_len - received);
+    if (ret <= 0) {
+      return ESP_FAIL;
+    }
+    received += ret;
+  }
+  body[received] = '\0';
+
+  cJSON *msg = cJSON_Parse(body);
+  if (!cJSON_IsObject(msg)) {
+    cJSON_Delete(msg);
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,
+                               "Expected a JSON object");
+  }
+
+  const char *error = NULL;
+  cJSON *item;
+  cJSON_ArrayForEach(item, msg) {
+    enum param_id id;
+    if (!param_find(item->string, &id)) {
+      error = "Unknown parameter";
+    } else if (!cJSON_IsNull(item) &&
+               !(cJSON_IsNumber(item) && param_valid(id, item->valuedouble))) {
+      error = "Value out of range";
+    }
+    if (error != NULL) {
+      ESP_LOGW(TAG, "Rejecting parameter update: %s %s", error, item->string);
+      break;
+    }
+  }
+
+  if (error == NULL) {
+    cJSON_ArrayForEach(item, msg) {
+      enum param_id id;
+      param_find(item->string, &id);
+      if (cJSON_IsNull(item)) {
+        param_reset(id);
+        ESP_LOGI(TAG, "%s reset to %g", item->string, param_get(id));
+      } else {
+        param_set(id, item->valuedouble);
+        ESP_LOGI(TAG, "%s set to %g", item->string, param_get(id));
+      }
+    }
+  }
+  cJSON_Delete(msg);
+
+  if (error != NULL) {
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, error);
+  }
+  return send_params(req);
 }
 
-httpd_uri_t uri_root = {
-    .uri = "/", .method = HTTP_GET, .handler = get_handler, .user_ctx = NULL};
+// Raw trace rings, one chunk per core of packed trace_entry records
+static esp_err_t trace_dump_handler(httpd_req_t *req) {
+  static trace_entry entries[TRACE_RING_SIZE];
+
+  httpd_resp_set_type(req, "application/octet-stream");
+  for (int core = 0; core < TRACE_CORES; core++) {
+    size_t count = trace_copy_entries(core, entries, TRACE_RING_SIZE);
+    esp_err_t ret = httpd_resp_send_chunk(req, (const char *)entries,
+                                          count * sizeof(trace_entry));
+    if (ret != ESP_OK) {
+      return ret;
+    }
+  }
+
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+// Recorder log so far, for host/robot_replay
+static esp_err_t record_dump_handler(httpd_req_t *req) {
+  static uint8_t chunk[HAL_RECORD_SECTOR_SIZE];
+  size_t stored = recorder_stored_bytes();
+
+  httpd_resp_set_type(req, "application/octet-stream");
+  for (size_t offset = 0; offset < stored; offset += sizeof(chunk)) {
+    size_t len = stored - offset < sizeof(chunk) ? stored - offset
+                                                 : sizeof(chunk);
+    esp_err_t ret = hal_record_storage_read(offset, chunk, len);
+    if (ret == ESP_OK) {
+      ret = httpd_resp_send_chunk(req, (const char *)chunk, len);
+    }
+    if (ret != ESP_OK) {
+      return ret;
+    }
+  }
+
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
 
 static const httpd_uri_t ws = {.uri = "/websocket",
                                .method = HTTP_GET,
@@ -144,15 +644,77 @@ static const httpd_uri_t ws = {.uri = "/websocket",
                                .user_ctx = NULL,
                                .is_websocket = true};
 
+static const httpd_uri_t uri_trace = {.uri = "/trace",
+                                      .method = HTTP_GET,
+                                      .handler = trace_handler,
+                                      .user_ctx = NULL};
+
+static const httpd_uri_t uri_trace_reset = {.uri = "/trace",
+                                            .method = HTTP_DELETE,
+                                            .handler = trace_reset_handler,
+                                            .user_ctx = NULL};
+
+static const httpd_uri_t uri_trace_dump = {.uri = "/trace.bin",
+                                           .method = HTTP_GET,
+                                           .handler = trace_dump_handler,
+                                           .user_ctx = NULL};
+
+static const httpd_uri_t uri_record_dump = {.uri = "/record.bin",
+                                            .method = HTTP_GET,
+                                            .handler = record_dump_handler,
+                                            .user_ctx = NULL};
+
+static const httpd_uri_t uri_params = {.uri = "/params",
+                                       .method = HTTP_GET,
+                                       .handler = params_handler,
+                                       .user_ctx = NULL};
+
+static const httpd_uri_t uri_params_update = {.uri = "/params",
+                                              .method = HTTP_POST,
+                                              .handler = params_update_handler,
+                                              .user_ctx = NULL};
+
+static const httpd_uri_t uri_tasks = {.uri = "/tasks",
+                                      .method = HTTP_GET,
+                                      .handler = tasks_handler,
+                                      .user_ctx = NULL};
+
+// URI handlers besides the frontend assets
+#define FIXED_URI_HANDLERS 8
+
 httpd_handle_t start_webserver() {
+  const task_config *httpd_task = task_get_config(task_httpd);
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  config.close_fn = close_handler;
+  config.task_priority = httpd_task->priority;
+  config.stack_size = httpd_task->stack_size;
+  config.core_id = httpd_task->core;
+  config.max_uri_handlers = FIXED_URI_HANDLERS + frontend_asset_count;
+  config.max_open_sockets = MAX_SESSIONS;
   httpd_handle_t server = NULL;
 
   esp_err_t result = httpd_start(&server, &config);
   if (result == ESP_OK) {
     ESP_LOGI(TAG, "serving requests");
-    httpd_register_uri_handler(server, &uri_root);
+    for (size_t i = 0; i < frontend_asset_count; i++) {
+      const httpd_uri_t uri_asset = {.uri = frontend_assets[i].uri,
+                                     .method = HTTP_GET,
+                                     .handler = asset_handler,
+                                     .user_ctx = (void *)&frontend_assets[i]};
+      httpd_register_uri_handler(server, &uri_asset);
+    }
     httpd_register_uri_handler(server, &ws);
+    httpd_register_uri_handler(server, &uri_trace);
+    httpd_register_uri_handler(server, &uri_trace_reset);
+    httpd_register_uri_handler(server, &uri_trace_dump);
+    httpd_register_uri_handler(server, &uri_tasks);
+    httpd_register_uri_handler(server, &uri_record_dump);
+    httpd_register_uri_handler(server, &uri_params);
+    httpd_register_uri_handler(server, &uri_params_update);
+
+    session_server = server;
+    publisher.server = server;
+    task_start(task_telemetry, telemetry_publish_loop, &publisher);
   } else {
     ESP_LOGE(TAG, "failed to initialize server");
 
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "tasks.h"
+
+static const char *TAG = "robot-tasks";
+
+// Motor control comes first since everything ends with a motor write, then
+// the sensor path in pipeline order. The remote path is latency sensitive
+// too but starts with a network frame on the other core anyway.
+static const task_config task_table[ROBOT_TASK_COUNT] = {
+    [task_motor_control] = {"motor_control", 2048, 20, APP_CORE},
+    [task_echo_events] = {"echo_events", 2048, 19, APP_CORE},
+    [task_poll_distance] = {"poll_distance", 2048, 18, APP_CORE},
+    [task_autonomous] = {"autonomous_loop", 2048, 17, APP_CORE},
+    [task_remote_input] = {"remote_input", 2048, 16, APP_CORE},
+    [task_httpd] = {"httpd", 4096, 5, PRO_CORE},
+    [task_telemetry] = {"telemetry", 2048, 5, PRO_CORE},
+    [task_deferred_log] = {"deferred_log", 3072, 1, PRO_CORE},
+    [task_recorder] = {"recorder", 3072, 2, PRO_CORE},
+    // Above everything on its core, so a robot coming out of idle has its
+    // motor driver back before the input that woke it gets acted on. It
+    // only runs when idling starts or ends and for a check once a second.
+    [task_power] = {"power", 2048, 21, APP_CORE},
+    [task_params] = {"params", 3072, 1, PRO_CORE},
+};
+
+const task_config *task_get_config(enum robot_task task) {
+  return &task_table[task];
+}
+
+TaskHandle_t task_start(enum robot_task task, TaskFunction_t function,
+                        void *arg) {
+  const task_config *config = &task_table[task];
+  TaskHandle_t handle = NULL;
+
+  BaseType_t ret =
+      xTaskCreatePinnedToCore(function, config->name, config->stack_size, arg,
+                              config->priority, &handle, config->core);
+  if (ret != pdPASS) {
+    ESP_LOGE(TAG, "Failed to start task %s", config->name);
+    abort();
+  }
+  return handle;
+}
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+
+// Run time counters from the previous report, to turn totals into a recent
+// share
+typedef struct {
+  TaskHandle_t handle;
+  uint32_t run_time;
+} run_time_sample;
+
+static run_time_sample *last_samples = NULL;
+static size_t last_sample_count = 0;
+static uint32_t last_total_run_time = 0;
+
+// Room for tasks started between counting them and taking the snapshot
+#define SPARE_TASKS 4
+
+static uint32_t previous_run_time(TaskHandle_t handle) {
+  for (size_t i = 0; i < last_sample_count; i++) {
+    if (last_samples[i].handle == handle) {
+      return last_samples[i].run_time;
+    }
+  }
+  return 0;
+}
+
+// Snapshot of every task, sized from the current task count
+static TaskStatus_t *system_state(UBaseType_t *count,
+                                  uint32_t *total_run_time) {
+  UBaseType_t capacity = uxTaskGetNumberOfTasks() + SPARE_TASKS;
+  for (int attempt = 0; attempt < 3; attempt++) {
+    TaskStatus_t *status = malloc(capacity * sizeof(TaskStatus_t));
+    if (status == NULL) {
+      return NULL;
+    }
+    // 0 if more tasks were started than there is room for, try again bigger
+    *count = uxTaskGetSystemState(status, capacity, total_run_time);
+    if (*count > 0) {
+      return status;
+    }
+    free(status);
+    capacity = uxTaskGetNumberOfTasks() + SPARE_TASKS * 2;
+  }
+  return NULL;
+}
+
+task_report *task_get_reports(size_t *count) {
+  *count = 0;
+  uint32_t total_run_time = 0;
+  UBaseType_t tasks;
+  TaskStatus_t *status = system_state(&tasks, &total_run_time);
+  if (status == NULL) {
+    return NULL;
+  }
+
+  task_report *out = malloc(tasks * sizeof(task_report));
+  run_time_sample *samples = malloc(tasks * sizeof(run_time_sample));
+  if (out == NULL || samples == NULL) {
+    free(out);
+    free(samples);
+    free(status);
+    return NULL;
+  }
+
+  uint32_t elapsed = total_run_time - last_total_run_time;
+  for (UBaseType_t i = 0; i < tasks; i++) {
+    task_report *report = &out[i];
+    strlcpy(report->name, status[i].pcTaskName, sizeof(report->name));
+    report->priority = status[i].uxCurrentPriority;
+    report->core =
+        status[i].xCoreID == tskNO_AFFINITY ? -1 : (int)status[i].xCoreID;
+    // The high water mark is in bytes on the ESP32 port
+    report->stack_free = status[i].usStackHighWaterMark;
+
+    uint32_t used =
+        status[i].ulRunTimeCounter - previous_run_time(status[i].xHandle);
+    report->cpu_percent = elapsed > 0 ? 100.0f * used / elapsed : 0;
+
+    samples[i] = (run_time_sample){.handle = status[i].xHandle,
+                                   .run_time = status[i].ulRunTimeCounter};
+  }
+
+  free(last_samples);
+  last_samples = samples;
+  last_sample_count = tasks;
+  last_total_run_time = total_run_time;
+  free(status);
+
+  *count = tasks;
+  return out;
+}
+
+#else
+
+task_report *task_get_reports(size_t *count) {
+  *count = 0;
+  return NULL;
+}
+
+#endif
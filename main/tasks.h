@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Stack, priority and core of every firmware task, in one place
+//
+// WiFi, lwIP and httpd live on the PRO core (0). Everything between an echo
+// edge and a motor write runs on the APP core (1), above anything else
+// there, so network bursts can't delay an obstacle reaction.
+
+enum robot_task {
+  task_motor_control,
+  task_echo_events,
+  task_poll_distance,
+  task_autonomous,
+  task_remote_input,
+  task_httpd,
+  task_telemetry,
+  task_deferred_log,
+  task_recorder,
+  task_power,
+  task_params,
+  ROBOT_TASK_COUNT,
+};
+
+#define PRO_CORE 0
+#define APP_CORE 1
+
+typedef struct {
+  const char *name;
+  uint32_t stack_size;
+  UBaseType_t priority;
+  BaseType_t core;
+} task_config;
+
+const task_config *task_get_config(enum robot_task task);
+
+// Create a task using its table entry. Aborts if it can't be created.
+TaskHandle_t task_start(enum robot_task task, TaskFunction_t function,
+                        void *arg);
+
+typedef struct {
+  char name[16];
+  UBaseType_t priority;
+  // Core the task is pinned to, or -1 for either
+  int core;
+  // Least free stack seen so far, in bytes
+  uint32_t stack_free;
+  // Share of one core used since the previous report, in percent
+  float cpu_percent;
+} task_report;
+
+// Report on every task in the system, firmware or not. Returns an array of
+// *count reports for the caller to free(), or NULL with *count 0 if out of
+// memory or the build has no trace facility or run time stats.
+task_report *task_get_reports(size_t *count);
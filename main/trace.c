@@ -0,0 +1,166 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_attr.h"
+
+#include "hal.h"
+#include "trace.h"
+
+// Latency buckets: 4 linear sub-buckets per power of two, so percentiles are
+// reported with at most 25% error
+#define SUB_BUCKET_BITS 2
+#define BUCKET_COUNT (32 << SUB_BUCKET_BITS)
+
+typedef struct {
+  uint32_t head;
+  trace_entry entries[TRACE_RING_SIZE];
+} trace_ring;
+
+typedef struct {
+  uint32_t count;
+  uint32_t min_us;
+  uint32_t max_us;
+  // Sum of every latency, split in two words since 64-bit atomics aren't
+  // lock-free on the ESP32 and would call out of IRAM
+  uint32_t total_low_us;
+  uint32_t total_high_us;
+  uint32_t buckets[BUCKET_COUNT];
+} trace_histogram;
+
+static trace_ring rings[TRACE_CORES];
+static trace_histogram histograms[TRACE_POINT_COUNT];
+
+static const char *POINT_NAMES[TRACE_POINT_COUNT] = {
+    [trace_echo_dequeue] = "echo_dequeue",
+    [trace_sensor_decision] = "sensor_decision",
+    [trace_sensor_motor] = "sensor_motor",
+    [trace_ws_recv] = "ws_recv",
+    [trace_remote_decision] = "remote_decision",
+    [trace_remote_motor] = "remote_motor",
+    [trace_ws_send] = "ws_send",
+    [trace_motor_tick] = "motor_tick",
+};
+
+static IRAM_ATTR int bucket_of(uint32_t value) {
+  if (value < (1 << SUB_BUCKET_BITS)) {
+    return value;
+  }
+
+  int msb = 31 - __builtin_clz(value);
+  int shift = msb - SUB_BUCKET_BITS;
+  int sub = (value >> shift) & ((1 << SUB_BUCKET_BITS) - 1);
+  return ((shift + 1) << SUB_BUCKET_BITS) + sub;
+}
+
+// Largest value that falls into the bucket
+static uint32_t bucket_upper_bound(int bucket) {
+  if (bucket < (1 << SUB_BUCKET_BITS)) {
+    return bucket;
+  }
+
+  int shift = (bucket >> SUB_BUCKET_BITS) - 1;
+  int sub = bucket & ((1 << SUB_BUCKET_BITS) - 1);
+  uint64_t base = (uint64_t)((1 << SUB_BUCKET_BITS) + sub) << shift;
+  return base + (1ULL << shift) - 1;
+}
+
+static IRAM_ATTR void atomic_min(uint32_t *target, uint32_t value) {
+  uint32_t current = __atomic_load_n(target, __ATOMIC_RELAXED);
+  while (value < current &&
+         !__atomic_compare_exchange_n(target, &current, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+static IRAM_ATTR void atomic_max(uint32_t *target, uint32_t value) {
+  uint32_t current = __atomic_load_n(target, __ATOMIC_RELAXED);
+  while (value > current &&
+         !__atomic_compare_exchange_n(target, &current, value, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void IRAM_ATTR trace_record(enum trace_point point, int64_t origin_us) {
+  int64_t now = hal_time_us();
+  int64_t latency = now - origin_us;
+  uint32_t latency_us = latency < 0 ? 0 : latency > UINT32_MAX ? UINT32_MAX
+                                                               : latency;
+
+  trace_ring *ring = &rings[hal_core_id() % TRACE_CORES];
+  uint32_t slot = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+  ring->entries[slot % TRACE_RING_SIZE] = (trace_entry){
+      .timestamp_us = now,
+      .latency_us = latency_us,
+      .point = point,
+      .sequence = slot,
+  };
+
+  trace_histogram *histogram = &histograms[point];
+  if (__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED) == 0) {
+    // First sample, min starts out as 0 from the reset
+    __atomic_store_n(&histogram->min_us, latency_us, __ATOMIC_RELAXED);
+  } else {
+    atomic_min(&histogram->min_us, latency_us);
+  }
+  atomic_max(&histogram->max_us, latency_us);
+  uint32_t low = __atomic_fetch_add(&histogram->total_low_us, latency_us,
+                                    __ATOMIC_RELAXED);
+  if (low + latency_us < low) {
+    __atomic_fetch_add(&histogram->total_high_us, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_add(&histogram->buckets[bucket_of(latency_us)], 1,
+                     __ATOMIC_RELAXED);
+}
+
+const char *trace_point_name(enum trace_point point) {
+  return POINT_NAMES[point];
+}
+
+void trace_get_stats(enum trace_point point, trace_stats *stats) {
+  const trace_histogram *histogram = &histograms[point];
+  uint32_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+
+  memset(stats, 0, sizeof(*stats));
+  stats->count = count;
+  if (count == 0) {
+    return;
+  }
+
+  stats->min_us = histogram->min_us;
+  stats->max_us = histogram->max_us;
+  // A carry still on its way may be missed, which is fine for a diagnostic
+  uint64_t total = (uint64_t)histogram->total_high_us << 32 |
+                   histogram->total_low_us;
+  stats->avg_us = total / count;
+
+  uint32_t rank = count - count / 100;
+  uint32_t seen = 0;
+  for (int bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+    seen += histogram->buckets[bucket];
+    if (seen >= rank) {
+      stats->p99_us = bucket_upper_bound(bucket);
+      break;
+    }
+  }
+  if (stats->p99_us > stats->max_us) {
+    stats->p99_us = stats->max_us;
+  }
+}
+
+void trace_reset() {
+  memset(histograms, 0, sizeof(histograms));
+}
+
+size_t trace_copy_entries(int core, trace_entry *out, size_t max_entries) {
+  const trace_ring *ring = &rings[core];
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint32_t available = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+  if (available > max_entries) {
+    available = max_entries;
+  }
+
+  for (uint32_t i = 0; i < available; i++) {
+    out[i] = ring->entries[(head - available + i) % TRACE_RING_SIZE];
+  }
+  return available;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reaction latency tracing
+//
+// Each trace point records how long after its origin it happened: the echo
+// edge timestamp for sensor-driven work, the WebSocket frame arrival for
+// remote-driven work, or when a speed loop tick was due. Records go into a
+// lock-free ring per core, and every point keeps a latency histogram for
+// min/avg/p99/max reporting.
+
+// Echo edges are timestamped in their ISR, so the first point after one is
+// the ultrasonic task picking it up
+enum trace_point {
+  trace_echo_dequeue,    // echo edge picked up by the ultrasonic task
+  trace_sensor_decision, // autonomous loop evaluated a new reading
+  trace_sensor_motor,    // motors written in response to a reading
+  trace_ws_recv,         // WebSocket frame read by its handler
+  trace_remote_decision, // controller applied a remote event
+  trace_remote_motor,    // motors written in response to a remote event
+  trace_ws_send,         // WebSocket response sent
+  trace_motor_tick,      // speed loop tick handled by the motor task
+  TRACE_POINT_COUNT,
+};
+
+#define TRACE_RING_SIZE 256
+#define TRACE_CORES 2
+
+typedef struct {
+  uint32_t timestamp_us;
+  uint32_t latency_us;
+  uint16_t point;
+  uint16_t sequence;
+} trace_entry;
+
+typedef struct {
+  uint32_t count;
+  uint32_t min_us;
+  uint32_t avg_us;
+  uint32_t p99_us;
+  uint32_t max_us;
+} trace_stats;
+
+// Safe to call from ISRs and any task
+void trace_record(enum trace_point point, int64_t origin_us);
+
+const char *trace_point_name(enum trace_point point);
+void trace_get_stats(enum trace_point point, trace_stats *stats);
+// Clear every histogram. Samples recorded meanwhile may be partly lost.
+void trace_reset();
+
+// Copy the ring of one core into out, oldest first. Entries being written
+// concurrently may be torn, which is acceptable for a diagnostic dump.
+size_t trace_copy_entries(int core, trace_entry *out, size_t max_entries);
@@ -1,121 +1,283 @@
+#include <math.h>
+
 #include "esp_log.h"
-#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/task.h"
+#include "sdkconfig.h"
 
 #include "controller.h"
+#include "deferred_log.h"
+#include "hal.h"
+#include "params.h"
+#include "power.h"
+#include "tasks.h"
+#include "trace.h"
 #include "ultrasonic.h"
 
-#define ESP_INTR_FLAG_DEFAULT 0
-
 static const char *TAG = "robot-ultrasonic";
 
-// Select pin number as a GPIO and set it to output mode
-static void initialize_output_gpio(int pin_number) {
-  gpio_pad_select_gpio(pin_number);
-  gpio_set_direction(pin_number, GPIO_MODE_OUTPUT);
+static const float CM_ROUNDTRIP_US = 58;
+
+// Longest echo pulse the sensor produces, including the no-target pulse
+#define ECHO_TIMEOUT_MS 40
+
+// The pause between slots adapts to how much fresh readings matter. Moving
+// fast or near something, slots run back to back with only the guard time
+// (see params.h) in between. Cruising in open space they are spaced out a
+// little, and with the wheels stopped they back off to a slow idle rate. In
+// mode_off nothing can drive until the mode changes, so they only keep the
+// readings from going stale.
+#define NEAR_CM 100
+#define FAST_SPEED 50
+#define CRUISE_PAUSE_MS 30
+#define IDLE_PAUSE_MS 100
+#define OFF_PAUSE_MS 250
+// Speeds below this count as stopped
+#define STOPPED_SPEED 1
+
+#define SENSOR_BIT(position) (1 << (position))
+
+// Sensors fired together in each slot of the trigger schedule. Sensors with
+// overlapping beams never share a slot, so none can hear another's ping. The
+// front sensor gets every other slot since it decides when we stop.
+static const uint32_t trigger_schedule[] = {
+    SENSOR_BIT(sensor_front) | SENSOR_BIT(sensor_rear),
+    SENSOR_BIT(sensor_front_left),
+    SENSOR_BIT(sensor_front),
+    SENSOR_BIT(sensor_front_right),
+};
+
+#define SCHEDULE_SLOTS (sizeof(trigger_schedule) / sizeof(trigger_schedule[0]))
+
+_Static_assert(ULTRASONIC_STALE_MS >=
+                   2 * SCHEDULE_SLOTS * (ECHO_TIMEOUT_MS + IDLE_PAUSE_MS),
+               "healthy sensors would be reported stale");
+_Static_assert(ULTRASONIC_STALE_MS >=
+                   SCHEDULE_SLOTS * (ECHO_TIMEOUT_MS + OFF_PAUSE_MS),
+               "healthy sensors would go stale in mode_off");
+
+// The front sensor decides when to brake, so it also tracks how fast we are
+// closing in on whatever is ahead
+static const filter_stage front_stages[] = {
+    {.type = filter_reject,
+     .reject = {.min_cm = 2,
+                .max_cm = ULTRASONIC_MAX_RANGE_CM,
+                .max_jump_cm = 100}},
+    {.type = filter_median, .median = {.taps = 3}},
+    {.type = filter_alpha_beta,
+     .alpha_beta = {.alpha = 0.5,
+                    .beta = 0.1,
+                    .max_cm = ULTRASONIC_MAX_RANGE_CM,
+                    .max_gap_ms = ULTRASONIC_STALE_MS}},
+};
+
+static const filter_stage side_stages[] = {
+    {.type = filter_reject,
+     .reject = {.min_cm = 2,
+                .max_cm = ULTRASONIC_MAX_RANGE_CM,
+                .max_jump_cm = 100}},
+    {.type = filter_median, .median = {.taps = 3}},
+    {.type = filter_ema, .ema = {.alpha = 0.5}},
+};
+
+static const filter_stage rear_stages[] = {
+    {.type = filter_reject,
+     .reject = {.min_cm = 2,
+                .max_cm = ULTRASONIC_MAX_RANGE_CM,
+                .max_jump_cm = 100}},
+    {.type = filter_median, .median = {.taps = 3}},
+};
+
+#define FILTER(stages)                                                         \
+  (&(const filter_config){stages, sizeof(stages) / sizeof(stages[0])})
+
+const ultrasonic_mount ultrasonic_mounts[SENSOR_COUNT] = {
+    [sensor_front] = {.trig = 25,
+                      .echo = 33,
+                      .angle = 0,
+                      .filter = FILTER(front_stages)},
+    [sensor_front_left] = {.trig = 16,
+                           .echo = 34,
+                           .angle = M_PI_4,
+                           .filter = FILTER(side_stages)},
+    [sensor_front_right] = {.trig = 17,
+                            .echo = 35,
+                            .angle = -M_PI_4,
+                            .filter = FILTER(side_stages)},
+    [sensor_rear] = {.trig = 18,
+                     .echo = 32,
+                     .angle = M_PI,
+                     .filter = FILTER(rear_stages)},
+};
+
+typedef struct {
+  enum sensor_position position;
+  const ultrasonic_mount *mount;
+  enum { idle, triggered, reading } state;
+  // When the current read was triggered. Edges from before it belong to an
+  // earlier read that timed out and are ignored.
+  int64_t triggered_at;
+  int64_t pulse_start;
+  distance_filter filter;
+  // Echo time of the last reading published
+  int64_t published_at;
+  // Already logged as silent
+  bool silent;
+  int idx;
+  int last_printed;
+} ultrasonic_sensor;
+
+static ultrasonic_sensor sensors[SENSOR_COUNT];
+// Echo events from every sensor, in the order they happened
+static xQueueHandle echo_events;
+// The poll_distance task, woken as each sensor in a slot finishes
+static TaskHandle_t scheduler_task;
+
+// Let the scheduler know this sensor is free to fire again
+static void finish_read(ultrasonic_sensor *sensor) {
+  sensor->state = idle;
+  xTaskNotify(scheduler_task, SENSOR_BIT(sensor->position), eSetBits);
 }
 
-// Select pin number as a GPIO and set it to output mode
-static void initialize_input_gpio(int pin_number) {
-  gpio_pad_select_gpio(pin_number);
-  gpio_set_direction(pin_number, GPIO_MODE_INPUT);
+// Publish a completed echo to the controller
+static void record_distance(ultrasonic_sensor *sensor, float pulse_us,
+                            int64_t timestamp) {
+  float distance = pulse_us / CM_ROUNDTRIP_US;
+  if (!distance_filter_push(&sensor->filter, distance, timestamp)) {
+    return;
+  }
+
+  controller_publish_distance(sensor->position, sensor->filter.distance,
+                              sensor->filter.velocity, timestamp);
+  sensor->published_at = timestamp;
+
+  if ((sensor->idx - sensor->last_printed) >= 10) {
+    DLOGI(TAG, "Sensor %d raw: %f filtered: %f rate: %f", sensor->position,
+          distance, sensor->filter.distance, sensor->filter.velocity);
+    sensor->last_printed = sensor->idx;
+  }
 }
 
-#define RING_BUFFER_SIZE 3
+#if CONFIG_ROBOT_ULTRASONIC_MCPWM_CAPTURE
+
+// The capture unit measures the pulse in hardware, so the task only ever sees
+// completed measurements
 typedef struct {
-  float values[RING_BUFFER_SIZE];
-  int current_index;
-} ring_buffer;
+  ultrasonic_sensor *sensor;
+  uint32_t width_ns;
+  int64_t timestamp;
+} echo_event;
 
-void ring_buffer_push(ring_buffer *buffer, float value) {
-  buffer->current_index = (buffer->current_index + 1) % RING_BUFFER_SIZE;
+static bool IRAM_ATTR capture_isr_handler(void *arg, uint32_t width_ns,
+                                          int64_t timestamp) {
+  echo_event event = {.sensor = (ultrasonic_sensor *)arg,
+                      .width_ns = width_ns,
+                      .timestamp = timestamp};
 
-  buffer->values[buffer->current_index] = value;
+  // The capture interrupt yields on our behalf
+  BaseType_t woken = pdFALSE;
+  xQueueSendFromISR(echo_events, &event, &woken);
+  return woken == pdTRUE;
 }
 
-float median_of(float a, float b, float c) {
-  int x = a - b;
-  int y = b - c;
-  int z = a - c;
-  if (x * y > 0)
-    return b;
-  if (x * z > 0)
-    return c;
-  return a;
+static void process_echo_events(void *arg) {
+  echo_event event;
+
+  for (;;) {
+    if (xQueueReceive(echo_events, &event, portMAX_DELAY)) {
+      ultrasonic_sensor *sensor = event.sensor;
+      sensor->idx++;
+      trace_record(trace_echo_dequeue, event.timestamp);
+
+      int64_t rise = event.timestamp - event.width_ns / 1000;
+      if (rise < sensor->triggered_at) {
+        continue;
+      }
+
+      if (sensor->state == triggered) {
+        record_distance(sensor, event.width_ns / 1000.0f, event.timestamp);
+      }
+      finish_read(sensor);
+    }
+  }
 }
 
-float ring_buffer_median(ring_buffer *buffer) {
-  return median_of(buffer->values[0], buffer->values[1], buffer->values[2]);
+static void attach_echo_handler(ultrasonic_sensor *sensor) {
+  ESP_ERROR_CHECK(
+      hal_pulse_capture_add(sensor->mount->echo, capture_isr_handler, sensor));
 }
 
+// Each read produces one event
+#define ECHO_EVENTS_PER_READ 1
+
+#else
+
 typedef struct {
-  gpio_num_t pin;
+  ultrasonic_sensor *sensor;
   int64_t timestamp;
-} gpio_event;
+} echo_event;
 
 static void IRAM_ATTR gpio_isr_handler(void *arg) {
-  ultrasonic_sensor *sensor = (ultrasonic_sensor *)arg;
-  gpio_event event = {.pin = sensor->echo, .timestamp = esp_timer_get_time()};
+  echo_event event = {.sensor = (ultrasonic_sensor *)arg,
+                      .timestamp = hal_time_us()};
 
-  xQueueSendFromISR(sensor->event_queue, &event, NULL);
+  // Switch straight to the echo task rather than at the next tick
+  BaseType_t woken = pdFALSE;
+  xQueueSendFromISR(echo_events, &event, &woken);
+  if (woken == pdTRUE) {
+    portYIELD_FROM_ISR();
+  }
 }
 
-static const float CM_ROUNDTRIP_US = 58;
-
-static void process_gpio_events(void *arg) {
-  ultrasonic_sensor *sensor = (ultrasonic_sensor *)arg;
-  gpio_event event;
-  int64_t pulse_start = 0;
-  ring_buffer running_average = {};
-  int idx = 0;
-  int last_printed = -10;
+static void process_echo_events(void *arg) {
+  echo_event event;
 
   for (;;) {
-    if (xQueueReceive(sensor->event_queue, &event, portMAX_DELAY)) {
-      idx++;
-      int pin_state = gpio_get_level(event.pin);
+    if (xQueueReceive(echo_events, &event, portMAX_DELAY)) {
+      ultrasonic_sensor *sensor = event.sensor;
+      sensor->idx++;
+      trace_record(trace_echo_dequeue, event.timestamp);
+      if (event.timestamp < sensor->triggered_at) {
+        continue;
+      }
+      int pin_state = hal_gpio_get_level(sensor->mount->echo);
 
       if (pin_state == 1 && sensor->state == triggered) {
         sensor->state = reading;
-        pulse_start = event.timestamp;
+        sensor->pulse_start = event.timestamp;
       } else if (pin_state == 0 && sensor->state == reading) {
-        sensor->state = idle;
-        float distance = (event.timestamp - pulse_start) / CM_ROUNDTRIP_US;
-        ring_buffer_push(&running_average, distance);
-        float median = ring_buffer_median(&running_average);
-        global_controller.front_distance = median;
-
-        if ((idx - last_printed) >= 10) {
-          ESP_LOGI(TAG, "Raw: %f Running Median: %f", distance, median);
-          last_printed = idx;
-        }
+        record_distance(sensor, event.timestamp - sensor->pulse_start,
+                        event.timestamp);
+        finish_read(sensor);
       } else {
-        /* ESP_LOGW(TAG, "Sensor is in invalid state: pin = %d, state = %d", */
-        /*          pin_state, sensor->state); */
-        sensor->state = idle; // Reset to default state
+        finish_read(sensor); // Reset to default state
       }
     }
   }
 }
 
-static void initialize_ultrasonic_sensor(ultrasonic_sensor *sensor,
-                                         gpio_num_t trig, gpio_num_t echo) {
-  sensor->trig = trig;
-  sensor->echo = echo;
-  sensor->event_queue = xQueueCreate(3, sizeof(gpio_event));
-  sensor->state = idle;
+static void attach_echo_handler(ultrasonic_sensor *sensor) {
+  hal_gpio_isr_add(sensor->mount->echo, gpio_isr_handler, (void *)sensor);
+}
 
-  initialize_output_gpio(trig);
-  gpio_set_level(trig, 0);
+// Rising and falling edge
+#define ECHO_EVENTS_PER_READ 2
 
-  xTaskCreate(process_gpio_events, "process_gpio_events", 2048, (void *)sensor,
-              10, NULL);
+#endif
+
+static void initialize_ultrasonic_sensor(ultrasonic_sensor *sensor,
+                                         enum sensor_position position) {
+  sensor->position = position;
+  sensor->mount = &ultrasonic_mounts[position];
+  sensor->state = idle;
+  sensor->last_printed = -10;
+  distance_filter_init(&sensor->filter, sensor->mount->filter);
 
-  initialize_input_gpio(echo);
-  gpio_set_intr_type(echo, GPIO_INTR_ANYEDGE);
-  gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
+  hal_gpio_output(sensor->mount->trig);
+  hal_gpio_set_level(sensor->mount->trig, 0);
+  hal_gpio_input(sensor->mount->echo);
+  attach_echo_handler(sensor);
 }
 
 // Sleep for the specified number of microseconds
@@ -124,35 +286,133 @@ static void delay_usecs(int usecs) {
   vTaskDelay(delay_msecs / portTICK_PERIOD_MS);
 }
 
-#define timeout_expired(start, time) ((esp_timer_get_time() - start) >= time)
-
 // Initiate cycle on trigger pin which will then trigger interrupts on our
-// echo pin
-static void trigger_read(ultrasonic_sensor *sensor) {
-  if (sensor->state == idle) {
-    // Set trigger high for 10 microseconds, then low to start cycle
-    ESP_ERROR_CHECK(gpio_set_level(sensor->trig, 1));
-    delay_usecs(10);
-    ESP_ERROR_CHECK(gpio_set_level(sensor->trig, 0));
-    sensor->state = triggered;
+// echo pin. Returns false if the sensor couldn't be fired.
+static bool trigger_read(ultrasonic_sensor *sensor) {
+  if (sensor->state != idle) {
+    ESP_LOGW(TAG, "Sensor %d is not idle, skipping read. State: %i",
+             sensor->position, sensor->state);
+    return false;
+  }
+  // Still sending the pulse of a read that timed out, it won't hear a new
+  // trigger until that ends
+  if (hal_gpio_get_level(sensor->mount->echo) == 1) {
+    DLOGW(TAG, "Sensor %d echo still high, skipping read", sensor->position);
+    return false;
+  }
+
+  sensor->triggered_at = hal_time_us();
+  sensor->state = triggered;
+  // Set trigger high for 10 microseconds, then low to start cycle
+  ESP_ERROR_CHECK(hal_gpio_set_level(sensor->mount->trig, 1));
+  delay_usecs(10);
+  ESP_ERROR_CHECK(hal_gpio_set_level(sensor->mount->trig, 0));
+  return true;
+}
+
+// Log a sensor going silent, as the controller sees it, or coming back. Only
+// checked right after the sensor fired so a pause while idle doesn't count.
+static void check_silent(ultrasonic_sensor *sensor) {
+  bool silent =
+      hal_time_us() - sensor->published_at > ULTRASONIC_STALE_MS * 1000LL;
+  if (silent == sensor->silent) {
+    return;
+  }
+
+  sensor->silent = silent;
+  if (silent) {
+    DLOGW(TAG, "Sensor %d went silent", sensor->position);
   } else {
-    ESP_LOGW(TAG, "Sensor is not idle, skipping read. State: %i",
-             sensor->state);
+    DLOGI(TAG, "Sensor %d is back", sensor->position);
+  }
+}
+
+// Fire every sensor in the slot and wait until they have all heard their
+// echo, or given up on it
+static void run_slot(uint32_t slot) {
+  // Drop completions left over from reads that already timed out
+  xTaskNotifyWait(0, UINT32_MAX, NULL, 0);
+
+  uint32_t pending = 0;
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    if ((slot & SENSOR_BIT(i)) && trigger_read(&sensors[i])) {
+      pending |= SENSOR_BIT(i);
+    }
+  }
+
+  TickType_t start = xTaskGetTickCount();
+  TickType_t timeout = pdMS_TO_TICKS(ECHO_TIMEOUT_MS);
+  while (pending != 0) {
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    uint32_t finished = 0;
+    if (elapsed >= timeout ||
+        !xTaskNotifyWait(0, UINT32_MAX, &finished, timeout - elapsed)) {
+      break;
+    }
+    pending &= ~finished;
+  }
+
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    if ((pending & SENSOR_BIT(i)) && sensors[i].state != idle) {
+      DLOGW(TAG, "Sensor %d echo timed out", i);
+      sensors[i].state = idle;
+    }
+    if (slot & SENSOR_BIT(i)) {
+      check_silent(&sensors[i]);
+    }
   }
 }
 
-#define TRIG_GPIO 25
-#define ECHO_GPIO 33
+// Time to wait before the next slot. Never less than the guard time, which
+// lets stray reflections die down before the next sensor fires.
+static int slot_pause_ms() {
+  int guard_ms = param_get_int(param_slot_guard_ms);
+
+  controller_snapshot now;
+  controller_read_snapshot(&now);
+  if (now.remote.mode == mode_off) {
+    return fmaxf(guard_ms, OFF_PAUSE_MS);
+  }
+
+  float speed = fmaxf(fmaxf(fabsf(now.left_speed), fabsf(now.right_speed)),
+                      fmaxf(fabsf(now.left_target), fabsf(now.right_target)));
+  if (speed < STOPPED_SPEED) {
+    return fmaxf(guard_ms, IDLE_PAUSE_MS);
+  }
+
+  const float *distances = now.sensors.distances;
+  float nearest = fminf(
+      fminf(distances[sensor_front], distances[sensor_rear]),
+      fminf(distances[sensor_front_left], distances[sensor_front_right]));
+  if (speed >= FAST_SPEED || nearest < NEAR_CM) {
+    return guard_ms;
+  }
+  return fmaxf(guard_ms, CRUISE_PAUSE_MS);
+}
 
 void poll_distance() {
-  ultrasonic_sensor sensor = {};
-  initialize_ultrasonic_sensor(&sensor, TRIG_GPIO, ECHO_GPIO);
+  scheduler_task = xTaskGetCurrentTaskHandle();
+  echo_events =
+      xQueueCreate(SENSOR_COUNT * ECHO_EVENTS_PER_READ, sizeof(echo_event));
+  task_start(task_echo_events, process_echo_events, NULL);
 
-  gpio_isr_handler_add(sensor.echo, gpio_isr_handler, (void *)&sensor);
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    initialize_ultrasonic_sensor(&sensors[i], i);
+  }
 
-  while (true) {
-    vTaskDelay(100 / portTICK_PERIOD_MS);
+  for (int slot = 0;; slot = (slot + 1) % SCHEDULE_SLOTS) {
+    run_slot(trigger_schedule[slot]);
+    vTaskDelay(pdMS_TO_TICKS(slot_pause_ms()));
+
+    // Nothing to look out for while the robot idles
+    while (power_idle()) {
+      xTaskNotifyWait(0, UINT32_MAX, NULL, portMAX_DELAY);
+    }
+  }
+}
 
-    trigger_read(&sensor);
+void ultrasonic_wake() {
+  if (scheduler_task != NULL) {
+    xTaskNotify(scheduler_task, 0, eNoAction);
   }
 }
@@ -1,14 +1,35 @@
 #pragma once
 
 #include "driver/gpio.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
 
+#include "controller.h"
+#include "distance_filter.h"
+
+// Beyond this the sensor is unreliable, treat it as open space
+#define ULTRASONIC_MAX_RANGE_CM 400
+
+// A sensor without a reading for this long is taken to be unplugged or
+// silent. A couple of full schedule cycles even at the slowest slot rate.
+#define ULTRASONIC_STALE_MS 1200
+
+// Where each sensor is wired and which way it faces
 typedef struct {
   gpio_num_t trig;
   gpio_num_t echo;
-  xQueueHandle event_queue;
-  enum { idle, triggered, reading } state;
-} ultrasonic_sensor;
+  // Direction the beam points relative to the robot's heading, in radians
+  // counter-clockwise
+  float angle;
+  // How raw readings are cleaned up before reaching the controller
+  const filter_config *filter;
+} ultrasonic_mount;
 
+// Indexed by enum sensor_position
+extern const ultrasonic_mount ultrasonic_mounts[SENSOR_COUNT];
+
+// Runs forever, firing the sensors on an interleaved schedule and publishing
+// each reading with controller_publish_distance(). Pauses between slots
+// while power_idle().
 void poll_distance();
+
+// Resume polling once the robot is no longer idle
+void ultrasonic_wake();